@@ -1,44 +1,126 @@
-#pragma once
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
 
+#pragma once
 
-#include <nori/mesh.h>
+#include <nori/accel.h>
 
 NORI_NAMESPACE_BEGIN
 
-// KdTreeAccel Declarations
-struct KdAccelNode;
-struct BoundEdge;
-class KdTree{
-  public:
-    // KdTreeAccel Public Methods
-    KdTree(Mesh *mesh, int isectCost = 80, int traversalCost = 1,
-                float emptyBonus = 0.5, int maxPrims = 1, int maxDepth = -1);
-    Bounds3f WorldBound() const { return bounds; }
-    ~KdTree();
-    bool Intersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const;
-    bool IntersectP(const Ray &ray) const;
-
-  private:
-    // KdTreeAccel Private Methods
-    void buildTree(int nodeNum, const BoundingBox3f &bounds,
-                   const std::vector<BoundingBox3f> &primBounds, int *primNums,
-                   int nprims, int depth,
-                   const std::unique_ptr<BoundEdge[]> edges[3], int *prims0,
-                   int *prims1, int badRefines = 0);
-
-    // KdTreeAccel Private Data
-    const int isectCost, traversalCost, maxPrims;
-    const float emptyBonus;
-    Mesh *mesh;
-    std::vector<int> primitiveIndices;
-    KdAccelNode *nodes;
-    int nAllocedNodes, nextFreeNode;
-    BoundingBox3f bounds;
+/**
+ * \brief Node of the kd-tree, packed into 8 bytes
+ *
+ * The lower two bits of \c flags hold the split axis of an interior node,
+ * or 3 for a leaf. The remaining bits store the index of the child above
+ * the splitting plane (the child below it directly follows its parent),
+ * or the number of triangles of a leaf.
+ */
+struct KdTreeNode {
+    union {
+        /// Interior node: position of the splitting plane
+        float split;
+        /// Leaf with a single triangle: its global primitive ID
+        uint32_t onePrim;
+        /// Leaf with several triangles: first entry in the primitive index array
+        uint32_t primOffset;
+    };
+    uint32_t flags;
+
+    void initLeaf(uint32_t primCount, uint32_t prim) {
+        flags = 3 | (primCount << 2);
+        onePrim = prim;
+    }
+
+    void initInterior(int axis, uint32_t aboveChild, float pos) {
+        flags = (uint32_t) axis | (aboveChild << 2);
+        split = pos;
+    }
+
+    bool isLeaf() const { return (flags & 3) == 3; }
+    int getAxis() const { return (int) (flags & 3); }
+    uint32_t getPrimCount() const { return flags >> 2; }
+    uint32_t getAboveChild() const { return flags >> 2; }
 };
 
-struct KdToDo {
-    const KdAccelNode *node;
-    float tMin, tMax;
+static_assert(sizeof(KdTreeNode) == 8, "KdTreeNode should occupy 8 bytes");
+
+/**
+ * \brief SAH kd-tree over the triangles of several meshes (\c &lt;accel type="kdtree"&gt;)
+ *
+ * An alternative to the \ref BVH that splits space instead of the set of
+ * triangles, following the kd-tree of PBRT (Pharr et al., 3rd ed., Sec. 4.4).
+ * The construction uses the O(N log N) algorithm by Wald and Havran [2006]:
+ * the start and end events of all triangle bounds are sorted once per axis,
+ * and every node splits its sorted event lists between its children in
+ * linear time, hence no node sorts anything. All three axes are evaluated
+ * in each node.
+ *
+ * Rays traverse the tree front to back using an explicit stack, and stop
+ * as soon as the closest intersection lies before the next node.
+ *
+ * Parameters:
+ * - \c intersectionCost: SAH cost of a ray-triangle test, relative to
+ *   \c traversalCost (80)
+ * - \c traversalCost: SAH cost of visiting an interior node (1)
+ * - \c emptyBonus: reduction of the SAH cost of splits that cut off empty
+ *   space (0.5)
+ * - \c maxLeafSize: number of triangles below which nodes are never split (1)
+ * - \c maxDepth: maximum depth of the tree, chosen based on the number of
+ *   triangles if not specified
+ */
+class KdTree : public Accel {
+public:
+    KdTree(const PropertyList &props);
+
+    /// Build the kd-tree over all registered meshes
+    void build(bool verbose = true) override;
+
+    /// Return the number of nodes of the tree
+    size_t getNodeCount() const override { return m_nodes.size(); }
+
+    /// Return the number of bytes taken by the nodes and the primitive index array
+    size_t getMemoryUsage() const override {
+        return m_nodes.size() * sizeof(KdTreeNode) + m_indexes.size() * sizeof(uint32_t);
+    }
+
+    /// Return a human-readable summary of the build parameters
+    std::string toString() const;
+
+protected:
+    bool traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const override;
+    bool occluded(const Ray3f &ray, uint32_t &prim) const override;
+
+private:
+    /// Find the closest intersection, or any intersection if \c ShadowRay is set (\c its is unused then)
+    template <bool ShadowRay> bool traverseTree(Ray3f &ray, Intersection *its, uint32_t &prim) const;
+
+    /// Start or end of the bounds of a triangle along one axis
+    struct Event;
+
+    /// Sorted event lists of a node along all three axes
+    typedef std::vector<Event> EventList[3];
+
+    /// Build the tree over the triangles of all registered meshes and return its maximum depth
+    int buildTriangles();
+
+    /// Build the subtree of a node that holds \c primCount triangles
+    void buildNode(const BoundingBox3f &bounds, EventList &events, uint32_t primCount,
+                   int depth, int badRefines);
+
+    float m_intersectionCost, m_traversalCost, m_emptyBonus;
+    uint32_t m_maxPrims;
+    int m_maxDepth;
+
+    /// Bounds of the root node
+    BoundingBox3f m_treeBounds;
+    std::vector<KdTreeNode> m_nodes;
+    /// Global primitive IDs of the leaves with more than one triangle
+    std::vector<uint32_t> m_indexes;
+    /// Side(s) of the splitting plane of each triangle, only needed during construction
+    std::vector<uint8_t> m_side;
 };
 
-NORI_NAMESPACE_END
\ No newline at end of file
+NORI_NAMESPACE_END
@@ -7,34 +7,232 @@
 #pragma once
 
 #include <nori/mesh.h>
-#include <queue>
-#include <utility>
+#include <nori/simd.h>
+#include <nori/mmap.h>
+#include <algorithm>
+#include <cstring>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
 /**
- * \brief Acceleration data structure for ray intersection queries
+ * \brief Node of the flattened bounding volume hierarchy
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * Nodes are stored in depth-first order in a single array. The two
+ * children of an interior node are always adjacent, hence only the index
+ * of the first one is stored. Leaves reference a contiguous range of the
+ * global primitive index array.
  */
-struct AccelNode
-{
-    uint32_t child = 0;
+struct BVHNode {
+    /// Bounds of all triangles below this node
     BoundingBox3f bbox;
-    std::vector<std::pair<uint32_t, uint32_t>> indices;
+    union {
+        /// Leaf node: first entry in the primitive index array
+        uint32_t primOffset;
+        /// Interior node: index of the first child (the second one follows it)
+        uint32_t child;
+    };
+    /// Number of triangles in a leaf node (zero for interior nodes)
+    uint16_t primCount;
+    /// Split axis of an interior node
+    uint8_t axis;
+    uint8_t unused;
+
+    bool isLeaf() const { return primCount > 0; }
+};
 
-    AccelNode() : bbox() {}
+static_assert(sizeof(BVHNode) == 32, "BVHNode should occupy 32 bytes");
 
-    explicit AccelNode(BoundingBox3f box)
-        : bbox(std::move(box)) {}
+/**
+ * \brief Node of the collapsed, \c Width-ary bounding volume hierarchy
+ *
+ * The bounds of the children are quantized to 8 bits relative to the
+ * bounds of the node itself: a child extends over whole cells of a grid
+ * with power-of-two spacing, whose origin is the minimum of the node
+ * bounds. The quantized bounds are rounded outwards, hence they always
+ * contain the child. As the grid spacing is a power of two, a kernel
+ * reproduces the decoded bounds exactly, no matter whether it fuses the
+ * multiply-add or not.
+ *
+ * The bounds are stored in SoA layout, hence a SIMD kernel can test a ray
+ * against all children at once. A 4-ary node occupies a single cache line,
+ * an 8-ary node two of them (the first one holds all bounds). Unused child
+ * slots have inverted bounds that no ray can intersect.
+ */
+template <int Width> struct alignas(64) WideBVHNode {
+    /// Origin of the quantization grid
+    float origin[3];
+    /// Grid spacing along x/y/z, stored as a power-of-two exponent
+    int8_t scaleExp[3];
+    uint8_t unused;
+    /// Child bounds in grid cells: rows 0-2 hold the minima along x/y/z, rows 3-5 the maxima
+    uint8_t bounds[6][Width];
+    /// Interior children: node index. Leaf children: first triangle packet
+    uint32_t child[Width];
+    /// Number of triangle packets of leaf children (zero for interior children)
+    uint16_t count[Width];
+
+    /// Return the grid spacing along \c axis
+    float getScale(int axis) const {
+        uint32_t bits = (uint32_t) (scaleExp[axis] + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(float));
+        return scale;
+    }
+
+    /// Decode the bounds of child \c i
+    BoundingBox3f getChildBounds(int i) const {
+        BoundingBox3f bbox;
+        for (int axis = 0; axis < 3; ++axis) {
+            float scale = getScale(axis);
+            bbox.min[axis] = origin[axis] + bounds[axis][i] * scale;
+            bbox.max[axis] = origin[axis] + bounds[axis + 3][i] * scale;
+        }
+        return bbox;
+    }
+
+    /**
+     * \brief Quantize the bounds of all children
+     *
+     * Invalid boxes (see \ref BoundingBox3f::isValid()) mark unused slots
+     */
+    void setChildBounds(const BoundingBox3f *childBounds) {
+        BoundingBox3f bbox;
+        for (int i = 0; i < Width; ++i) {
+            if (childBounds[i].isValid())
+                bbox.expandBy(childBounds[i]);
+        }
 
-    AccelNode(BoundingBox3f box, uint32_t size)
-        : bbox(std::move(box)), indices(size) {}
+        for (int axis = 0; axis < 3; ++axis) {
+            /* Choose the finest grid whose 255 cells cover the node. The
+               range of the exponent keeps all products 'cell * scale' exact */
+            origin[axis] = bbox.isValid() ? bbox.min[axis] : 0.0f;
+            float extent = bbox.isValid() ? bbox.max[axis] - origin[axis] : 0.0f;
+            int exp = -126;
+            if (extent > 0) {
+                std::frexp(extent / 255.0f, &exp);
+                exp = std::max(exp, -126);
+            }
+            while (exp < 119 && origin[axis] + 255 * std::ldexp(1.0f, exp) < bbox.max[axis])
+                ++exp;
+            scaleExp[axis] = (int8_t) exp;
+            float scale = getScale(axis);
+
+            for (int i = 0; i < Width; ++i) {
+                if (!childBounds[i].isValid()) {
+                    bounds[axis][i] = 255;
+                    bounds[axis + 3][i] = 0;
+                    continue;
+                }
+
+                /* Round outwards, and correct for the rounding of the decoding */
+                float lo = childBounds[i].min[axis], hi = childBounds[i].max[axis];
+                int qlo = std::min(std::max((int) std::floor((lo - origin[axis]) / scale), 0), 255);
+                int qhi = std::min(std::max((int) std::ceil((hi - origin[axis]) / scale), 0), 255);
+                while (qlo > 0 && origin[axis] + qlo * scale > lo)
+                    --qlo;
+                while (qhi < 255 && origin[axis] + qhi * scale < hi)
+                    ++qhi;
+                bounds[axis][i] = (uint8_t) qlo;
+                bounds[axis + 3][i] = (uint8_t) qhi;
+            }
+        }
+    }
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 64, "4-ary nodes should occupy a single cache line");
+static_assert(sizeof(WideBVHNode<8>) == 128, "8-ary nodes should occupy two cache lines");
+
+/**
+ * \brief Group of \c Width triangles of a leaf, stored in SoA layout
+ *
+ * Leaves own a copy of their triangles, hence the intersection kernel tests
+ * a whole packet without going through the index buffers of the meshes.
+ * The vertices are stored instead of precomputed edges: the watertight test
+ * needs positions that are bit-identical between neighboring triangles.
+ * Unused lanes of the last packet of a leaf hold NaN vertices.
+ */
+template <int Width> struct alignas(64) TrianglePacket {
+    /// Vertex positions, indexed by [vertex][axis][lane]
+    float p[3][3][Width];
+    /// Global primitive ID of each triangle (see \ref Accel::findMesh())
+    uint32_t prim[Width];
 };
 
-class Accel {
+/**
+ * \brief Array of tree nodes or triangle packets that is used for traversal
+ *
+ * The elements are either owned by the array (after a build) or live in
+ * memory that is owned by someone else, e.g. a memory-mapped cache file.
+ */
+template <typename T> class AccelBuffer {
 public:
+    AccelBuffer() = default;
+    AccelBuffer(const AccelBuffer &) = delete;
+    AccelBuffer &operator=(const AccelBuffer &) = delete;
+
+    /// Take over the elements of a vector
+    void assign(std::vector<T> &&values) {
+        m_owned = std::move(values);
+        m_data = m_owned.data();
+        m_size = m_owned.size();
+    }
+
+    /// Refer to \c size elements that are owned by someone else
+    void assign(T *data, size_t size) {
+        std::vector<T>().swap(m_owned);
+        m_data = data;
+        m_size = size;
+    }
+
+    /// Release all elements
+    void clear() { assign(nullptr, 0); }
+
+    T *data() const { return m_data; }
+    T &operator[](size_t i) const { return m_data[i]; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+private:
+    std::vector<T> m_owned;
+    T *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/**
+ * \brief Acceleration data structure for ray intersection queries
+ *
+ * Abstract interface of the data structures that index the triangles of a
+ * scene or shape group. Implementations are registered with the
+ * \ref NoriObjectFactory and chosen in the scene description, together
+ * with their build parameters:
+ *
+ * <pre>
+ * &lt;scene&gt;
+ *     &lt;accel type="kdtree"&gt;
+ *         &lt;float name="intersectionCost" value="80"/&gt;
+ *         &lt;integer name="maxDepth" value="24"/&gt;
+ *     &lt;/accel&gt;
+ *     ...
+ * </pre>
+ *
+ * Scenes and shape groups without an \c accel tag use a \ref BVH with its
+ * default parameters.
+ *
+ * The base class numbers the triangles of all registered meshes (see
+ * \ref findMesh()) and fills in the intersection record once a subclass
+ * has found the closest triangle. It also organizes instances of shape
+ * groups in a separate top-level binary BVH. Rays that reach an instance
+ * are transformed into the coordinate system of its group and traverse the
+ * group's own (bottom-level) structure, which may be of a different type.
+ *
+ * Shadow rays use a separate any-hit traversal (see \ref rayOccluded()).
+ */
+class Accel : public NoriObject {
+public:
+    /// Release all memory
+    virtual ~Accel() { }
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
@@ -43,8 +241,31 @@ public:
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
-    void build();
+    /**
+     * \brief Register an instance of a shape group
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void addInstance(const Instance *instance);
+
+    /**
+     * \brief Build the acceleration data structure
+     *
+     * Calling this function again discards the previous structure.
+     *
+     * \param verbose
+     *    Print statistics about the resulting structure
+     */
+    virtual void build(bool verbose = true) = 0;
+
+    /// Return the time in milliseconds taken by the last call to \ref build()
+    double getBuildTime() const { return m_buildTime; }
+
+    /// Return the number of nodes over the triangles of the registered meshes
+    virtual size_t getNodeCount() const = 0;
+
+    /// Return the number of bytes taken by the nodes and triangle references
+    virtual size_t getMemoryUsage() const = 0;
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
@@ -66,31 +287,498 @@ public:
      *    find out whether the ray is blocked or not without returning detailed
      *    intersection information.
      *
+     * \param attributes
+     *    Attributes of \c its that are computed right away (see
+     *    \ref Intersection::EAttribute); the others can be added later
+     *    using \ref Intersection::compute()
+     *
      * \return \c true if an intersection was found
      */
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay,
+                      uint32_t attributes = Intersection::EAllAttributes) const;
 
-    void divide(uint32_t n, std::vector<AccelNode>* children);
+    /**
+     * \brief Find the closest intersections of several independent rays
+     *
+     * Equivalent to calling the other \ref rayIntersect() for each ray,
+     * but the structure may trace the rays interleaved to hide the latency
+     * of memory accesses (see \ref BVH). Rays that do not hit anything
+     * leave \c its[i].mesh set to \c nullptr.
+     *
+     * \return The number of rays that hit a triangle
+     */
+    uint32_t rayIntersect(const Ray3f *rays, Intersection *its, uint32_t count,
+                          uint32_t attributes = Intersection::EAllAttributes) const;
 
-    bool traverse(uint32_t n, Ray3f& ray, Intersection& its, uint32_t& f, bool shadowRay) const;
+    /**
+     * \brief Check whether any triangle stored in the scene blocks a ray
+     *
+     * Consecutive shadow rays of a thread are often blocked by the same
+     * triangle, e.g. when they head towards the same area light. If the
+     * last shadow ray of the calling thread was blocked, the triangle that
+     * blocked it is therefore tested before the structure is traversed.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayOccluded(const Ray3f &ray) const;
 
-    std::pair<uint32_t, uint32_t> getLimits() const { return { 16, 12 };}
+    /**
+     * \brief Find the closest intersections of a stream of incoherent rays,
+     * such as the secondary rays of many paths
+     *
+     * Like the batch variant of \ref rayIntersect(), but the rays are first
+     * binned by the octant of their direction and sorted along a Morton
+     * curve through their origins. Rays that travel through the same part
+     * of the scene are then traced together and share the node fetches.
+     * The results are returned in the original order of the rays.
+     * Structures that are small enough to stay in the caches trace the
+     * rays one by one instead, since the sorting would not pay off.
+     *
+     * \return The number of rays that hit a triangle
+     */
+    uint32_t intersectStream(const Ray3f *rays, Intersection *its, uint32_t count,
+                             uint32_t attributes = Intersection::EAllAttributes) const;
 
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
+    /**
+     * \brief Check which rays of a stream of shadow rays are blocked
+     *
+     * The rays are reordered like in \ref intersectStream(). Unlike
+     * \ref rayOccluded(), no per-thread cache of the last occluder is
+     * used for large structures.
+     *
+     * \return The number of blocked rays
+     */
+    uint32_t occludedStream(const Ray3f *rays, bool *occluded, uint32_t count) const;
 
-    uint32_t getTotalTriangleCount() const { return m_indexes.size(); }
+    /// Return the total number of triangles over all registered meshes (excluding instances)
+    uint32_t getTotalTriangleCount() const { return m_meshOffset.back(); }
+
+    /**
+     * \brief Return the index of the mesh that contains a primitive
+     *
+     * Triangles are identified by a global primitive ID: the triangles of
+     * mesh \c i are numbered consecutively starting at \c m_meshOffset[i].
+     * The face index within the mesh is \c prim - \c m_meshOffset[i].
+     */
+    uint32_t findMesh(uint32_t prim) const {
+        return (uint32_t) (std::upper_bound(m_meshOffset.begin(), m_meshOffset.end(), prim)
+                           - m_meshOffset.begin()) - 1;
+    }
+
+    EClassType getClassType() const { return EAccel; }
+
+protected:
+    /**
+     * \brief Find the closest intersection with the triangles of the
+     * registered meshes
+     *
+     * Sets \c its.t and \c its.bary, shortens \c ray.maxt and stores the
+     * global primitive ID of the triangle in \c prim
+     */
+    virtual bool traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const = 0;
+
+    /**
+     * \brief Find any intersection with the triangles of the registered meshes
+     *
+     * Stops at the first triangle that blocks the ray and stores its global
+     * primitive ID in \c prim. Since the closest hit does not matter,
+     * nodes may be visited in any order that is cheap to determine.
+     */
+    virtual bool occluded(const Ray3f &ray, uint32_t &prim) const = 0;
+
+    /**
+     * \brief Find the closest intersections of several rays with the
+     * triangles of the registered meshes
+     *
+     * Like \ref traverse() for each ray, and sets \c prims[i] to
+     * <tt>(uint32_t) -1</tt> for rays that miss. The default
+     * implementation traces one ray after the other.
+     */
+    virtual void traverseBatch(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const;
+
+    /**
+     * \brief Find any intersection of several rays with the triangles of
+     * the registered meshes
+     *
+     * Like \ref occluded() for each ray, and sets \c prims[i] to
+     * <tt>(uint32_t) -1</tt> for rays that are not blocked. The default
+     * implementation traces one ray after the other.
+     */
+    virtual void occludedBatch(Ray3f *rays, uint32_t *prims, uint32_t count) const;
+
+    /// Build the top-level tree over all registered instances (called by \ref build())
+    void buildInstances();
+
+    /// Recompute the scene bounds and the bounds of the top-level tree after instances or meshes moved
+    void refitInstances();
+
+    /**
+     * \brief Find the closest intersection with an instance, or any
+     * intersection if \c ShadowRay is set (\c its is unused then)
+     *
+     * Like \ref traverse() and \ref occluded(), and additionally stores
+     * the index of the instance that was hit
+     */
+    template <bool ShadowRay> bool traverseInstances(Ray3f &ray, Intersection *its, uint32_t &prim,
+                                                     uint32_t &instance) const;
+
+    /// Instance index of triangles that are not part of an instance
+    static constexpr uint32_t NoInstance = (uint32_t) -1;
+
+    /// Fill in the hit handle of \c its and compute the requested attributes
+    void completeIntersection(Intersection &its, uint32_t prim, uint32_t instance, uint32_t attributes) const;
+
+    /// Copy the subtree below \c src into \c target in depth-first order and return its depth
+    template <typename NodeArray> static uint32_t flatten(const NodeArray &nodes, std::vector<BVHNode> &target,
+                                                          uint32_t src, uint32_t dst);
+
+    /// Maximum depth of all trees (also determines the size of the traversal stacks)
+    static constexpr uint32_t MaxDepth = 64;
 
-private:
     std::vector<Mesh*> m_meshes;
+    /// Prefix sum over the triangle counts of all meshes (one entry per mesh + 1)
+    std::vector<uint32_t> m_meshOffset { 0 };
     BoundingBox3f m_bbox;
-    std::vector<AccelNode> m_tree;
-    std::vector<std::pair<uint32_t, uint32_t>> m_indexes;
+    /// Instances of shape groups and the top-level tree over them
+    std::vector<const Instance *> m_instances;
+    std::vector<BVHNode> m_instanceNodes;
+    /// Instance indices ordered by the leaves of the top-level tree
+    std::vector<uint32_t> m_instanceIndexes;
+    double m_buildTime = 0;
+
+private:
+    /// Return a new unique ID (\ref m_id)
+    static uint64_t newId();
+
+    /// Identifies this structure in the per-thread cache of \ref rayOccluded()
+    const uint64_t m_id = newId();
+};
+
+/**
+ * \brief Bounding volume hierarchy (\c &lt;accel type="bvh"&gt;)
+ *
+ * The tree is constructed top-down using the surface area heuristic (SAH).
+ * Split candidates are evaluated on a fixed number of bins along each axis.
+ *
+ * The binary tree is then collapsed into a 4-ary (SSE2 or scalar code) or
+ * 8-ary tree (AVX2), depending on the widest kernel the processor supports.
+ * Leaves store their triangles in packets of the same width, which the
+ * kernel intersects at once using a watertight ray-triangle test.
+ *
+ * Building the tree over a large mesh takes much longer than reading it
+ * back, hence the collapsed tree can be stored in an on-disk cache (see
+ * \ref setCacheDirectory()). Cache files are keyed by a hash of the mesh
+ * data and the build parameters, and they are mapped into memory as is.
+ *
+ * Batches of rays (see \ref Accel::rayIntersect()) are traced in packets
+ * of neighboring rays with a shared origin, such as camera rays, which
+ * test each node once for the whole packet. Batches whose rays diverge
+ * quickly are traced interleaved instead.
+ *
+ * Parameters:
+ * - \c builder: \c "binned" (default) or \c "sbvh", which additionally
+ *   splits long, thin or overlapping triangles (e.g. in architecture)
+ * - \c duplicationBudget: additional triangle references that spatial
+ *   splits may create, relative to the number of triangles (0.3)
+ * - \c maxLeafSize: maximum number of triangles per leaf (8)
+ * - \c maxDepth: maximum depth of the binary tree (64)
+ * - \c traversalCost, \c intersectionCost: SAH costs of visiting a node
+ *   and of testing a triangle packet (1 and 1)
+ * - \c maxCostGrowth: SAH cost growth that makes \ref refit() rebuild
+ *   subtrees (1.2)
+ */
+class BVH : public Accel {
+public:
+    /// Algorithms that construct the tree
+    enum EBuildMode {
+        /// Partition the triangles by their centroids (binned SAH)
+        EBinnedSAH = 0,
+        /// Additionally split triangles where that reduces overlap (SBVH)
+        ESpatialSplits
+    };
+
+    BVH(const PropertyList &props);
+
+    /**
+     * \brief Enable the on-disk cache of built trees
+     *
+     * \param directory
+     *    Directory that stores the cache files (created on demand).
+     *    An empty string disables the cache, which is the default.
+     */
+    static void setCacheDirectory(const std::string &directory);
+
+    /// Return the directory of the on-disk cache (empty if the cache is disabled)
+    static const std::string &getCacheDirectory();
+
+    /// Ignore existing cache files and rebuild (the cache is still updated)
+    static void setForceRebuild(bool forceRebuild);
+
+    /**
+     * \brief Build the acceleration data structure
+     *
+     * The construction runs in parallel on the currently active TBB task
+     * arena. Calling this function again discards the previous tree.
+     *
+     * \param verbose
+     *    Print statistics about the resulting tree
+     */
+    void build(bool verbose = true) override;
+
+    /**
+     * \brief Select the construction algorithm used by \ref build()
+     *
+     * \param duplicationBudget
+     *    Number of additional triangle references that spatial splits
+     *    may create, relative to the number of triangles
+     */
+    void setBuildMode(EBuildMode mode, float duplicationBudget = 0.3f) {
+        m_buildMode = mode;
+        m_duplicationBudget = duplicationBudget;
+    }
+
+    /// Return the construction algorithm
+    EBuildMode getBuildMode() const { return m_buildMode; }
+
+    /// Return the duplication budget of the spatial split builder
+    float getDuplicationBudget() const { return m_duplicationBudget; }
+
+    /// Return the number of nodes of the (collapsed) triangle tree
+    size_t getNodeCount() const override { return m_nodes4.size() + m_nodes8.size(); }
+
+    /// Return the number of triangle references in the leaves (exceeds the triangle count with spatial splits)
+    size_t getReferenceCount() const { return m_referenceCount; }
+
+    /// Return the SAH cost of the (collapsed) triangle tree after the last build
+    float getSAHCost() const { return m_buildCost; }
+
+    /// Return the number of bytes taken by the nodes and triangle packets of the (collapsed) triangle tree
+    size_t getMemoryUsage() const override {
+        return m_nodes4.size() * sizeof(WideBVHNode<4>) + m_nodes8.size() * sizeof(WideBVHNode<8>) +
+               m_packets4.size() * sizeof(TrianglePacket<4>) + m_packets8.size() * sizeof(TrianglePacket<8>);
+    }
+
+    /**
+     * \brief Update the tree after the vertices of the meshes have moved
+     *
+     * Recomputes the bounds of all nodes bottom-up and in parallel, while
+     * keeping the topology of the tree. When triangles move far away from
+     * their original neighbors, refitted nodes overlap and traversal gets
+     * slower. Hence, if the SAH cost grew by more than a factor of
+     * \ref m_maxCostGrowth since the last build, the subtrees whose nodes
+     * degraded by that factor are rebuilt from scratch.
+     *
+     * The number of triangles and the connectivity of the meshes must not
+     * change (see \ref Mesh::setVertexPositions()). The bounds of instances
+     * are updated as well, but not the trees of their shape groups.
+     *
+     * \param verbose
+     *    Print the SAH cost and the number of rebuilt subtrees
+     */
+    void refit(bool verbose = true);
+
+    /// Return the time in milliseconds taken by the last call to \ref refit()
+    double getRefitTime() const { return m_refitTime; }
+
+    /// Return a human-readable summary of the build parameters
+    std::string toString() const;
 
-    uint32_t depth_curr_ = 1;
-    uint32_t count_leaf_ = 1;
-    uint32_t count_node_ = 1;
+protected:
+    bool traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const override;
+    bool occluded(const Ray3f &ray, uint32_t &prim) const override;
+    void traverseBatch(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const override;
+    void occludedBatch(Ray3f *rays, uint32_t *prims, uint32_t count) const override;
 
 private:
-    Mesh         *m_mesh = nullptr; ///< Mesh (only a single one for now)
+    /// Number of rays that \ref traverseInterleaved() advances in turns
+    static constexpr uint32_t InterleavedRayCount = 8;
+
+    /// Maximum number of rays that \ref traversePacket() traces together
+    static constexpr uint32_t PacketSize = 8;
+
+    /**
+     * Fraction of the rays of a packet that need to test the average leaf,
+     * below which the following rays of a batch are traced interleaved
+     */
+    static constexpr float MinPacketCoherence = 0.5f;
+
+    /// Build the tree over the triangles of all registered meshes
+    void buildTriangles();
+
+    /**
+     * \brief Build the binary tree \ref m_nodes and \ref m_indexes over a set of
+     * triangles and return its depth
+     *
+     * \param prims
+     *    Global primitive IDs of the triangles, or an empty vector to build
+     *    over all triangles
+     */
+    uint32_t buildBinary(const std::vector<uint32_t> &prims, uint32_t maxDepth);
+
+    /// Hash the mesh data and build parameters, which identifies the cache file of the tree
+    uint64_t cacheKey() const;
+
+    /// Map the collapsed tree from the cache file into memory, returns \c false on failure
+    bool loadCache(uint64_t key);
+
+    /// Write the collapsed tree to the cache file
+    void saveCache(uint64_t key) const;
+
+    /// Compute the expected cost of a ray query according to the SAH
+    float sahCost() const;
+
+    /// Width of the nodes and triangle packets of the selected kernel
+    uint32_t packetWidth() const { return m_simdLevel == EAVX2 ? 8 : 4; }
+
+    /// Collapse the binary subtree below \c n into \c Width-ary nodes and return the new index
+    template <int Width> uint32_t collapse(std::vector<WideBVHNode<Width>> &nodes,
+                                           std::vector<TrianglePacket<Width>> &packets,
+                                           uint32_t n) const;
+
+    /// Append the triangles of a leaf to \c packets and return the number of new packets
+    template <int Width> uint16_t pack(std::vector<TrianglePacket<Width>> &packets,
+                                       uint32_t offset, uint32_t count) const;
+
+    /// SAH cost of the children of a wide node relative to its own surface area
+    template <int Width> float nodeCost(const WideBVHNode<Width> &node) const;
+
+    /// SAH cost of the whole wide tree
+    template <int Width> float wideSAHCost(const AccelBuffer<WideBVHNode<Width>> &nodes) const;
+
+    /// Record the current cost of every wide node as the reference for \ref refit()
+    template <int Width> void resetNodeCosts(const AccelBuffer<WideBVHNode<Width>> &nodes);
+
+    /**
+     * \brief Refit the triangle tree and rebuild degraded subtrees
+     *
+     * Returns the number of rebuilt subtrees, and stores the SAH cost
+     * before rebuilding and the number of rebuilt triangles
+     */
+    template <int Width> uint32_t refitTriangles(AccelBuffer<WideBVHNode<Width>> &nodes,
+                                                 AccelBuffer<TrianglePacket<Width>> &packets,
+                                                 float &refitCost, uint32_t &rebuiltTriangles);
+
+    /// Update the triangle packets and child bounds below node \c n and return its bounds
+    template <int Width> BoundingBox3f refitNode(AccelBuffer<WideBVHNode<Width>> &nodes,
+                                                 AccelBuffer<TrianglePacket<Width>> &packets,
+                                                 uint32_t n, uint32_t depth);
+
+    /// Flag the topmost nodes whose cost grew too much and return their number
+    template <int Width> uint32_t findDegraded(const AccelBuffer<WideBVHNode<Width>> &nodes,
+                                               uint32_t n, std::vector<uint8_t> &degraded) const;
+
+    /// Append the global primitive IDs of all triangles below node \c n to \c prims
+    template <int Width> void gatherTriangles(const AccelBuffer<WideBVHNode<Width>> &nodes,
+                                              const AccelBuffer<TrianglePacket<Width>> &packets,
+                                              uint32_t n, std::vector<uint32_t> &prims) const;
+
+    /**
+     * \brief Copy the subtree below node \c n into new arrays, rebuilding
+     * all flagged subtrees along the way, and return its new index
+     */
+    template <int Width> uint32_t relayout(const AccelBuffer<WideBVHNode<Width>> &oldNodes,
+                                           const AccelBuffer<TrianglePacket<Width>> &oldPackets,
+                                           const std::vector<uint8_t> &degraded,
+                                           std::vector<WideBVHNode<Width>> &nodes,
+                                           std::vector<TrianglePacket<Width>> &packets,
+                                           std::vector<float> &costs,
+                                           uint32_t &rebuiltTriangles,
+                                           uint32_t n, uint32_t depth);
+
+    /**
+     * \brief Traverse the wide tree using the box and triangle tests provided by \c Kernel
+     *
+     * Finds the closest intersection, or any intersection if \c ShadowRay is
+     * set (\c its is unused then). Only the former visits the children of a
+     * node sorted by their entry distance.
+     */
+    template <typename Kernel, bool ShadowRay>
+    bool traverseWide(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                      const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                      Ray3f &ray, Intersection *its, uint32_t &prim) const;
+
+    /**
+     * \brief Find the closest intersections of several rays, or any
+     * intersections if \c ShadowRay is set (\c its is unused then),
+     * advancing groups of \ref InterleavedRayCount rays in turns
+     *
+     * Each ray visits one node or leaf and then prefetches the next one
+     * before the next ray of the group continues, so that the memory
+     * accesses of the rays overlap with the work on the others
+     */
+    template <typename Kernel, bool ShadowRay>
+    void traverseInterleaved(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                             const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                             Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const;
+
+    /**
+     * \brief Find the closest intersections of up to \ref PacketSize rays
+     * that share their origin, such as the camera rays of neighboring pixels
+     *
+     * Each node is tested once for the whole packet using bounds on the
+     * entry and exit distances of all rays. The rays then test the leaves
+     * that the packet reaches individually, unless their closest
+     * intersection so far lies in front of the leaf.
+     *
+     * \param raysPerLeaf
+     *    Average number of rays that tested each leaf
+     * \return \c false without tracing the rays if they do not share their
+     *    origin and the signs of their directions
+     */
+    template <typename Kernel>
+    bool traversePacket(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                        const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                        Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count,
+                        float &raysPerLeaf) const;
+
+    /// Trace consecutive rays as packets where they are coherent and interleaved otherwise
+    template <typename Kernel>
+    void traverseRays(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                      const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                      Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const;
+
+    /// Traversal entry points for the different instruction sets
+    bool traverseScalar(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const;
+    bool traverseSSE2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const;
+    NORI_TARGET_AVX2 bool traverseAVX2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const;
+    void traverseScalar(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const;
+    void traverseSSE2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const;
+    NORI_TARGET_AVX2 void traverseAVX2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count,
+                                       bool shadowRay) const;
+
+private:
+    /// Binary tree, only needed during construction
+    std::vector<BVHNode> m_nodes;
+    /// Collapsed tree used for traversal (only one of them is populated)
+    AccelBuffer<WideBVHNode<4>> m_nodes4;
+    AccelBuffer<WideBVHNode<8>> m_nodes8;
+    /// Leaf triangles matching the width of the collapsed tree
+    AccelBuffer<TrianglePacket<4>> m_packets4;
+    AccelBuffer<TrianglePacket<8>> m_packets8;
+    /// Cache file that holds the collapsed tree (if it was loaded from the cache)
+    std::unique_ptr<MemoryMappedFile> m_cacheFile;
+    /// Instruction set of the traversal kernel
+    ESIMDLevel m_simdLevel = EScalar;
+    /// Global primitive IDs ordered by the leaves of the tree, only needed during construction
+    std::vector<uint32_t> m_indexes;
+    uint32_t m_maxLeafSize = 8;       ///< Maximum number of triangles per leaf
+    float m_traversalCost = 1.0f;     ///< SAH cost of visiting an interior node
+    float m_intersectionCost = 1.0f;  ///< SAH cost of a ray-triangle test
+    float m_maxCostGrowth = 1.2f;     ///< SAH cost growth that makes \ref refit() rebuild subtrees
+    EBuildMode m_buildMode = EBinnedSAH;
+    float m_duplicationBudget = 0.3f; ///< Additional references allowed by spatial splits
+    uint32_t m_maxDepth = MaxDepth;   ///< Maximum depth of the binary tree
+    size_t m_referenceCount = 0;
+
+    /// SAH cost of the wide tree after the last build and of each of its nodes (see \ref nodeCost())
+    float m_buildCost = 0.0f;
+    std::vector<float> m_nodeCost;
+
+    /// Depth of the binary tree after the last build
+    uint32_t m_treeDepth = 0;
+    double m_refitTime = 0;
+    /// Time taken by the build of the triangle tree when it was written to the cache
+    double m_cachedBuildTime = 0;
 };
 
 NORI_NAMESPACE_END
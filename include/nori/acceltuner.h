@@ -0,0 +1,76 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Chooses the acceleration data structure and build parameters that
+ * trace the rays of a scene fastest
+ *
+ * No fixed set of parameters is best for every scene: e.g. the leaf size
+ * of the \ref BVH trades the cost of the box tests against the triangle
+ * tests, and the \ref KdTree needs different SAH costs for small and
+ * large scenes. The tuner builds a list of candidate structures over the
+ * scene geometry and measures the rays per second of each one on the same
+ * set of sample rays: camera rays through random pixels, shadow rays from
+ * their hit points into random directions and random rays within the scene
+ * bounds.
+ *
+ * The candidates are tried in order until the time budget is spent. The
+ * tuning is enabled with a scene property, and it prints the winning
+ * configuration as an \c accel tag, which can be pasted into the scene
+ * description to skip the tuning in later runs:
+ *
+ * <pre>
+ * &lt;scene&gt;
+ *     &lt;float name="accelTuningBudget" value="10"/&gt; &lt;!-- seconds --&gt;
+ *     ...
+ * </pre>
+ */
+class AccelTuner {
+public:
+    /**
+     * \brief Create a tuner for the geometry of a scene
+     *
+     * \param scene
+     *    Scene whose camera, meshes and instances are used
+     * \param budget
+     *    Time in seconds after which no further candidates are tried
+     */
+    AccelTuner(const Scene *scene, float budget);
+
+    /**
+     * \brief Compare \c accel against the candidate structures
+     *
+     * \param accel
+     *    Built acceleration data structure of the scene, which is
+     *    measured first
+     * \return
+     *    \c accel if it was the fastest one, otherwise a new (built)
+     *    acceleration data structure that the caller takes ownership of
+     */
+    Accel *tune(Accel *accel);
+
+private:
+    /// Create the sample rays, using \c accel to find the origins of the shadow rays
+    void generateRays(const Accel *accel);
+
+    /// Return the number of rays per second that \c accel traces
+    double measure(const Accel *accel) const;
+
+    const Scene *m_scene;
+    float m_budget;
+    /// Camera rays and random rays within the scene (closest hit queries)
+    std::vector<Ray3f> m_rays;
+    /// Shadow rays from the hit points of the camera rays
+    std::vector<Ray3f> m_shadowRays;
+};
+
+NORI_NAMESPACE_END
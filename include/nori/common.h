@@ -19,6 +19,7 @@
 #include <vector>
 #include <Eigen/Core>
 #include <stdint.h>
+#include <cstring>
 #include <ImathPlatform.h>
 #include <tinyformat.h>
 
@@ -110,10 +111,12 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
-class KDTree;
+class KdTree;
 class Emitter;
 struct EmitterQueryRecord;
+struct Intersection;
 class Mesh;
 class NoriObject;
 class NoriObjectFactory;
@@ -122,6 +125,7 @@ class PhaseFunction;
 class ReconstructionFilter;
 class Sampler;
 class Scene;
+class ShapeGroup;
 
 /// Import cout, cerr, endl for debugging purposes
 using std::cout;
@@ -225,6 +229,16 @@ inline int mod(int a, int b) {
     return (r < 0) ? r+b : r;
 }
 
+/// Interleave the lower 10 bits of \c v with zeros (bit i moves to bit 3i), e.g. for Morton codes
+inline uint32_t expandBits(uint32_t v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
 /// Compute a direction for the given coordinates in spherical coordinates
 extern Vector3f sphericalDirection(float theta, float phi);
 
@@ -253,4 +267,43 @@ extern float fresnel(float cosThetaI, float extIOR, float intIOR);
  */
 extern filesystem::resolver *getFileResolver();
 
+/**
+ * \brief Simple (non-cryptographic) 64-bit hash function
+ *
+ * Consumes the input eight bytes at a time, hence even large meshes are
+ * hashed in a small fraction of the time that building their tree takes.
+ * Used for the keys of the BVH cache and the checksums of mesh files.
+ */
+class Hasher {
+public:
+    void add(const void *data, size_t size) {
+        const uint8_t *ptr = (const uint8_t *) data;
+        for (; size >= 8; size -= 8, ptr += 8) {
+            uint64_t word;
+            memcpy(&word, ptr, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, ptr, size);
+        mix(tail ^ ((uint64_t) size << 56));
+    }
+
+    template <typename T> void add(const T &value) { add(&value, sizeof(T)); }
+
+    uint64_t get() const {
+        uint64_t h = m_state;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        return h ^ (h >> 31);
+    }
+
+private:
+    void mix(uint64_t word) {
+        uint64_t h = m_state ^ (word * 0x9E3779B97F4A7C15ull);
+        m_state = ((h << 27) | (h >> 37)) * 0xBF58476D1CE4E5B9ull;
+    }
+
+    uint64_t m_state = 0xCBF29CE484222325ull;
+};
+
 NORI_NAMESPACE_END
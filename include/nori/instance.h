@@ -0,0 +1,108 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Group of meshes that can be placed in the scene several times
+ *
+ * A shape group is declared once and does not appear in the rendered
+ * image by itself. Its meshes are stored and indexed by a bottom-level
+ * acceleration data structure in their own (object) coordinate system,
+ * which is a \ref BVH unless the group contains an \c accel tag.
+ * Copies of the group are then created using \ref Instance objects:
+ *
+ * <pre>
+ * &lt;shapegroup id="tree"&gt;
+ *     &lt;mesh type="obj"&gt; ... &lt;/mesh&gt;
+ * &lt;/shapegroup&gt;
+ *
+ * &lt;instance&gt;
+ *     &lt;ref id="tree"/&gt;
+ *     &lt;transform name="toWorld"&gt; ... &lt;/transform&gt;
+ * &lt;/instance&gt;
+ * </pre>
+ */
+class ShapeGroup : public NoriObject {
+public:
+    ShapeGroup(const PropertyList &props);
+
+    /// Release all memory
+    virtual ~ShapeGroup();
+
+    /// Register a mesh or the acceleration data structure with the group
+    void addChild(NoriObject *obj);
+
+    /// Build the bottom-level acceleration data structure
+    void activate();
+
+    /// Return the acceleration data structure over the meshes of the group
+    const Accel *getAccel() const { return m_accel; }
+
+    /// Return an axis-aligned box that bounds the group in object space
+    const BoundingBox3f &getBoundingBox() const { return m_accel->getBoundingBox(); }
+
+    /// Return the name of the group
+    const std::string &getName() const { return m_name; }
+
+    /// Return a human-readable summary of the group
+    std::string toString() const;
+
+    EClassType getClassType() const { return EShapeGroup; }
+
+private:
+    std::string m_name;
+    std::vector<Mesh *> m_meshes;
+    Accel *m_accel = nullptr;
+};
+
+/**
+ * \brief Copy of a \ref ShapeGroup with its own object-to-world transform
+ *
+ * Rays are transformed into the coordinate system of the group during
+ * traversal, hence an instance costs only a few bytes regardless of the
+ * size of the geometry it references.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &props);
+
+    /// Register the referenced shape group
+    void addChild(NoriObject *obj);
+
+    /// Compute the world space bounds of the instance
+    void activate();
+
+    /// Return the referenced shape group
+    const ShapeGroup *getShapeGroup() const { return m_group; }
+
+    /// Return the transformation from object to world space
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return the transformation from world to object space
+    const Transform &getWorldToObject() const { return m_worldToObject; }
+
+    /// Return an axis-aligned box that bounds the instance in world space
+    const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+    /// Return a human-readable summary of the instance
+    std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+private:
+    const ShapeGroup *m_group = nullptr;
+    Transform m_toWorld;
+    Transform m_worldToObject;
+    BoundingBox3f m_bbox;
+};
+
+NORI_NAMESPACE_END
@@ -41,6 +41,28 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose first
+     * intersection has already been found
+     *
+     * The renderer traces the camera rays of an image block together (see
+     * \ref Scene::rayIntersect()) for integrators that return a nonzero
+     * value from \ref getPrimaryHitAttributes(), and then calls this
+     * function for each ray. \c its is \c nullptr if the ray does not hit
+     * anything. The default implementation ignores \c its.
+     */
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                       const Intersection *its) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /**
+     * \brief Return the attributes of the first intersection that the
+     * integrator needs (see \ref Intersection::EAttribute), or zero if it
+     * does not support the \ref Li() variant that receives it
+     */
+    virtual uint32_t getPrimaryHitAttributes() const { return 0; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
@@ -27,8 +27,23 @@ struct SampleMeshResult
  * This includes the position, traveled ray distance, uv coordinates, as well
  * as well as two local coordinate frames (one that corresponds to the true
  * geometry, and one that is used for shading computations).
+ *
+ * Apart from the distance and the mesh, these attributes are interpolated
+ * from the vertex data on demand: the ray tracing functions only compute
+ * the attributes that the caller asks for (all of them by default), and
+ * \ref compute() adds further ones later on using the hit handle, i.e.
+ * the triangle, barycentric coordinates and instance of the hit.
  */
 struct Intersection {
+    /// Attributes that are interpolated on demand
+    enum EAttribute : uint32_t {
+        EPosition       = 0x01, ///< \ref p
+        ETexCoords      = 0x02, ///< \ref uv
+        EGeometricFrame = 0x04, ///< \ref geoFrame
+        EShadingFrame   = 0x08, ///< \ref shFrame
+        EAllAttributes  = 0x0F
+    };
+
     /// Position of the surface intersection
     Point3f p;
     /// Unoccluded distance along the ray
@@ -42,8 +57,23 @@ struct Intersection {
     /// Pointer to the associated mesh
     const Mesh *mesh;
 
+    /// Index of the triangle within \ref mesh
+    uint32_t f;
+    /// Barycentric coordinates of the intersection on the triangle
+    Point2f bary;
+    /// Instance of the mesh, or \c nullptr if the mesh is part of the scene itself
+    const Instance *instance;
+    /// Attributes that have been computed so far (see \ref EAttribute)
+    uint32_t computed;
+
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr) { }
+    Intersection() : mesh(nullptr), instance(nullptr), computed(0) { }
+
+    /// Compute the given attributes (see \ref EAttribute) unless they are available already
+    void compute(uint32_t attributes) {
+        if (attributes & ~computed)
+            computeAttributes(attributes & ~computed);
+    }
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -57,8 +87,58 @@ struct Intersection {
 
     /// Return a human-readable summary of the intersection record
     std::string toString() const;
+
+private:
+    /// Interpolate the given attributes, which have not been computed yet
+    void computeAttributes(uint32_t attributes);
 };
 
+/**
+ * \brief Matrix of vertex attributes or triangle indices of a mesh
+ *
+ * Behaves like an \c Eigen::Map of a column-major matrix. Like
+ * \ref AccelBuffer, the elements are either owned by the matrix (after
+ * \ref resize()) or live in memory that is owned by someone else, e.g.
+ * a memory-mapped mesh file (see \ref assign()).
+ */
+template <typename Scalar> class MeshMatrix : public Eigen::Map<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>> {
+public:
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+    typedef Eigen::Map<Matrix> Base;
+
+    MeshMatrix() : Base(nullptr, 0, 0) { }
+    MeshMatrix(const MeshMatrix &) = delete;
+
+    /// Copy the values of a matrix of the same size
+    template <typename Derived> MeshMatrix &operator=(const Eigen::DenseBase<Derived> &other) {
+        Base::operator=(other);
+        return *this;
+    }
+
+    /// Allocate (uninitialized) storage that is owned by the matrix
+    void resize(Eigen::Index rows, Eigen::Index cols) {
+        m_owned.resize(rows, cols);
+        remap(m_owned.data(), rows, cols);
+    }
+
+    /// Refer to a column-major matrix that is owned by someone else
+    void assign(Scalar *data, Eigen::Index rows, Eigen::Index cols) {
+        m_owned = Matrix();
+        remap(data, rows, cols);
+    }
+
+private:
+    void remap(Scalar *data, Eigen::Index rows, Eigen::Index cols) {
+        /* Eigen's way of pointing an existing map to other memory */
+        new (static_cast<Base *>(this)) Base(data, rows, cols);
+    }
+
+    Matrix m_owned;
+};
+
+typedef MeshMatrix<float>    MeshMatrixXf;
+typedef MeshMatrix<uint32_t> MeshMatrixXu;
+
 /**
  * \brief Triangle mesh
  *
@@ -120,17 +200,40 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+    /**
+     * \brief Fill in the details of an intersection with a triangle
+     *
+     * Expects \c its.bary to hold the barycentric coordinates of the hit
+     * (see \ref rayIntersect()), and computes the requested attributes of
+     * \c its (see \ref Intersection::EAttribute) in the coordinate system
+     * of the mesh. Requesting the shading frame of a mesh without vertex
+     * normals also computes the geometric frame.
+     *
+     * \return The attributes that were computed
+     */
+    uint32_t fillIntersectionRecord(uint32_t index, Intersection &its,
+                                    uint32_t attributes = Intersection::EAllAttributes) const;
+
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MeshMatrixXf &getVertexPositions() const { return m_V; }
+
+    /**
+     * \brief Replace the vertex positions, e.g. to animate the mesh
+     *
+     * The number of vertices must stay the same. Afterwards, the
+     * acceleration data structure needs to be updated using
+     * \ref BVH::refit().
+     */
+    void setVertexPositions(const MatrixXf &V);
 
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    const MeshMatrixXf &getVertexNormals() const { return m_N; }
 
     /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    const MeshMatrixXf &getVertexTexCoords() const { return m_UV; }
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MeshMatrixXu &getIndices() const { return m_F; }
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -167,12 +270,41 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /// Compute the surface area and the distribution used to sample triangles
+    void computeAreaDistribution();
+
+    /// Orders of the triangles that \ref reorder() can establish
+    enum ETriangleOrder {
+        /// Keep the order of the file
+        EFileOrder = 0,
+        /// Sort along a Morton (Z-order) curve through the centroids
+        EMortonOrder,
+        /// Sort along a Hilbert curve through the centroids
+        EHilbertOrder
+    };
+
+    /// Read the \c reorder parameter of a mesh: \c "none" (default), \c "morton" or \c "hilbert"
+    static ETriangleOrder getTriangleOrder(const PropertyList &props);
+
+    /**
+     * \brief Sort the triangles along a space-filling curve and renumber
+     * the vertices in the order in which the triangles first use them
+     *
+     * Neighboring triangles then reference nearby columns of the vertex
+     * matrices, which saves cache misses when intersection tests and
+     * intersection records fetch their vertices. Normals and texture
+     * coordinates are permuted along with the positions, and vertices that
+     * no triangle uses move to the end. Needs the bounding box, and must be
+     * called before \ref activate().
+     */
+    void reorder(ETriangleOrder order);
+
 protected:
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    MeshMatrixXf  m_V;                   ///< Vertex positions
+    MeshMatrixXf  m_N;                   ///< Vertex normals
+    MeshMatrixXf  m_UV;                  ///< Vertex texture coordinates
+    MeshMatrixXu  m_F;                   ///< Faces
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
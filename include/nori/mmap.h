@@ -0,0 +1,51 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only view of a file that is mapped into memory
+ *
+ * The operating system loads the pages of the file on demand, hence
+ * opening even a large file is cheap. The mapping is private: writes
+ * to the memory are allowed, but they only modify a copy of the
+ * affected pages and never reach the file.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the given file into memory (throws a \ref NoriException on failure)
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    /// Return a pointer to the contents of the file
+    uint8_t *data() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+    /// Return the name of the file
+    const std::string &getFilename() const { return m_filename; }
+
+private:
+    std::string m_filename;
+    uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+NORI_NAMESPACE_END
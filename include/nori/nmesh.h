@@ -0,0 +1,54 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Triangle mesh in Nori's binary mesh format (\c &lt;mesh type="nmesh"&gt;)
+ *
+ * An \c .nmesh file consists of a header followed by the vertex positions,
+ * normals and texture coordinates and the triangle indices, each of which
+ * is stored exactly like the matrices of a \ref Mesh and starts at a
+ * 64-byte aligned offset. The loader maps the file into memory and points
+ * the matrices of the mesh at these blocks, hence nothing is parsed or
+ * copied and even huge meshes open in constant time. The pages of the file
+ * are only read once the mesh is used.
+ *
+ * The header stores the bounds of the mesh and a checksum of the blocks.
+ * The checksum (and the range of the indices) is only verified on request,
+ * since doing so reads the whole file. Use the \c nori-meshconv tool to
+ * convert OBJ and PLY files; its \c --reorder option stores the triangles
+ * in the order of a space-filling curve (see \ref Mesh::reorder()).
+ *
+ * Parameters:
+ * - \c filename: path of the \c .nmesh file
+ * - \c toWorld: optional transformation, which is applied to a private
+ *   copy of the pages of the positions and normals
+ * - \c verify: check the checksum and indices when loading (\c false)
+ */
+class NMesh : public Mesh {
+public:
+    NMesh(const PropertyList &props);
+
+    /**
+     * \brief Write a mesh to an \c .nmesh file
+     *
+     * Throws a \ref NoriException if the file cannot be written.
+     */
+    static void write(const Mesh *mesh, const std::string &filename);
+
+private:
+    /// Mapped file that the matrices of the mesh point to
+    std::unique_ptr<MemoryMappedFile> m_file;
+};
+
+NORI_NAMESPACE_END
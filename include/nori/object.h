@@ -30,6 +30,9 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EShapeGroup,
+        EInstance,
+        EAccel,
         EClassTypeCount
     };
 
@@ -86,6 +89,9 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EShapeGroup: return "shapegroup";
+            case EInstance:   return "instance";
+            case EAccel:      return "accel";
             default:          return "<unknown>";
         }
     }
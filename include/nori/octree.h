@@ -1,21 +1,93 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
 #pragma once
-#include <nori/mesh.h>
+
+#include <nori/accel.h>
 
 NORI_NAMESPACE_BEGIN
-struct treeNode;
-class Octree{
-    public:
-    Octree(Mesh* mesh);
-    BoundingBox3f WorldBound() const { return bounds;}
-    bool IntersectOctree(Ray3f &ray_, Intersection &its, bool shadowRay,int &triIndex) const;
-
-    private:
-    void buildTree(std::vector<int> meshIndex, BoundingBox3f bound, treeNode *parent, int nTri);
-    bool recursive(const treeNode &node, Ray3f &ray_, Intersection &its, bool shadowRay, BoundingBox3f bbox,int &triIndex) const;
-    Mesh* mesh;
-    std::vector<int> meshIndices;
-    BoundingBox3f bounds;
-    std::vector<BoundingBox3f> tribounds;
-    treeNode *root;
+
+/// Node of the octree
+struct OctreeNode {
+    /// Value of \ref count that marks interior nodes
+    static constexpr uint32_t Interior = std::numeric_limits<uint32_t>::max();
+
+    /// Bounds of the octant covered by this node
+    BoundingBox3f bbox;
+    /**
+     * Interior node: index of the first child (the other seven follow it).
+     * Leaf node: offset of the IDs of its triangles in the index array
+     */
+    uint32_t offset = 0;
+    /// Leaf node: number of triangles that overlap the octant. \ref Interior for interior nodes
+    uint32_t count = 0;
+
+    bool isLeaf() const { return count != Interior; }
+};
+
+/**
+ * \brief Uniform octree over the triangles of several meshes (\c &lt;accel type="octree"&gt;)
+ *
+ * Every interior node splits its box into eight equally sized octants.
+ * Triangles are stored in all leaves whose octant their bounds overlap,
+ * hence a triangle may be referenced several times. The triangles of all
+ * leaves are stored in a single index array, which the build partitions
+ * in place without a separate list per node. Rays are traced
+ * without recursion using a fixed-size stack, and visit the children of
+ * a node front to back in an order that only depends on the signs of
+ * the ray direction.
+ *
+ * Parameters:
+ * - \c maxLeafSize: number of triangles below which nodes are never split (16)
+ * - \c maxDepth: maximum depth of the tree (12)
+ */
+class Octree : public Accel {
+public:
+    Octree(const PropertyList &props);
+
+    /// Build the octree over all registered meshes
+    void build(bool verbose = true) override;
+
+    /// Return the number of nodes of the tree
+    size_t getNodeCount() const override { return m_nodes.size(); }
+
+    /// Return the number of bytes taken by the nodes and the index array
+    size_t getMemoryUsage() const override;
+
+    /// Return a human-readable summary of the build parameters
+    std::string toString() const;
+
+protected:
+    bool traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const override;
+    bool occluded(const Ray3f &ray, uint32_t &prim) const override;
+
+private:
+    /// Find the closest intersection, or any intersection if \c ShadowRay is set (\c its is unused then)
+    template <bool ShadowRay> bool traverseTree(Ray3f &ray, Intersection *its, uint32_t &prim) const;
+
+    /**
+     * \brief Split leaf \c n into eight octants, or return \c false if
+     * that does not separate its triangles
+     *
+     * The node owns the range of \c work that starts at \c begin and
+     * extends to the end of the array. On success, this range is replaced
+     * by those of the children, whose \ref OctreeNode::offset fields
+     * temporarily refer to \c work
+     */
+    bool divide(uint32_t n, std::vector<uint32_t> &work, uint32_t begin);
+
+    uint32_t m_maxLeafSize = 16;
+    uint32_t m_maxDepth = 12;
+
+    /// Nodes in depth-first order, with the eight children of a node next to each other
+    std::vector<OctreeNode> m_nodes;
+    /// Global primitive IDs of the triangles of all leaves
+    std::vector<uint32_t> m_indices;
+    /// Depth of the tree after the last build
+    uint32_t m_treeDepth = 0;
 };
+
 NORI_NAMESPACE_END
@@ -13,6 +13,12 @@ NORI_NAMESPACE_BEGIN
 /**
  * \brief Load a scene from the specified filename and
  * return its root object
+ *
+ * Meshes are loaded by parallel tasks while the rest of the file is
+ * parsed, and each task also builds the sampling distribution of its mesh.
+ * An object waits for these tasks only when it needs its children, hence
+ * the scene builds its acceleration data structure right after the last
+ * mesh is complete.
  */
 extern NoriObject *loadFromXML(const std::string &filename);
 
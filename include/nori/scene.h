@@ -17,6 +17,23 @@ NORI_NAMESPACE_BEGIN
  * This class holds information on scene objects and is responsible for
  * coordinating rendering jobs. It also provides useful query routines that
  * are mostly used by the \ref Integrator implementations.
+ *
+ * The acceleration data structure is a \ref BVH with the binned SAH
+ * builder by default. Scenes can choose another structure or other build
+ * parameters, e.g. spatial splits for long, thin or overlapping triangles
+ * (architecture):
+ *
+ * <pre>
+ * &lt;scene&gt;
+ *     &lt;accel type="bvh"&gt;
+ *         &lt;string name="builder" value="sbvh"/&gt;
+ *         &lt;float name="duplicationBudget" value="0.3"/&gt;
+ *     &lt;/accel&gt;
+ *     ...
+ * </pre>
+ *
+ * Alternatively, the scene can measure a number of candidate structures
+ * and choose the fastest one (see \ref AccelTuner).
  */
 class Scene : public NoriObject {
 public:
@@ -26,9 +43,12 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
+    /// Return a pointer to the scene's acceleration data structure
+    Accel *getAccel() { return m_accel; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -47,6 +67,9 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /// Return a reference to an array containing all instances of shape groups
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -59,10 +82,31 @@ public:
      *    A detailed intersection record, which will be filled by the
      *    intersection query
      *
+     * \param attributes
+     *    Attributes of \c its that are needed (see \ref Intersection::EAttribute).
+     *    Skipping the others saves their interpolation, and they can still
+     *    be computed later using \ref Intersection::compute()
+     *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        return m_accel->rayIntersect(ray, its, false);
+    bool rayIntersect(const Ray3f &ray, Intersection &its,
+                      uint32_t attributes = Intersection::EAllAttributes) const {
+        return m_accel->rayIntersect(ray, its, false, attributes);
+    }
+
+    /**
+     * \brief Find the closest intersections of several rays at once
+     *
+     * Equivalent to calling \ref rayIntersect() for each ray, but faster
+     * for larger batches of rays, which the acceleration data structure
+     * can trace in an interleaved fashion. Rays that do not hit anything
+     * set \c its[i].mesh to \c nullptr.
+     *
+     * \return The number of rays that hit a triangle
+     */
+    uint32_t rayIntersect(const Ray3f *rays, Intersection *its, uint32_t count,
+                          uint32_t attributes = Intersection::EAllAttributes) const {
+        return m_accel->rayIntersect(rays, its, count, attributes);
     }
 
     /**
@@ -81,8 +125,33 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Find the closest intersections of a stream of incoherent rays
+     *
+     * Equivalent to the batch variant of \ref rayIntersect(), but the rays
+     * are reordered by their origin and direction before they are traced
+     * (see \ref Accel::intersectStream()), which pays off for secondary
+     * rays. Rays that do not hit anything set \c its[i].mesh to \c nullptr.
+     *
+     * \return The number of rays that hit a triangle
+     */
+    uint32_t intersectStream(const Ray3f *rays, Intersection *its, uint32_t count,
+                             uint32_t attributes = Intersection::EAllAttributes) const {
+        return m_accel->intersectStream(rays, its, count, attributes);
+    }
+
+    /**
+     * \brief Check which rays of a stream of shadow rays are blocked
+     *
+     * Sets \c occluded[i] to \c true if ray \c i hits any triangle
+     *
+     * \return The number of blocked rays
+     */
+    uint32_t occludedStream(const Ray3f *rays, bool *occluded, uint32_t count) const {
+        return m_accel->occludedStream(rays, occluded, count);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -93,7 +162,7 @@ public:
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
-     * Initializes the internal data structures (kd-tree,
+     * Initializes the internal data structures (acceleration data structure,
      * emitter sampling data structures, etc.)
      */
     void activate();
@@ -115,10 +184,13 @@ private:
     std::vector<Mesh *> m_meshes;
     std::vector<Mesh*> m_meshes_emitter;
     std::vector<Emitter*> m_emitters;
+    std::vector<ShapeGroup *> m_shapeGroups;
+    std::vector<Instance *> m_instances;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    float m_accelTuningBudget = 0.0f;
     //Emitter* m_emitter = mullptr;
 };
 
@@ -0,0 +1,91 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+/* SIMD kernels are only available on x86 processors. Other platforms
+   (e.g. ARM) always use the scalar code paths */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define NORI_X86 1
+#  include <immintrin.h>
+#endif
+
+/* Kernels that use AVX2 are compiled for that instruction set on a
+   per-function basis, hence the rest of Nori still runs on any x86
+   processor. They must only be called if \ref getSIMDLevel() permits it */
+#if defined(_MSC_VER) && !defined(__clang__)
+#  define NORI_INLINE       __forceinline
+#  define NORI_TARGET_AVX2
+#  include <intrin.h>
+#else
+#  define NORI_INLINE       inline __attribute__((always_inline))
+#  if defined(NORI_X86)
+#    define NORI_TARGET_AVX2  __attribute__((target("avx2")))
+#  else
+#    define NORI_TARGET_AVX2
+#  endif
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Instruction sets used by the ray tracing kernels (in increasing order)
+enum ESIMDLevel {
+    EScalar = 0,
+    ESSE2,
+    EAVX2
+};
+
+/// Return the widest instruction set that is supported by the processor and OS
+extern ESIMDLevel getSIMDLevel();
+
+/// Return a human-readable name of an instruction set
+inline const char *simdLevelName(ESIMDLevel level) {
+    switch (level) {
+        case ESSE2: return "SSE2";
+        case EAVX2: return "AVX2";
+        default:    return "scalar";
+    }
+}
+
+/// Return the index of the lowest set bit of a nonzero mask
+inline int lowestBit(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int) index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/// Return the number of set bits of a mask
+inline int popCount(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int count = 0;
+    for (; mask; mask &= mask - 1)
+        ++count;
+    return count;
+#else
+    return __builtin_popcount(mask);
+#endif
+}
+
+/// Ask the processor to start loading all cache lines of an object that is accessed soon
+template <typename T> NORI_INLINE void prefetch(const T *ptr) {
+    for (size_t offset = 0; offset < sizeof(T); offset += 64) {
+#if defined(_MSC_VER) && !defined(__clang__)
+#  if defined(NORI_X86)
+        _mm_prefetch((const char *) ptr + offset, _MM_HINT_T0);
+#  endif
+#else
+        __builtin_prefetch((const char *) ptr + offset);
+#endif
+    }
+}
+
+NORI_NAMESPACE_END
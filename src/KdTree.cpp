@@ -1,367 +1,362 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
 #include <nori/KdTree.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+#include <tbb/blocked_range.h>
 #include <limits>
 
 NORI_NAMESPACE_BEGIN
 
-// KdTreeAccel Local Declarations
-struct KdAccelNode {
-    // KdAccelNode Methods
-    void InitLeaf(int *primNums, int np, std::vector<int> *primitiveIndices);
-    void InitInterior(int axis, int ac, float s) {
-        split = s;
-        flags = axis;
-        aboveChild |= (ac << 2);
-    }
-    float SplitPos() const { return split; }
-    int nPrimitives() const { return nPrims >> 2; }
-    int SplitAxis() const { return flags & 3; }
-    bool IsLeaf() const { return (flags & 3) == 3; }
-    int AboveChild() const { return aboveChild >> 2; }
-    union {
-        float split;                 // Interior
-        int onePrimitive;            // Leaf
-        int primitiveIndicesOffset;  // Leaf
-    };
+namespace {
 
-  private:
-    union {
-        int flags;       // Both
-        int nPrims;      // Leaf
-        int aboveChild;  // Interior
-    };
-};
+/// Event types, ordered such that triangles starting at a plane come first
+enum EEventType : uint32_t { EStart = 0, EEnd };
 
-enum class EdgeType { Start, End };
-struct BoundEdge {
-    // BoundEdge Public Methods
-    BoundEdge() {}
-    BoundEdge(float t, int primNum, bool starting) : t(t), primNum(primNum) {
-        type = starting ? EdgeType::Start : EdgeType::End;
-    }
+/// Sides of the splitting plane that a triangle overlaps
+enum ESide : uint8_t { EBelow = 1, EAbove = 2 };
+
+}
+
+struct KdTree::Event {
     float t;
-    int primNum;
-    EdgeType type;
+    uint32_t prim;
+    uint32_t type;
+
+    bool operator<(const Event &other) const {
+        if (t != other.t)
+            return t < other.t;
+        if (type != other.type)
+            return type < other.type;
+        return prim < other.prim;
+    }
 };
 
-// KdTreeAccel Method Definitions
-KdTree::KdTree(Mesh *mesh, int isectCost, int traversalCost, float emptyBonus,
-                         int maxPrims, int maxDepth)
-    : isectCost(isectCost),
-      traversalCost(traversalCost),
-      maxPrims(maxPrims),
-      emptyBonus(emptyBonus),
-      mesh(mesh) {
-    // Build kd-tree for accelerator
-    nextFreeNode = nAllocedNodes = 0;
-    int nums = mesh->getTriangleCount();
-    if (maxDepth <= 0)
-        maxDepth = std::round(8 + 1.3f * log2(float(nums)));
-
-    // Compute bounds for kd-tree construction
-    std::vector<BoundingBox3f> primBounds;
-    primBounds.reserve(nums);
-    for (size_t i = 0; i < nums; i++) {
-        primBounds.push_back(mesh->getBoundingBox(i));
+KdTree::KdTree(const PropertyList &props) {
+    m_intersectionCost = props.getFloat("intersectionCost", 80.0f);
+    m_traversalCost = props.getFloat("traversalCost", 1.0f);
+    m_emptyBonus = props.getFloat("emptyBonus", 0.5f);
+    int maxLeafSize = props.getInteger("maxLeafSize", 1);
+    m_maxDepth = props.getInteger("maxDepth", -1);
+
+    if (m_intersectionCost <= 0 || m_traversalCost <= 0 || m_emptyBonus < 0 || m_emptyBonus > 1)
+        throw NoriException("KdTree: invalid cost parameters!");
+    if (maxLeafSize < 1)
+        throw NoriException("KdTree: the maximum leaf size must be positive!");
+    if (m_maxDepth == 0 || m_maxDepth > (int) MaxDepth)
+        throw NoriException("KdTree: the maximum depth must be between 1 and %i!", MaxDepth);
+    m_maxPrims = (uint32_t) maxLeafSize;
+}
+
+void KdTree::build(bool verbose) {
+    Timer timer;
+
+    m_nodes.clear();
+    m_indexes.clear();
+    uint32_t primCount = getTotalTriangleCount();
+    int maxDepth = 0;
+    if (primCount > 0)
+        maxDepth = buildTriangles();
+    buildInstances();
+
+    m_buildTime = timer.elapsed();
+
+    if (verbose && primCount > 0) {
+        size_t leafCount = 0, emptyCount = 0;
+        for (const KdTreeNode &node : m_nodes) {
+            if (node.isLeaf()) {
+                leafCount++;
+                emptyCount += node.getPrimCount() == 0 ? 1 : 0;
+            }
+        }
+        std::cout << "[kd-tree build time]: " << timeString(m_buildTime) << std::endl;
+        std::cout << "[kd-tree nodes]: " << m_nodes.size() << " (" << leafCount << " leaves, "
+                  << emptyCount << " empty, max depth " << maxDepth << ")" << std::endl;
+        std::cout << "[kd-tree memory]: " << memString(getMemoryUsage()) << ", "
+                  << tfm::format("%.1f", (double) getMemoryUsage() / primCount)
+                  << " bytes/triangle" << std::endl;
+    }
+    if (verbose && !m_instances.empty()) {
+        std::cout << "[instances]: " << m_instances.size() << " ("
+                  << m_instanceNodes.size() << " top-level nodes)" << std::endl;
     }
-    bounds = mesh->getBoundingBox();
-
-    // Allocate working memory for kd-tree construction
-    std::unique_ptr<BoundEdge[]> edges[3];
-    for (int i = 0; i < 3; ++i)
-        edges[i].reset(new BoundEdge[2 * nums]);
-    std::unique_ptr<int[]> prims0(new int[nums]);
-    std::unique_ptr<int[]> prims1(new int[(maxDepth + 1) * nums]);
-
-    // Initialize _primNums_ for kd-tree construction
-    std::unique_ptr<int[]> primNums(new int[nums]);
-    for (size_t i = 0; i < nums; ++i) primNums[i] = i;
-
-    // Start recursive construction of kd-tree
-    buildTree(0, bounds, primBounds, primNums.get(), nums,
-              maxDepth, edges, prims0.get(), prims1.get());
 }
 
-void KdAccelNode::InitLeaf(int *primNums, int np,
-                           std::vector<int> *primitiveIndices) {
-    flags = 3;
-    nPrims |= (np << 2);
-    // Store primitive ids for leaf node
-    if (np == 0)
-        onePrimitive = 0;
-    else if (np == 1)
-        onePrimitive = primNums[0];
-    else {
-        primitiveIndicesOffset = primitiveIndices->size();
-        for (int i = 0; i < np; ++i) primitiveIndices->push_back(primNums[i]);
+int KdTree::buildTriangles() {
+    /* Leaves store their triangle count in 30 bits */
+    uint32_t primCount = getTotalTriangleCount();
+    if (primCount >= (1u << 30))
+        throw NoriException("KdTree: the scene exceeds the maximum number of triangles!");
+
+    int maxDepth = m_maxDepth > 0 ? m_maxDepth
+        : (int) std::round(8 + 1.3f * std::log2((float) primCount));
+    maxDepth = std::min(maxDepth, (int) MaxDepth);
+
+    /* Create the start and end events of all triangles and sort them once */
+    EventList events;
+    for (int axis = 0; axis < 3; ++axis)
+        events[axis].resize(2 * (size_t) primCount);
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        const Mesh *mesh = m_meshes[i];
+        uint32_t offset = m_meshOffset[i];
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount()),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t f = range.begin(); f < range.end(); ++f) {
+                    BoundingBox3f bbox = mesh->getBoundingBox(f);
+                    uint32_t prim = offset + f;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        events[axis][2 * prim] = { bbox.min[axis], prim, EStart };
+                        events[axis][2 * prim + 1] = { bbox.max[axis], prim, EEnd };
+                    }
+                }
+            }
+        );
     }
+    for (int axis = 0; axis < 3; ++axis)
+        tbb::parallel_sort(events[axis].begin(), events[axis].end());
+
+    /* The root covers the triangles, while the scene bounds also include instances */
+    m_treeBounds.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_treeBounds.expandBy(mesh->getBoundingBox());
+
+    m_side.assign(primCount, 0);
+    buildNode(m_treeBounds, events, primCount, maxDepth, 0);
+    std::vector<uint8_t>().swap(m_side);
+    return maxDepth;
 }
 
-KdTree::~KdTree() {delete nodes; }
-
-void KdTree::buildTree(int nodeNum, const BoundingBox3f &nodeBounds,
-                            const std::vector<BoundingBox3f> &allPrimBounds,
-                            int *primNums, int nPrimitives, int depth,
-                            const std::unique_ptr<BoundEdge[]> edges[3],
-                            int *prims0, int *prims1, int badRefines) {
-    // Get next free node from _nodes_ array
-    if (nextFreeNode == nAllocedNodes) {
-        int nNewAllocNodes = std::max(2 * nAllocedNodes, 512);
-        KdAccelNode *n = new KdAccelNode[nNewAllocNodes];
-        if (nAllocedNodes > 0) {
-            memcpy(n, nodes, nAllocedNodes * sizeof(KdAccelNode));
-            delete[] nodes;
+void KdTree::buildNode(const BoundingBox3f &bounds, EventList &events, uint32_t primCount,
+                       int depth, int badRefines) {
+    uint32_t index = (uint32_t) m_nodes.size();
+    if (index >= (1u << 30))
+        throw NoriException("KdTree: the tree exceeds the maximum number of nodes!");
+    m_nodes.emplace_back();
+
+    /* Every triangle has exactly one start event along each axis */
+    auto makeLeaf = [&]() {
+        std::vector<uint32_t> prims;
+        prims.reserve(primCount);
+        for (const Event &event : events[0]) {
+            if (event.type == EStart)
+                prims.push_back(event.prim);
         }
-        nodes = n;
-        nAllocedNodes = nNewAllocNodes;
-    }
-    ++nextFreeNode;
+        if (prims.size() <= 1) {
+            m_nodes[index].initLeaf((uint32_t) prims.size(), prims.empty() ? 0 : prims[0]);
+        } else {
+            m_nodes[index].initLeaf((uint32_t) prims.size(), (uint32_t) m_indexes.size());
+            m_indexes.insert(m_indexes.end(), prims.begin(), prims.end());
+        }
+    };
 
-    // Initialize leaf node if termination criteria met
-    if (nPrimitives <= maxPrims || depth == 0) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+    if (primCount <= m_maxPrims || depth == 0) {
+        makeLeaf();
         return;
     }
 
-    // Initialize interior node and continue recursion
-
-    // Choose split axis position for interior node
-    int bestAxis = -1, bestOffset = -1;
-    float bestCost = std::numeric_limits<float>::infinity();;
-    float oldCost = isectCost * float(nPrimitives);
-    float totalSA = nodeBounds.getSurfaceArea();
-    float invTotalSA = 1 / totalSA;
-    Vector3f d = nodeBounds.getExtents();
-
-    // Choose which axis to split along
-    int axis = nodeBounds.getMajorAxis();
-    int retries = 0;
-retrySplit:
-
-    // Initialize edges for _axis_
-    for (int i = 0; i < nPrimitives; ++i) {
-        int pn = primNums[i];
-        const BoundingBox3f &bounds = allPrimBounds[pn];
-        edges[axis][2 * i] = BoundEdge(bounds.min[axis], pn, true);
-        edges[axis][2 * i + 1] = BoundEdge(bounds.max[axis], pn, false);
-    }
-
-    // Sort _edges_ for _axis_
-    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives],
-              [](const BoundEdge &e0, const BoundEdge &e1) -> bool {
-                  if (e0.t == e1.t)
-                      return (int)e0.type < (int)e1.type;
-                  else
-                      return e0.t < e1.t;
-              });
-
-    // Compute cost of all splits for _axis_ to find best
-    int nBelow = 0, nAbove = nPrimitives;
-    for (int i = 0; i < 2 * nPrimitives; ++i) {
-        if (edges[axis][i].type == EdgeType::End) --nAbove;
-        float edgeT = edges[axis][i].t;
-        if (edgeT > nodeBounds.min[axis] && edgeT < nodeBounds.max[axis]) {
-            // Compute cost for split at _i_th edge
-
-            // Compute child surface areas for split at _edgeT_
-            int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
-            float belowSA = 2 * (d[otherAxis0] * d[otherAxis1] +
-                                 (edgeT - nodeBounds.min[axis]) *
-                                     (d[otherAxis0] + d[otherAxis1]));
-            float aboveSA = 2 * (d[otherAxis0] * d[otherAxis1] +
-                                 (nodeBounds.max[axis] - edgeT) *
-                                     (d[otherAxis0] + d[otherAxis1]));
-            float pBelow = belowSA * invTotalSA;
-            float pAbove = aboveSA * invTotalSA;
-            float eb = (nAbove == 0 || nBelow == 0) ? emptyBonus : 0;
-            float cost =
-                traversalCost +
-                isectCost * (1 - eb) * (pBelow * nBelow + pAbove * nAbove);
-
-            // Update best split if this is lowest cost so far
-            if (cost < bestCost) {
-                bestCost = cost;
-                bestAxis = axis;
-                bestOffset = i;
+    /* Sweep over the sorted events of all axes to find the split with the lowest SAH cost */
+    int bestAxis = -1;
+    size_t bestOffset = 0;
+    float bestCost = std::numeric_limits<float>::infinity();
+    float leafCost = m_intersectionCost * primCount;
+    float invTotalArea = 1.0f / bounds.getSurfaceArea();
+    Vector3f d = bounds.getExtents();
+
+    for (int axis = 0; axis < 3; ++axis) {
+        int otherAxis0 = (axis + 1) % 3, otherAxis1 = (axis + 2) % 3;
+        uint32_t below = 0, above = primCount;
+        const std::vector<Event> &list = events[axis];
+        for (size_t i = 0; i < list.size(); ++i) {
+            if (list[i].type == EEnd)
+                --above;
+            float t = list[i].t;
+            if (t > bounds.min[axis] && t < bounds.max[axis]) {
+                float belowArea = 2 * (d[otherAxis0] * d[otherAxis1] +
+                                       (t - bounds.min[axis]) * (d[otherAxis0] + d[otherAxis1]));
+                float aboveArea = 2 * (d[otherAxis0] * d[otherAxis1] +
+                                       (bounds.max[axis] - t) * (d[otherAxis0] + d[otherAxis1]));
+                float bonus = (above == 0 || below == 0) ? m_emptyBonus : 0.0f;
+                float cost = m_traversalCost + m_intersectionCost * (1 - bonus) *
+                    (belowArea * invTotalArea * below + aboveArea * invTotalArea * above);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
             }
+            if (list[i].type == EStart)
+                ++below;
         }
-        if (edges[axis][i].type == EdgeType::Start) ++nBelow;
     }
-    
 
-    // Create leaf if no good splits were found
-    if (bestAxis == -1 && retries < 2) {
-        ++retries;
-        axis = (axis + 1) % 3;
-        goto retrySplit;
-    }
-    if (bestCost > oldCost) ++badRefines;
-    if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
-        badRefines == 3) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+    /* Create a leaf if no split is worth it */
+    if (bestCost > leafCost)
+        ++badRefines;
+    if ((bestCost > 4 * leafCost && primCount < 16) || bestAxis == -1 || badRefines == 3) {
+        makeLeaf();
         return;
     }
 
-    // Classify primitives with respect to split
-    int n0 = 0, n1 = 0;
-    for (int i = 0; i < bestOffset; ++i)
-        if (edges[bestAxis][i].type == EdgeType::Start)
-            prims0[n0++] = edges[bestAxis][i].primNum;
-    for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
-        if (edges[bestAxis][i].type == EdgeType::End)
-            prims1[n1++] = edges[bestAxis][i].primNum;
-
-    // Recursively initialize children nodes
-    float tSplit = edges[bestAxis][bestOffset].t;
-    BoundingBox3f bounds0 = nodeBounds, bounds1 = nodeBounds;
-    bounds0.max[bestAxis] = bounds1.min[bestAxis] = tSplit;
-    buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
-    int aboveChild = nextFreeNode;
-    nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
-    buildTree(aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
+    /* Classify the triangles consistently with the counts of the sweep */
+    const std::vector<Event> &list = events[bestAxis];
+    for (size_t i = 0; i < bestOffset; ++i) {
+        if (list[i].type == EStart)
+            m_side[list[i].prim] |= EBelow;
+    }
+    for (size_t i = bestOffset + 1; i < list.size(); ++i) {
+        if (list[i].type == EEnd)
+            m_side[list[i].prim] |= EAbove;
+    }
+    float split = list[bestOffset].t;
+
+    uint32_t belowCount = 0, aboveCount = 0;
+    for (const Event &event : events[0]) {
+        if (event.type == EStart) {
+            belowCount += (m_side[event.prim] & EBelow) ? 1 : 0;
+            aboveCount += (m_side[event.prim] & EAbove) ? 1 : 0;
+        }
+    }
+
+    /* Splitting the event lists preserves their order */
+    EventList belowEvents, aboveEvents;
+    for (int axis = 0; axis < 3; ++axis) {
+        belowEvents[axis].reserve(2 * (size_t) belowCount);
+        aboveEvents[axis].reserve(2 * (size_t) aboveCount);
+        for (const Event &event : events[axis]) {
+            uint8_t side = m_side[event.prim];
+            if (side & EBelow)
+                belowEvents[axis].push_back(event);
+            if (side & EAbove)
+                aboveEvents[axis].push_back(event);
+        }
+    }
+    for (const Event &event : events[0])
+        m_side[event.prim] = 0;
+    for (int axis = 0; axis < 3; ++axis)
+        std::vector<Event>().swap(events[axis]);
+
+    BoundingBox3f belowBounds = bounds, aboveBounds = bounds;
+    belowBounds.max[bestAxis] = aboveBounds.min[bestAxis] = split;
+    buildNode(belowBounds, belowEvents, belowCount, depth - 1, badRefines);
+    m_nodes[index].initInterior(bestAxis, (uint32_t) m_nodes.size(), split);
+    buildNode(aboveBounds, aboveEvents, aboveCount, depth - 1, badRefines);
 }
 
-bool KdTree::Intersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const{
-    // Compute initial parametric range of ray inside kd-tree extent
+template <bool ShadowRay> bool KdTree::traverseTree(Ray3f &ray, Intersection *its, uint32_t &prim) const {
+    if (m_nodes.empty())
+        return false;
+
+    /* Compute the parametric range of the ray inside the tree */
     float tMin, tMax;
-    if (!bounds.rayIntersect(ray_,tMin,tMax)) {
+    if (!m_treeBounds.rayIntersect(ray, tMin, tMax))
+        return false;
+    tMin = std::max(tMin, ray.mint);
+    tMax = std::min(tMax, ray.maxt);
+    if (tMin > tMax)
         return false;
-    }
 
-    // Prepare to traverse kd-tree for ray
-    Vector3f invDir = ray_.dRcp;
-    const int maxTodo = 64;
-    KdToDo todo[maxTodo];
-    int todoPos = 0;
-    float u,v,t;
-    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
-
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
-    // Traverse kd-tree nodes in order for ray
-    bool hit = false;
-    const KdAccelNode *node = &nodes[0];
-    while (node != nullptr) {
-        // Bail out if we found a hit closer than the current node
-        if (ray_.maxt < tMin) break;
-        if (!node->IsLeaf()) {
-            // Process kd-tree interior node
-
-            // Compute parametric distance along ray to split plane
-            int axis = node->SplitAxis();
-            float tPlane = (node->SplitPos() - ray_.o[axis]) * invDir[axis];
-
-            // Get node children pointers for ray
-            const KdAccelNode *firstChild, *secondChild;
-            int belowFirst =
-                (ray_.o[axis] < node->SplitPos()) ||
-                (ray_.o[axis] == node->SplitPos() && ray_.d[axis] <= 0);
-            if (belowFirst) {
-                firstChild = node + 1;
-                secondChild = &nodes[node->AboveChild()];
+    /* Far children that still need to be visited, together with the ray segment inside them */
+    struct StackEntry {
+        uint32_t node;
+        float tMin, tMax;
+    };
+    StackEntry stack[MaxDepth];
+    uint32_t stackSize = 0, n = 0;
+    bool foundIntersection = false;
+
+    while (true) {
+        /* Nodes on the stack lie further along the ray than the current one */
+        if (ray.maxt < tMin)
+            break;
+
+        const KdTreeNode &node = m_nodes[n];
+        if (!node.isLeaf()) {
+            int axis = node.getAxis();
+            float tPlane = (node.split - ray.o[axis]) * ray.dRcp[axis];
+
+            /* Visit the child on the side of the ray origin first */
+            bool belowFirst = ray.o[axis] < node.split ||
+                              (ray.o[axis] == node.split && ray.d[axis] <= 0);
+            uint32_t first = belowFirst ? n + 1 : node.getAboveChild();
+            uint32_t second = belowFirst ? node.getAboveChild() : n + 1;
+
+            if (std::isnan(tPlane)) {
+                /* The ray runs within the splitting plane */
+                stack[stackSize++] = { second, tMin, tMax };
+                n = first;
+            } else if (tPlane > tMax || tPlane <= 0) {
+                n = first;
+            } else if (tPlane < tMin) {
+                n = second;
             } else {
-                firstChild = &nodes[node->AboveChild()];
-                secondChild = node + 1;
-            }
-
-            // Advance to next child node, possibly enqueue other child
-            if (tPlane > tMax || tPlane <= 0)
-                node = firstChild;
-            else if (tPlane < tMin)
-                node = secondChild;
-            else {
-                // Enqueue _secondChild_ in todo list
-                todo[todoPos].node = secondChild;
-                todo[todoPos].tMin = tPlane;
-                todo[todoPos].tMax = tMax;
-                ++todoPos;
-                node = firstChild;
+                stack[stackSize++] = { second, tPlane, tMax };
+                n = first;
                 tMax = tPlane;
             }
-        } else {
-            // Check for intersections inside leaf node
-            int nPrimitives = node->nPrimitives();
-            if (nPrimitives == 1) {
-                // Check one primitive inside leaf node
-                
-                if (mesh->rayIntersect(node->onePrimitive, ray_, u, v, t)) {
-                    hit = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = mesh;
-                    f = node->onePrimitive;
-                    }
-            } else {
-                for (int i = 0; i < nPrimitives; ++i) {
-                    int index =
-                        primitiveIndices[node->primitiveIndicesOffset + i];
-                    // Check one primitive inside leaf node
-                    if (mesh->rayIntersect(index, ray_, u, v, t)) {
-                        hit = true;
-                        ray.maxt = its.t = t;
-                        its.uv = Point2f(u, v);
-                        its.mesh = mesh;
-                        f = node->onePrimitive;
-                        }
+            continue;
+        }
+
+        uint32_t primCount = node.getPrimCount();
+        for (uint32_t i = 0; i < primCount; ++i) {
+            uint32_t candidate = primCount == 1 ? node.onePrim : m_indexes[node.primOffset + i];
+            uint32_t meshIndex = findMesh(candidate);
+            float u, v, t;
+            if (m_meshes[meshIndex]->rayIntersect(candidate - m_meshOffset[meshIndex], ray, u, v, t)) {
+                /* An intersection was found! Can terminate
+                   immediately if this is a shadow ray query */
+                if (ShadowRay) {
+                    prim = candidate;
+                    return true;
                 }
+                ray.maxt = its->t = t;
+                its->bary = Point2f(u, v);
+                prim = candidate;
+                foundIntersection = true;
             }
-
-            // Grab next node to process from todo list
-            if (todoPos > 0) {
-                --todoPos;
-                node = todo[todoPos].node;
-                tMin = todo[todoPos].tMin;
-                tMax = todo[todoPos].tMax;
-            } else
-                break;
-        }
-    }
-    if(shadowRay)
-        return hit;
-    else if (hit){
-Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
         }
+
+        if (stackSize == 0)
+            break;
+        --stackSize;
+        n = stack[stackSize].node;
+        tMin = stack[stackSize].tMin;
+        tMax = stack[stackSize].tMax;
     }
+
+    return foundIntersection;
 }
 
-NORI_NAMESPACE_END
\ No newline at end of file
+bool KdTree::traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const {
+    return traverseTree<false>(ray, &its, prim);
+}
+
+bool KdTree::occluded(const Ray3f &ray_, uint32_t &prim) const {
+    Ray3f ray(ray_);
+    return traverseTree<true>(ray, nullptr, prim);
+}
+
+std::string KdTree::toString() const {
+    return tfm::format(
+        "KdTree[\n"
+        "  intersectionCost = %f,\n"
+        "  traversalCost = %f,\n"
+        "  emptyBonus = %f,\n"
+        "  maxLeafSize = %i,\n"
+        "  maxDepth = %s\n"
+        "]",
+        m_intersectionCost,
+        m_traversalCost,
+        m_emptyBonus,
+        m_maxPrims,
+        m_maxDepth > 0 ? std::to_string(m_maxDepth) : std::string("auto")
+    );
+}
+
+NORI_REGISTER_CLASS(KdTree, "kdtree");
+
+NORI_NAMESPACE_END
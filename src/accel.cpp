@@ -3,232 +3,2599 @@
 
     Copyright (c) 2015 by Wenzel Jakob
 */
-#include <chrono>
+
 #include <nori/accel.h>
+#include <nori/instance.h>
+#include <nori/timer.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_group.h>
+#include <tbb/task_arena.h>
+#include <tbb/concurrent_vector.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
 void Accel::addMesh(Mesh *mesh) {
-    /*if (m_mesh)
-        throw NoriException("Accel: only a single mesh is supported!");
-    m_mesh = mesh;
-    m_bbox = m_mesh->getBoundingBox();*/
-
-    if (m_meshes.size() > 10)
-        throw NoriException("Accel: only 10 meshes are supported!");
+    uint64_t triangleCount = (uint64_t) m_meshOffset.back() + mesh->getTriangleCount();
+    if (triangleCount >= (uint64_t) std::numeric_limits<uint32_t>::max())
+        throw NoriException("Accel: the scene exceeds the maximum number of triangles!");
     m_meshes.push_back(mesh);
+    m_meshOffset.push_back((uint32_t) triangleCount);
     m_bbox.expandBy(mesh->getBoundingBox());
-    for (int i = 0; i < mesh->getTriangleCount(); i++) {
-        m_indexes.emplace_back(i, m_meshes.size() - 1);
-    }
 }
 
-void Accel::build() {
-    if (m_meshes.empty()) return;
+void Accel::addInstance(const Instance *instance) {
+    m_instances.push_back(instance);
+    m_bbox.expandBy(instance->getBoundingBox());
+}
+
+namespace {
+
+/// Number of bins used to evaluate split candidates along each axis
+constexpr uint32_t BinCount = 16;
+/// Triangle count above which binning and partitioning run in parallel
+constexpr uint32_t ParallelBinningThreshold = 128 * 1024;
+/// Triangle count above which the two subtrees of a node are built concurrently
+constexpr uint32_t ParallelBuildThreshold = 4 * 1024;
+/// Granularity of the parallel loops over triangles
+constexpr uint32_t GrainSize = 16 * 1024;
+/// Levels of the wide tree whose children are refitted concurrently
+constexpr uint32_t ParallelRefitDepth = 3;
+
+/// Per-triangle data that is only needed during construction
+struct BuildPrimitive {
+    BoundingBox3f bbox;
+    Point3f centroid;
+    uint32_t index;
+};
+
+/// Bounds of a range of triangles and of their centroids
+struct RangeBounds {
+    BoundingBox3f bbox, centroidBounds;
+
+    void add(const BuildPrimitive &prim) {
+        bbox.expandBy(prim.bbox);
+        centroidBounds.expandBy(prim.centroid);
+    }
+
+    void merge(const RangeBounds &other) {
+        bbox.expandBy(other.bbox);
+        centroidBounds.expandBy(other.centroidBounds);
+    }
+};
+
+/// Triangle bounds and counts of the SAH bins along all three axes
+struct Bins {
+    BoundingBox3f bounds[3][BinCount];
+    uint32_t counts[3][BinCount] = { };
+    Point3f origin;
+    Vector3f scale;
+
+    Bins(const BoundingBox3f &centroidBounds) : origin(centroidBounds.min) {
+        Vector3f extents = centroidBounds.getExtents();
+        for (int axis = 0; axis < 3; ++axis)
+            scale[axis] = extents[axis] > 0 ? BinCount / extents[axis] : 0.0f;
+    }
+
+    uint32_t binIndex(const BuildPrimitive &prim, int axis) const {
+        return std::min((uint32_t) ((prim.centroid[axis] - origin[axis]) * scale[axis]),
+                        BinCount - 1);
+    }
+
+    void add(const BuildPrimitive &prim) {
+        for (int axis = 0; axis < 3; ++axis) {
+            uint32_t b = binIndex(prim, axis);
+            bounds[axis][b].expandBy(prim.bbox);
+            counts[axis][b]++;
+        }
+    }
+
+    void merge(const Bins &other) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (uint32_t b = 0; b < BinCount; ++b) {
+                bounds[axis][b].expandBy(other.bounds[axis][b]);
+                counts[axis][b] += other.counts[axis][b];
+            }
+        }
+    }
+};
+
+/**
+ * \brief Top-down SAH builder
+ *
+ * Large nodes near the root compute their bounds and bins and partition
+ * their triangles with data-parallel loops. Further down, the two subtrees
+ * of every node are built as separate TBB tasks. Nodes are allocated from
+ * a concurrent vector in pairs, hence siblings are always adjacent.
+ */
+class BVHBuilder {
+public:
+    BVHBuilder(std::vector<BuildPrimitive> &prims, uint32_t maxLeafSize, uint32_t maxDepth,
+               uint32_t packetWidth, float traversalCost, float intersectionCost)
+        : m_prims(prims), m_maxLeafSize(maxLeafSize), m_maxDepth(maxDepth),
+          m_packetWidth(packetWidth), m_traversalCost(traversalCost),
+          m_intersectionCost(intersectionCost) { }
+
+    const tbb::concurrent_vector<BVHNode> &build() {
+        m_nodes.clear();
+        m_nodes.grow_by(1);
+        build(0, 0, (uint32_t) m_prims.size(), 1);
+        return m_nodes;
+    }
+
+private:
+    /// Accumulate the triangles in [begin, end) into \c result, in parallel if worthwhile
+    template <typename Result> void reduce(uint32_t begin, uint32_t end, Result &result) const {
+        if (end - begin < ParallelBinningThreshold) {
+            for (uint32_t i = begin; i < end; ++i)
+                result.add(m_prims[i]);
+            return;
+        }
+
+        result = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(begin, end, GrainSize), result,
+            [&](const tbb::blocked_range<uint32_t> &range, Result partial) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i)
+                    partial.add(m_prims[i]);
+                return partial;
+            },
+            [](Result a, const Result &b) {
+                a.merge(b);
+                return a;
+            }
+        );
+    }
+
+    /// Move the triangles that satisfy \c pred to the front of [begin, end)
+    template <typename Predicate> uint32_t partition(uint32_t begin, uint32_t end, const Predicate &pred) {
+        if (end - begin < ParallelBinningThreshold) {
+            auto it = std::partition(m_prims.begin() + begin, m_prims.begin() + end, pred);
+            return (uint32_t) (it - m_prims.begin());
+        }
+
+        /* Count the triangles on the left side per block, compute the
+           output offsets of every block and then scatter in parallel */
+        uint32_t blockCount = (end - begin + GrainSize - 1) / GrainSize;
+        std::vector<uint32_t> leftOffset(blockCount), rightOffset(blockCount);
+        tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+            uint32_t blockBegin = begin + block * GrainSize,
+                     blockEnd = std::min(blockBegin + GrainSize, end), count = 0;
+            for (uint32_t i = blockBegin; i < blockEnd; ++i)
+                count += pred(m_prims[i]) ? 1 : 0;
+            leftOffset[block] = count;
+            rightOffset[block] = blockEnd - blockBegin - count;
+        });
+
+        uint32_t leftTotal = 0, rightTotal = 0;
+        for (uint32_t block = 0; block < blockCount; ++block) {
+            uint32_t left = leftOffset[block], right = rightOffset[block];
+            leftOffset[block] = leftTotal;
+            rightOffset[block] = rightTotal;
+            leftTotal += left;
+            rightTotal += right;
+        }
+
+        std::vector<BuildPrimitive> temp(end - begin);
+        tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+            uint32_t blockBegin = begin + block * GrainSize,
+                     blockEnd = std::min(blockBegin + GrainSize, end),
+                     left = leftOffset[block], right = leftTotal + rightOffset[block];
+            for (uint32_t i = blockBegin; i < blockEnd; ++i) {
+                if (pred(m_prims[i]))
+                    temp[left++] = m_prims[i];
+                else
+                    temp[right++] = m_prims[i];
+            }
+        });
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, end - begin, GrainSize),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                std::copy(temp.begin() + range.begin(), temp.begin() + range.end(),
+                          m_prims.begin() + begin + range.begin());
+            }
+        );
+
+        return begin + leftTotal;
+    }
 
-    auto start = std::chrono::high_resolution_clock::now();
+    /// Recursively build the subtree of node \c n over the triangle range [begin, end)
+    void build(uint32_t n, uint32_t begin, uint32_t end, uint32_t depth) {
+        RangeBounds rangeBounds;
+        reduce(begin, end, rangeBounds);
+        const BoundingBox3f &bbox = rangeBounds.bbox;
+        m_nodes[n].bbox = bbox;
 
-    m_tree.clear();
-    auto root = AccelNode(m_bbox, getTotalTriangleCount());
-    root.indices = m_indexes;
-    m_tree.emplace_back(root);
+        uint32_t count = end - begin;
+        if (count == 1 || depth == m_maxDepth) {
+            makeLeaf(n, begin, end);
+            return;
+        }
 
-    std::queue<uint32_t> q;
-    q.push(0);
+        /* Evaluate the SAH at the boundaries between the bins along each axis.
+           Costs are expressed relative to the surface area of the current node */
+        Bins bins(rangeBounds.centroidBounds);
+        reduce(begin, end, bins);
+        float bestCost = std::numeric_limits<float>::infinity();
+        int bestAxis = -1;
+        uint32_t bestBin = 0;
 
-    auto children = std::vector<AccelNode>();
+        for (int axis = 0; axis < 3; ++axis) {
+            if (bins.scale[axis] == 0)
+                continue;
 
-    //get the limits
-    auto [LIMIT_COUNT, LIMIT_DEPTH] = getLimits();
+            /* Sweep from the right to find the bounds of all suffixes */
+            float rightArea[BinCount];
+            uint32_t rightCount[BinCount];
+            BoundingBox3f accum;
+            uint32_t accumCount = 0;
+            for (uint32_t b = BinCount - 1; b > 0; --b) {
+                accum.expandBy(bins.bounds[axis][b]);
+                accumCount += bins.counts[axis][b];
+                rightArea[b] = accumCount > 0 ? accum.getSurfaceArea() : 0.0f;
+                rightCount[b] = accumCount;
+            }
 
-    while (!q.empty()) {
-        uint32_t n = q.size();
-        for (uint32_t k = 0; k < n; k++) {
-            if (m_tree[q.front()].indices.size() > LIMIT_COUNT && depth_curr_ < LIMIT_DEPTH) {
-                m_tree[q.front()].child = m_tree.size();
-                divide(q.front(), &children);
-                --count_leaf_;
-                for (auto& child : children) {
-                    q.push(m_tree.size());
-                    m_tree.emplace_back(child);
-                    ++count_node_;
-                    ++count_leaf_;
+            /* .. and from the left to evaluate all split candidates */
+            accum.reset();
+            accumCount = 0;
+            for (uint32_t b = 1; b < BinCount; ++b) {
+                accum.expandBy(bins.bounds[axis][b - 1]);
+                accumCount += bins.counts[axis][b - 1];
+                if (accumCount == 0 || rightCount[b] == 0)
+                    continue;
+                float cost = packets(accumCount) * accum.getSurfaceArea() +
+                             packets(rightCount[b]) * rightArea[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
                 }
             }
-            q.pop();
-            children.clear();
-            children.shrink_to_fit();
         }
-        depth_curr_++;
+
+        uint32_t mid;
+        if (bestAxis == -1) {
+            /* All centroids coincide, the SAH cannot separate these triangles */
+            if (count <= m_maxLeafSize) {
+                makeLeaf(n, begin, end);
+                return;
+            }
+            bestAxis = bbox.getMajorAxis();
+            mid = begin + count / 2;
+        } else {
+            float area = bbox.getSurfaceArea();
+            float leafCost = m_intersectionCost * packets(count);
+            float splitCost = area > 0 ? m_traversalCost + m_intersectionCost * bestCost / area
+                                       : leafCost;
+            if (count <= m_maxLeafSize && leafCost <= splitCost) {
+                makeLeaf(n, begin, end);
+                return;
+            }
+
+            mid = partition(begin, end, [&](const BuildPrimitive &prim) {
+                return bins.binIndex(prim, bestAxis) < bestBin;
+            });
+        }
+
+        /* Allocate both children next to each other */
+        uint32_t child = (uint32_t) (m_nodes.grow_by(2) - m_nodes.begin());
+        BVHNode &node = m_nodes[n];
+        node.child = child;
+        node.primCount = 0;
+        node.axis = (uint8_t) bestAxis;
+
+        if (count > ParallelBuildThreshold) {
+            tbb::task_group group;
+            group.run([=] { build(child, begin, mid, depth + 1); });
+            build(child + 1, mid, end, depth + 1);
+            group.wait();
+        } else {
+            build(child, begin, mid, depth + 1);
+            build(child + 1, mid, end, depth + 1);
+        }
+    }
+
+    /// Turn node \c n into a leaf that references the triangle range [begin, end)
+    void makeLeaf(uint32_t n, uint32_t begin, uint32_t end) {
+        if (end - begin > std::numeric_limits<uint16_t>::max())
+            throw NoriException("Accel: a leaf node cannot reference more than 65535 triangles!");
+        BVHNode &node = m_nodes[n];
+        node.primOffset = begin;
+        node.primCount = (uint16_t) (end - begin);
+        node.axis = 0;
+    }
+
+    /// Leaves are intersected one packet at a time, hence the SAH counts packets
+    uint32_t packets(uint32_t count) const {
+        return (count + m_packetWidth - 1) / m_packetWidth;
+    }
+
+private:
+    std::vector<BuildPrimitive> &m_prims;
+    tbb::concurrent_vector<BVHNode> m_nodes;
+    uint32_t m_maxLeafSize, m_maxDepth, m_packetWidth;
+    float m_traversalCost, m_intersectionCost;
+};
+
+/// Minimum overlap of the children of the best object split (relative to the
+/// surface area of the root) above which spatial splits are evaluated
+constexpr float SpatialSplitAlpha = 1e-5f;
+
+/// Triangle counts and clipped triangle bounds of the spatial bins along all three axes
+struct SpatialBins {
+    BoundingBox3f bounds[3][BinCount];
+    uint32_t entries[3][BinCount] = { };
+    uint32_t exits[3][BinCount] = { };
+
+    void merge(const SpatialBins &other) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (uint32_t b = 0; b < BinCount; ++b) {
+                bounds[axis][b].expandBy(other.bounds[axis][b]);
+                entries[axis][b] += other.entries[axis][b];
+                exits[axis][b] += other.exits[axis][b];
+            }
+        }
     }
+};
 
-    auto over = std::chrono::high_resolution_clock::now();
-    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(over - start).count();
+/// Accumulate \c count items into \c result using \c add, in parallel if worthwhile
+template <typename Result, typename Add> void reduceItems(size_t count, Result &result, const Add &add) {
+    if (count < ParallelBinningThreshold) {
+        for (size_t i = 0; i < count; ++i)
+            add(result, i);
+        return;
+    }
 
-    std::cout << "[build time]: " << time << "ms" << std::endl;
-    std::cout << "[max depth]: " << depth_curr_ << std::endl;
-    std::cout << "[node count]: " << count_node_ << std::endl;
-    std::cout << "[leaf count]: " << count_leaf_ << std::endl;
+    result = tbb::parallel_reduce(
+        tbb::blocked_range<size_t>(0, count, GrainSize), result,
+        [&](const tbb::blocked_range<size_t> &range, Result partial) {
+            for (size_t i = range.begin(); i < range.end(); ++i)
+                add(partial, i);
+            return partial;
+        },
+        [](Result a, const Result &b) {
+            a.merge(b);
+            return a;
+        }
+    );
 }
 
-void Accel::divide(uint32_t n, std::vector<AccelNode>* children) {
-    auto& node = m_tree[n];
-    Vector3f center = node.bbox.getCenter();
-    for (size_t i = 0; i < 8; i++) {
+/**
+ * \brief Top-down SAH builder with spatial splits (Stich et al. [2009])
+ *
+ * Besides partitioning the triangles of a node by their centroids (object
+ * splits), this builder also considers planes that cut through triangles
+ * (spatial splits). Triangles that straddle the plane are then referenced
+ * by both children, with bounds clipped to the respective side, which
+ * removes the overlap between the children. Spatial splits are evaluated
+ * only where the children of the best object split overlap, and at most
+ * \c duplicationBudget times the triangle count additional references are
+ * created overall.
+ *
+ * Every node owns the array of its references, since spatial splits make
+ * the arrays of the children larger than that of their parent. Leaves
+ * append their references to a concurrent output array.
+ */
+class SBVHBuilder {
+public:
+    SBVHBuilder(std::vector<BuildPrimitive> &&prims, const std::vector<Mesh *> &meshes,
+                const std::vector<uint32_t> &meshOffset, uint32_t maxLeafSize, uint32_t maxDepth,
+                uint32_t packetWidth, float traversalCost, float intersectionCost,
+                float duplicationBudget)
+        : m_prims(std::move(prims)), m_meshes(meshes), m_meshOffset(meshOffset),
+          m_maxLeafSize(maxLeafSize), m_maxDepth(maxDepth), m_packetWidth(packetWidth),
+          m_traversalCost(traversalCost), m_intersectionCost(intersectionCost),
+          m_duplicationBudget(duplicationBudget) { }
+
+    const tbb::concurrent_vector<BVHNode> &build() {
+        m_nodes.clear();
+        m_references.clear();
+        m_remainingDuplicates = (int64_t) (m_duplicationBudget * m_prims.size());
+
+        RangeBounds rootBounds = bounds(m_prims);
+        m_rootArea = rootBounds.bbox.getSurfaceArea();
+
+        m_nodes.grow_by(1);
+        build(0, std::move(m_prims), 1);
+        return m_nodes;
+    }
+
+    /// Global primitive IDs of all references, ordered by the leaves that contain them
+    const tbb::concurrent_vector<uint32_t> &references() const { return m_references; }
 
-        Vector3f corner = node.bbox.getCorner(i);
-        BoundingBox3f bbox_sub;
-        for (uint32_t j = 0; j < 3; j++) {
-            bbox_sub.min[j] = std::min(center[j], corner[j]);
-            bbox_sub.max[j] = std::max(center[j], corner[j]);
+private:
+    /// Best split of a node found so far
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        uint32_t bin = 0;
+        bool spatial = false;
+        /// Bounds and triangle counts of both sides
+        BoundingBox3f left, right;
+        uint32_t leftCount = 0, rightCount = 0;
+    };
+
+    RangeBounds bounds(const std::vector<BuildPrimitive> &prims) const {
+        RangeBounds result;
+        reduceItems(prims.size(), result, [&](RangeBounds &r, size_t i) { r.add(prims[i]); });
+        return result;
+    }
+
+    /// Fetch the vertices of a triangle
+    void triangle(uint32_t prim, Point3f *p) const {
+        uint32_t meshIndex = (uint32_t) (std::upper_bound(m_meshOffset.begin(), m_meshOffset.end(), prim)
+                                         - m_meshOffset.begin()) - 1;
+        const MeshMatrixXf &V = m_meshes[meshIndex]->getVertexPositions();
+        const MeshMatrixXu &F = m_meshes[meshIndex]->getIndices();
+        uint32_t face = prim - m_meshOffset[meshIndex];
+        for (int j = 0; j < 3; ++j)
+            p[j] = V.col(F(j, face));
+    }
+
+    /// Split a reference at the plane \c axis = \c pos into the bounds of both sides
+    void splitReference(const BuildPrimitive &prim, int axis, float pos,
+                        BoundingBox3f &left, BoundingBox3f &right) const {
+        Point3f p[3];
+        triangle(prim.index, p);
+        left.reset();
+        right.reset();
+        for (int j = 0; j < 3; ++j) {
+            const Point3f &v0 = p[j], &v1 = p[(j + 1) % 3];
+            if (v0[axis] <= pos)
+                left.expandBy(v0);
+            if (v0[axis] >= pos)
+                right.expandBy(v0);
+            /* The edge crosses the plane */
+            if ((v0[axis] < pos && v1[axis] > pos) || (v0[axis] > pos && v1[axis] < pos)) {
+                float t = (pos - v0[axis]) / (v1[axis] - v0[axis]);
+                Point3f q = v0 + (v1 - v0) * std::min(std::max(t, 0.0f), 1.0f);
+                q[axis] = pos;
+                left.expandBy(q);
+                right.expandBy(q);
+            }
         }
+        left.max[axis] = pos;
+        right.min[axis] = pos;
+        left.clip(prim.bbox);
+        right.clip(prim.bbox);
+    }
+
+    void findObjectSplit(const std::vector<BuildPrimitive> &prims, Bins &bins, Split &best) const {
+        reduceItems(prims.size(), bins, [&](Bins &b, size_t i) { b.add(prims[i]); });
 
-        AccelNode node_sub(bbox_sub);
-        for (auto [faceIndex, meshIdx] : node.indices) {
+        for (int axis = 0; axis < 3; ++axis) {
+            if (bins.scale[axis] == 0)
+                continue;
 
-            if (bbox_sub.overlaps(m_meshes[meshIdx]->getBoundingBox(faceIndex))) {
-                node_sub.indices.emplace_back(faceIndex, meshIdx);
+            BoundingBox3f rightBounds[BinCount];
+            uint32_t rightCount[BinCount];
+            BoundingBox3f accum;
+            uint32_t accumCount = 0;
+            for (uint32_t b = BinCount - 1; b > 0; --b) {
+                accum.expandBy(bins.bounds[axis][b]);
+                accumCount += bins.counts[axis][b];
+                rightBounds[b] = accum;
+                rightCount[b] = accumCount;
+            }
+
+            accum.reset();
+            accumCount = 0;
+            for (uint32_t b = 1; b < BinCount; ++b) {
+                accum.expandBy(bins.bounds[axis][b - 1]);
+                accumCount += bins.counts[axis][b - 1];
+                if (accumCount == 0 || rightCount[b] == 0)
+                    continue;
+                float cost = packets(accumCount) * accum.getSurfaceArea() +
+                             packets(rightCount[b]) * rightBounds[b].getSurfaceArea();
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = b;
+                    best.left = accum;
+                    best.right = rightBounds[b];
+                    best.leftCount = accumCount;
+                    best.rightCount = rightCount[b];
+                }
             }
         }
-        children->emplace_back(node_sub);
     }
-}
 
-bool Accel::traverse(uint32_t n, Ray3f& ray, Intersection& its, uint32_t& f, bool shadowRay) const {
-    auto& node = m_tree[n];
+    void findSpatialSplit(const std::vector<BuildPrimitive> &prims, const BoundingBox3f &bbox,
+                          Split &best) const {
+        Vector3f binSize = bbox.getExtents() / (float) BinCount;
+        auto clampBin = [](float b) {
+            return (uint32_t) std::min(std::max((int) b, 0), (int) BinCount - 1);
+        };
 
-    if (!node.bbox.rayIntersect(ray))
-        return false;
+        /* Clip every reference against the bins that it overlaps */
+        SpatialBins bins;
+        reduceItems(prims.size(), bins, [&](SpatialBins &sb, size_t i) {
+            const BuildPrimitive &prim = prims[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                if (binSize[axis] <= 0)
+                    continue;
+                /* Like in partitionSpatial(), references that end on a bin
+                   boundary belong to the left side, unless they are flat */
+                uint32_t first = clampBin(std::floor((prim.bbox.min[axis] - bbox.min[axis]) / binSize[axis])),
+                         last = clampBin(std::ceil((prim.bbox.max[axis] - bbox.min[axis]) / binSize[axis]) - 1);
+                last = std::max(first, last);
+                BuildPrimitive remainder = prim;
+                for (uint32_t b = first; b < last; ++b) {
+                    BoundingBox3f left, right;
+                    splitReference(remainder, axis, bbox.min[axis] + binSize[axis] * (b + 1), left, right);
+                    sb.bounds[axis][b].expandBy(left);
+                    remainder.bbox = right;
+                }
+                sb.bounds[axis][last].expandBy(remainder.bbox);
+                sb.entries[axis][first]++;
+                sb.exits[axis][last]++;
+            }
+        });
 
-    bool isHit = false;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (binSize[axis] <= 0)
+                continue;
 
-    if (node.child == 0) {
-        float u, v, t;
-        for (auto [faceIndex, meshIndex] : node.indices) {
-            if (m_meshes[meshIndex]->rayIntersect(faceIndex, ray, u, v, t) && t < ray.maxt) {
-                if (shadowRay) {
-                    return true;
+            BoundingBox3f rightBounds[BinCount];
+            uint32_t rightCount[BinCount];
+            BoundingBox3f accum;
+            uint32_t accumCount = 0;
+            for (uint32_t b = BinCount - 1; b > 0; --b) {
+                accum.expandBy(bins.bounds[axis][b]);
+                accumCount += bins.exits[axis][b];
+                rightBounds[b] = accum;
+                rightCount[b] = accumCount;
+            }
+
+            accum.reset();
+            accumCount = 0;
+            for (uint32_t b = 1; b < BinCount; ++b) {
+                accum.expandBy(bins.bounds[axis][b - 1]);
+                accumCount += bins.entries[axis][b - 1];
+                if (accumCount == 0 || rightCount[b] == 0)
+                    continue;
+                float cost = packets(accumCount) * accum.getSurfaceArea() +
+                             packets(rightCount[b]) * rightBounds[b].getSurfaceArea();
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = b;
+                    best.spatial = true;
+                    best.left = accum;
+                    best.right = rightBounds[b];
+                    best.leftCount = accumCount;
+                    best.rightCount = rightCount[b];
                 }
-                ray.maxt = t;
-                its.t = t;
-                its.uv = Point2f(u, v);
-                its.mesh = m_meshes[meshIndex];
-                f = faceIndex;
-                isHit = true;
             }
         }
     }
-    else {
-        std::pair<uint32_t, float> children[8] = {};
-        for (uint32_t i = 0; i < 8; i++) {
-            auto ptr = node.child + i;
-            //get the distance from node to light source
-            children[i] = { ptr, m_tree[ptr].bbox.distanceTo(ray.o) };
+
+    /**
+     * \brief Distribute the references among the two sides of a spatial split
+     *
+     * Straddling references are only duplicated if that is cheaper than
+     * moving them to one side in their entirety ("reference unsplitting")
+     */
+    void partitionSpatial(const std::vector<BuildPrimitive> &prims, Split &split, float pos,
+                          std::vector<BuildPrimitive> &left, std::vector<BuildPrimitive> &right) const {
+        int axis = split.axis;
+        float leftCount = (float) split.leftCount, rightCount = (float) split.rightCount;
+        for (const BuildPrimitive &prim : prims) {
+            if (prim.bbox.max[axis] <= pos && prim.bbox.min[axis] < pos) {
+                left.push_back(prim);
+                continue;
+            } else if (prim.bbox.min[axis] >= pos) {
+                right.push_back(prim);
+                continue;
+            }
+
+            BoundingBox3f leftUnsplit = BoundingBox3f::merge(split.left, prim.bbox),
+                          rightUnsplit = BoundingBox3f::merge(split.right, prim.bbox);
+            float splitCost = split.left.getSurfaceArea() * leftCount +
+                              split.right.getSurfaceArea() * rightCount;
+            float leftCost = leftUnsplit.getSurfaceArea() * leftCount +
+                             split.right.getSurfaceArea() * (rightCount - 1);
+            float rightCost = split.left.getSurfaceArea() * (leftCount - 1) +
+                              rightUnsplit.getSurfaceArea() * rightCount;
+
+            BoundingBox3f leftPart, rightPart;
+            splitReference(prim, axis, pos, leftPart, rightPart);
+            if ((leftCost < splitCost && leftCost <= rightCost) || !rightPart.isValid()) {
+                split.left = leftUnsplit;
+                rightCount -= 1;
+                left.push_back(prim);
+            } else if (rightCost < splitCost || !leftPart.isValid()) {
+                split.right = rightUnsplit;
+                leftCount -= 1;
+                right.push_back(prim);
+            } else {
+                BuildPrimitive l = prim, r = prim;
+                l.bbox = leftPart;
+                l.centroid = leftPart.getCenter();
+                r.bbox = rightPart;
+                r.centroid = rightPart.getCenter();
+                left.push_back(l);
+                right.push_back(r);
+            }
+        }
+    }
+
+    void build(uint32_t n, std::vector<BuildPrimitive> prims, uint32_t depth) {
+        RangeBounds rangeBounds = bounds(prims);
+        const BoundingBox3f &bbox = rangeBounds.bbox;
+        m_nodes[n].bbox = bbox;
+
+        uint32_t count = (uint32_t) prims.size();
+        if (count == 1 || depth == m_maxDepth) {
+            makeLeaf(n, prims);
+            return;
+        }
+
+        Split best;
+        Bins bins(rangeBounds.centroidBounds);
+        findObjectSplit(prims, bins, best);
+        Split objectSplit = best;
+
+        /* Only look for spatial splits if the children of the object split overlap */
+        if (best.axis != -1 && m_remainingDuplicates > 0) {
+            BoundingBox3f overlap = best.left;
+            overlap.clip(best.right);
+            if (overlap.isValid() && overlap.getSurfaceArea() > SpatialSplitAlpha * m_rootArea)
+                findSpatialSplit(prims, bbox, best);
+        }
+
+        if (best.axis == -1) {
+            /* All centroids coincide, the SAH cannot separate these triangles */
+            if (count <= m_maxLeafSize) {
+                makeLeaf(n, prims);
+                return;
+            }
+        } else {
+            float area = bbox.getSurfaceArea();
+            float leafCost = m_intersectionCost * packets(count);
+            float splitCost = area > 0 ? m_traversalCost + m_intersectionCost * best.cost / area
+                                       : leafCost;
+            if (count <= m_maxLeafSize && leafCost <= splitCost) {
+                makeLeaf(n, prims);
+                return;
+            }
+        }
+
+        std::vector<BuildPrimitive> left, right;
+        if (best.spatial) {
+            float pos = bbox.min[best.axis] + bbox.getExtents()[best.axis] * best.bin / (float) BinCount;
+            partitionSpatial(prims, best, pos, left, right);
+
+            /* Take the duplicates from the budget, or fall back to an object split */
+            int64_t duplicates = (int64_t) (left.size() + right.size()) - count;
+            if (left.empty() || right.empty() ||
+                m_remainingDuplicates.fetch_sub(duplicates) < duplicates) {
+                if (!left.empty() && !right.empty())
+                    m_remainingDuplicates.fetch_add(duplicates);
+                left.clear();
+                right.clear();
+                best = objectSplit;
+            }
+        }
+
+        if (!best.spatial) {
+            auto mid = best.axis == -1 ? prims.begin() + count / 2 :
+                std::partition(prims.begin(), prims.end(), [&](const BuildPrimitive &prim) {
+                    return bins.binIndex(prim, best.axis) < best.bin;
+                });
+            left.assign(prims.begin(), mid);
+            right.assign(mid, prims.end());
+            if (best.axis == -1)
+                best.axis = bbox.getMajorAxis();
+        }
+        std::vector<BuildPrimitive>().swap(prims);
+
+        /* Allocate both children next to each other */
+        uint32_t child = (uint32_t) (m_nodes.grow_by(2) - m_nodes.begin());
+        BVHNode &node = m_nodes[n];
+        node.child = child;
+        node.primCount = 0;
+        node.axis = (uint8_t) best.axis;
+
+        if (count > ParallelBuildThreshold) {
+            tbb::task_group group;
+            group.run([&] { build(child, std::move(left), depth + 1); });
+            build(child + 1, std::move(right), depth + 1);
+            group.wait();
+        } else {
+            build(child, std::move(left), depth + 1);
+            build(child + 1, std::move(right), depth + 1);
+        }
+    }
+
+    /// Turn node \c n into a leaf that references the given triangles
+    void makeLeaf(uint32_t n, const std::vector<BuildPrimitive> &prims) {
+        if (prims.size() > std::numeric_limits<uint16_t>::max())
+            throw NoriException("Accel: a leaf node cannot reference more than 65535 triangles!");
+        auto it = m_references.grow_by(prims.size());
+        BVHNode &node = m_nodes[n];
+        node.primOffset = (uint32_t) (it - m_references.begin());
+        node.primCount = (uint16_t) prims.size();
+        node.axis = 0;
+        for (const BuildPrimitive &prim : prims)
+            *it++ = prim.index;
+    }
+
+    uint32_t packets(uint32_t count) const {
+        return (count + m_packetWidth - 1) / m_packetWidth;
+    }
+
+private:
+    std::vector<BuildPrimitive> m_prims;
+    const std::vector<Mesh *> &m_meshes;
+    const std::vector<uint32_t> &m_meshOffset;
+    tbb::concurrent_vector<BVHNode> m_nodes;
+    tbb::concurrent_vector<uint32_t> m_references;
+    std::atomic<int64_t> m_remainingDuplicates;
+    uint32_t m_maxLeafSize, m_maxDepth, m_packetWidth;
+    float m_traversalCost, m_intersectionCost, m_duplicationBudget;
+    float m_rootArea = 0.0f;
+};
+
+}
+
+namespace {
+
+/// Count the triangle references stored in an array of packets
+template <int Width> size_t countReferences(const AccelBuffer<TrianglePacket<Width>> &packets) {
+    size_t count = 0;
+    for (size_t i = 0; i < packets.size(); ++i)
+        for (int lane = 0; lane < Width; ++lane)
+            count += std::isnan(packets[i].p[0][0][lane]) ? 0 : 1;
+    return count;
+}
+
+/// Size of a wide node with full-precision (float) child bounds, for comparison with the quantized layout
+template <int Width> constexpr size_t fullPrecisionNodeSize() {
+    return (sizeof(float) * 6 * Width + sizeof(uint32_t) * Width + sizeof(uint16_t) * Width + 31) / 32 * 32;
+}
+
+}
+
+template <typename NodeArray> uint32_t Accel::flatten(const NodeArray &nodes, std::vector<BVHNode> &target,
+                                                      uint32_t src, uint32_t dst) {
+    const BVHNode &node = nodes[src];
+    target[dst] = node;
+
+    if (node.isLeaf())
+        return 1;
+
+    uint32_t child = (uint32_t) target.size();
+    target.resize(target.size() + 2);
+    target[dst].child = child;
+    return 1 + std::max(flatten(nodes, target, node.child, child),
+                        flatten(nodes, target, node.child + 1, child + 1));
+}
+
+uint32_t BVH::buildBinary(const std::vector<uint32_t> &subset, uint32_t maxDepth) {
+    std::vector<BuildPrimitive> prims(subset.empty() ? getTotalTriangleCount() : subset.size());
+    if (subset.empty()) {
+        for (uint32_t meshIndex = 0; meshIndex < m_meshes.size(); ++meshIndex) {
+            const Mesh *mesh = m_meshes[meshIndex];
+            uint32_t offset = m_meshOffset[meshIndex];
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh->getTriangleCount(), GrainSize),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                        BuildPrimitive &prim = prims[offset + i];
+                        prim.bbox = mesh->getBoundingBox(i);
+                        prim.centroid = prim.bbox.getCenter();
+                        prim.index = offset + i;
+                    }
+                }
+            );
         }
-        //sort based on the node distance
-        std::sort(
-            children,
-            children + 8,
-            [](const auto& lhs, const auto& rhs) {
-                return lhs.second < rhs.second;
+    } else {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, subset.size(), GrainSize),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i < range.end(); ++i) {
+                    uint32_t meshIndex = findMesh(subset[i]);
+                    BuildPrimitive &prim = prims[i];
+                    prim.bbox = m_meshes[meshIndex]->getBoundingBox(subset[i] - m_meshOffset[meshIndex]);
+                    prim.centroid = prim.bbox.getCenter();
+                    prim.index = subset[i];
+                }
             }
         );
-        //traverse
-        for (auto& child : children) {
-            isHit |= traverse(child.first, ray, its, f, shadowRay);
-            if (shadowRay && isHit) {
-                return true;
+    }
+
+    /* The task-parallel builds allocate nodes in a nondeterministic order.
+       Store them depth-first so that the layout does not depend on the
+       scheduling, and the triangles in the order of the leaves */
+    auto flattenNodes = [&](const tbb::concurrent_vector<BVHNode> &nodes) {
+        m_nodes.clear();
+        m_nodes.reserve(nodes.size());
+        m_nodes.emplace_back();
+        return flatten(nodes, m_nodes, 0, 0);
+    };
+
+    uint32_t depth;
+    if (m_buildMode == ESpatialSplits) {
+        SBVHBuilder builder(std::move(prims), m_meshes, m_meshOffset, m_maxLeafSize, maxDepth,
+                            packetWidth(), m_traversalCost, m_intersectionCost, m_duplicationBudget);
+        depth = flattenNodes(builder.build());
+        m_indexes.assign(builder.references().begin(), builder.references().end());
+    } else {
+        BVHBuilder builder(prims, m_maxLeafSize, maxDepth, packetWidth(),
+                           m_traversalCost, m_intersectionCost);
+        depth = flattenNodes(builder.build());
+        m_indexes.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); ++i)
+            m_indexes[i] = prims[i].index;
+    }
+
+    return depth;
+}
+
+void BVH::buildTriangles() {
+    m_treeDepth = buildBinary({ }, m_maxDepth);
+
+    /* Collapse into the node layout of the widest available kernel */
+    if (m_simdLevel == EAVX2) {
+        std::vector<WideBVHNode<8>> wideNodes;
+        std::vector<TrianglePacket<8>> packets;
+        collapse(wideNodes, packets, 0);
+        m_nodes8.assign(std::move(wideNodes));
+        m_packets8.assign(std::move(packets));
+    } else {
+        std::vector<WideBVHNode<4>> wideNodes;
+        std::vector<TrianglePacket<4>> packets;
+        collapse(wideNodes, packets, 0);
+        m_nodes4.assign(std::move(wideNodes));
+        m_packets4.assign(std::move(packets));
+    }
+}
+
+void Accel::buildInstances() {
+    m_instanceNodes.clear();
+    m_instanceIndexes.clear();
+    if (m_instances.empty())
+        return;
+
+    std::vector<BuildPrimitive> prims(m_instances.size());
+    for (uint32_t i = 0; i < m_instances.size(); ++i) {
+        prims[i].bbox = m_instances[i]->getBoundingBox();
+        prims[i].centroid = prims[i].bbox.getCenter();
+        prims[i].index = i;
+    }
+
+    /* Instances are tested one at a time, hence every leaf holds just one */
+    BVHBuilder builder(prims, 1, MaxDepth, 1, 1.0f, 1.0f);
+    const tbb::concurrent_vector<BVHNode> &nodes = builder.build();
+
+    m_instanceNodes.reserve(nodes.size());
+    m_instanceNodes.emplace_back();
+    flatten(nodes, m_instanceNodes, 0, 0);
+
+    m_instanceIndexes.resize(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i)
+        m_instanceIndexes[i] = prims[i].index;
+}
+
+void Accel::refitInstances() {
+    m_bbox.reset();
+    for (const Mesh *mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+    for (const Instance *instance : m_instances)
+        m_bbox.expandBy(instance->getBoundingBox());
+
+    /* Children of the top-level tree are stored after their parents */
+    for (size_t n = m_instanceNodes.size(); n-- > 0; ) {
+        BVHNode &node = m_instanceNodes[n];
+        node.bbox.reset();
+        if (node.isLeaf()) {
+            for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i)
+                node.bbox.expandBy(m_instances[m_instanceIndexes[i]]->getBoundingBox());
+        } else {
+            node.bbox.expandBy(m_instanceNodes[node.child].bbox);
+            node.bbox.expandBy(m_instanceNodes[node.child + 1].bbox);
+        }
+    }
+}
+
+BVH::BVH(const PropertyList &props) {
+    std::string builder = props.getString("builder", "binned");
+    if (builder == "sbvh")
+        m_buildMode = ESpatialSplits;
+    else if (builder != "binned")
+        throw NoriException("BVH: unknown builder \"%s\"!", builder);
+    m_duplicationBudget = props.getFloat("duplicationBudget", m_duplicationBudget);
+
+    int maxLeafSize = props.getInteger("maxLeafSize", (int) m_maxLeafSize);
+    int maxDepth = props.getInteger("maxDepth", (int) m_maxDepth);
+    if (maxLeafSize < 1 || maxLeafSize > 65535)
+        throw NoriException("BVH: the maximum leaf size must be between 1 and 65535!");
+    if (maxDepth < 1 || maxDepth > (int) MaxDepth)
+        throw NoriException("BVH: the maximum depth must be between 1 and %i!", MaxDepth);
+    m_maxLeafSize = (uint32_t) maxLeafSize;
+    m_maxDepth = (uint32_t) maxDepth;
+
+    m_traversalCost = props.getFloat("traversalCost", m_traversalCost);
+    m_intersectionCost = props.getFloat("intersectionCost", m_intersectionCost);
+    m_maxCostGrowth = props.getFloat("maxCostGrowth", m_maxCostGrowth);
+    if (m_duplicationBudget < 0 || m_traversalCost <= 0 || m_intersectionCost <= 0 || m_maxCostGrowth < 1)
+        throw NoriException("BVH: invalid cost parameters!");
+}
+
+void BVH::build(bool verbose) {
+    Timer timer;
+
+    m_simdLevel = getSIMDLevel();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_packets4.clear();
+    m_packets8.clear();
+    m_cacheFile.reset();
+
+    if (getTotalTriangleCount() > 0) {
+        bool useCache = !getCacheDirectory().empty();
+        uint64_t key = useCache ? cacheKey() : 0;
+        if (!useCache || !loadCache(key)) {
+            Timer triangleTimer;
+            buildTriangles();
+            m_cachedBuildTime = triangleTimer.elapsed();
+            if (useCache)
+                saveCache(key);
+        }
+    }
+    buildInstances();
+
+    if (!m_nodes8.empty())
+        resetNodeCosts(m_nodes8);
+    else if (!m_nodes4.empty())
+        resetNodeCosts(m_nodes4);
+    m_referenceCount = countReferences(m_packets4) + countReferences(m_packets8);
+
+    m_buildTime = timer.elapsed();
+
+    if (verbose) {
+        std::cout << "[build time]: " << timeString(m_buildTime) << " ("
+                  << tbb::this_task_arena::max_concurrency() << " threads)" << std::endl;
+        if (m_cacheFile) {
+            std::cout << "[accel cache]: loaded \"" << m_cacheFile->getFilename() << "\" ("
+                      << memString(m_cacheFile->size()) << ") in " << timeString(m_buildTime)
+                      << ", building took " << timeString(m_cachedBuildTime) << std::endl;
+        }
+        if (!m_nodes.empty()) {
+            size_t leafCount = std::count_if(m_nodes.begin(), m_nodes.end(),
+                                             [](const BVHNode &node) { return node.isLeaf(); });
+            std::cout << "[max depth]: " << m_treeDepth << std::endl;
+            std::cout << "[node count]: " << m_nodes.size() << std::endl;
+            std::cout << "[leaf count]: " << leafCount << std::endl;
+            std::cout << "[SAH cost]: " << sahCost() << std::endl;
+        }
+        if (!m_nodes4.empty() || !m_nodes8.empty()) {
+            std::cout << "[wide nodes]: " << m_nodes4.size() + m_nodes8.size() << " (BVH"
+                      << packetWidth() << ", "
+                      << simdLevelName(m_simdLevel) << " kernel)" << std::endl;
+            size_t packetCount = m_packets4.size() + m_packets8.size();
+            size_t packetSize = m_simdLevel == EAVX2 ? sizeof(TrianglePacket<8>) : sizeof(TrianglePacket<4>);
+            std::cout << "[triangle packets]: " << packetCount << " ("
+                      << memString(packetCount * packetSize) << ", "
+                      << tfm::format("%.1f", 100.0 * m_referenceCount / (packetCount * packetWidth()))
+                      << "% of lanes used)" << std::endl;
+            if (m_buildMode == ESpatialSplits) {
+                std::cout << "[triangle references]: " << m_referenceCount << " ("
+                          << tfm::format("%.1f", 100.0 * m_referenceCount / getTotalTriangleCount() - 100.0)
+                          << "% duplicates from spatial splits)" << std::endl;
             }
+            size_t nodeCount = m_nodes4.size() + m_nodes8.size();
+            size_t fullPrecisionSize = packetCount * packetSize + nodeCount *
+                (m_simdLevel == EAVX2 ? fullPrecisionNodeSize<8>() : fullPrecisionNodeSize<4>());
+            std::cout << "[accel memory]: " << memString(getMemoryUsage()) << ", "
+                      << tfm::format("%.1f", (double) getMemoryUsage() / getTotalTriangleCount())
+                      << " bytes/triangle ("
+                      << tfm::format("%.1f", (double) fullPrecisionSize / getTotalTriangleCount())
+                      << " with full-precision child bounds)" << std::endl;
+            std::cout << "[wide SAH cost]: " << m_buildCost << std::endl;
+        }
+        if (!m_instances.empty()) {
+            std::cout << "[instances]: " << m_instances.size() << " ("
+                      << m_instanceNodes.size() << " top-level nodes)" << std::endl;
         }
     }
-    return isHit;
+
+    std::vector<BVHNode>().swap(m_nodes);
+    std::vector<uint32_t>().swap(m_indexes);
 }
 
-bool Accel::rayIntersect(const Ray3f& ray_, Intersection& its, bool shadowRay) const {
-    bool foundIntersection = false;  // Was an intersection found so far?
-    auto f = (uint32_t)-1;      // Triangle index of the closest intersection
+float BVH::sahCost() const {
+    float cost = 0.0f;
+    for (const BVHNode &node : m_nodes) {
+        float area = node.bbox.getSurfaceArea();
+        if (node.isLeaf())
+            cost += area * m_intersectionCost * ((node.primCount + packetWidth() - 1) / packetWidth());
+        else
+            cost += area * m_traversalCost;
+    }
+    return cost / m_nodes[0].bbox.getSurfaceArea();
+}
 
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+template <int Width> uint16_t BVH::pack(std::vector<TrianglePacket<Width>> &packets,
+                                         uint32_t offset, uint32_t count) const {
+    uint32_t packetCount = (count + Width - 1) / Width;
 
+    for (uint32_t i = 0; i < packetCount; ++i) {
+        TrianglePacket<Width> &packet = packets.emplace_back();
+        for (int lane = 0; lane < Width; ++lane) {
+            uint32_t index = i * Width + lane;
+            if (index < count) {
+                uint32_t prim = m_indexes[offset + index];
+                uint32_t meshIndex = findMesh(prim);
+                uint32_t faceIndex = prim - m_meshOffset[meshIndex];
+                const MeshMatrixXf &V = m_meshes[meshIndex]->getVertexPositions();
+                const MeshMatrixXu &F = m_meshes[meshIndex]->getIndices();
+                for (int j = 0; j < 3; ++j)
+                    for (int axis = 0; axis < 3; ++axis)
+                        packet.p[j][axis][lane] = V(axis, F(j, faceIndex));
+                packet.prim[lane] = prim;
+            } else {
+                /* NaN vertices fail all edge tests of the intersection kernels */
+                for (int j = 0; j < 3; ++j)
+                    for (int axis = 0; axis < 3; ++axis)
+                        packet.p[j][axis][lane] = std::numeric_limits<float>::quiet_NaN();
+                packet.prim[lane] = 0;
+            }
+        }
+    }
 
-    //Brute force search through all triangles
-  /*  for (uint32_t idx = 0; idx < m_mesh->getTriangleCount(); ++idx) {
-      float u, v, t;
-      if (m_mesh->rayIntersect(idx, ray, u, v, t)) {
-        //An intersection was found! Can terminate
-        //immediately if this is a shadow ray query
-        if (shadowRay)
-          return true;
-        ray.maxt = its.t = t;
-        its.uv = Point2f(u, v);
-        its.mesh = m_mesh;
-        f = idx;
-        foundIntersection = true;
-      }
-    }*/
+    return (uint16_t) packetCount;
+}
 
-    foundIntersection = traverse(0, ray, its, f, shadowRay);
+template <int Width> uint32_t BVH::collapse(std::vector<WideBVHNode<Width>> &nodes,
+                                            std::vector<TrianglePacket<Width>> &packets,
+                                            uint32_t n) const {
+    /* Gather up to 'Width' children by repeatedly opening the interior
+       child with the largest surface area */
+    uint32_t children[Width], childCount = 0;
+    if (m_nodes[n].isLeaf()) {
+        children[childCount++] = n;
+    } else {
+        children[childCount++] = m_nodes[n].child;
+        children[childCount++] = m_nodes[n].child + 1;
+    }
 
-    if (shadowRay)
-        return foundIntersection;
+    while (childCount < Width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (!child.isLeaf() && child.bbox.getSurfaceArea() > bestArea) {
+                best = (int) i;
+                bestArea = child.bbox.getSurfaceArea();
+            }
+        }
+        if (best < 0)
+            break;
+        uint32_t opened = m_nodes[children[best]].child;
+        children[best] = opened;
+        children[childCount++] = opened + 1;
+    }
+
+    uint32_t index = (uint32_t) nodes.size();
+    nodes.emplace_back();
+
+    BoundingBox3f childBounds[Width]; /* Invalid bounds for unused slots */
+    for (uint32_t i = 0; i < childCount; ++i)
+        childBounds[i] = m_nodes[children[i]].bbox;
+    nodes[index].setChildBounds(childBounds);
 
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
+    for (uint32_t i = 0; i < Width; ++i) {
+        uint32_t child = 0;
+        uint16_t count = 0;
 
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
+        if (i < childCount) {
+            const BVHNode &node = m_nodes[children[i]];
+            if (node.isLeaf()) {
+                child = (uint32_t) packets.size();
+                count = pack(packets, node.primOffset, node.primCount);
+            } else {
+                child = collapse(nodes, packets, children[i]);
+            }
+        }
+
+        WideBVHNode<Width> &wide = nodes[index];
+        wide.child[i] = child;
+        wide.count[i] = count;
+    }
 
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1 - its.uv.sum(), its.uv;
+    return index;
+}
+
+template <int Width> float BVH::nodeCost(const WideBVHNode<Width> &node) const {
+    BoundingBox3f bbox;
+    float cost = 0.0f;
+    for (int i = 0; i < Width; ++i) {
+        if (node.count[i] == 0 && node.child[i] == 0)
+            continue; /* Unused slot */
+        BoundingBox3f child = node.getChildBounds(i);
+        bbox.expandBy(child);
+        cost += child.getSurfaceArea() *
+            (node.count[i] > 0 ? m_intersectionCost * node.count[i] : m_traversalCost);
+    }
+    float area = bbox.getSurfaceArea();
+    return area > 0 ? cost / area : 0.0f;
+}
 
-        /* References to all relevant mesh buffers */
-        const Mesh* mesh = its.mesh;
-        const MatrixXf& V = mesh->getVertexPositions();
-        const MatrixXf& N = mesh->getVertexNormals();
-        const MatrixXf& UV = mesh->getVertexTexCoords();
-        const MatrixXu& F = mesh->getIndices();
+template <int Width> float BVH::wideSAHCost(const AccelBuffer<WideBVHNode<Width>> &nodes) const {
+    /* Sum up the costs of all nodes relative to the surface area of the root */
+    BoundingBox3f rootBounds;
+    for (int i = 0; i < Width; ++i) {
+        if (nodes[0].count[i] != 0 || nodes[0].child[i] != 0)
+            rootBounds.expandBy(nodes[0].getChildBounds(i));
+    }
+    float rootArea = rootBounds.getSurfaceArea();
+    if (rootArea <= 0)
+        return 0.0f;
 
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+    double cost = 0.0;
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        const WideBVHNode<Width> &node = nodes[n];
+        for (int i = 0; i < Width; ++i) {
+            if (node.count[i] == 0 && node.child[i] == 0)
+                continue;
+            BoundingBox3f child = node.getChildBounds(i);
+            cost += child.getSurfaceArea() *
+                (node.count[i] > 0 ? m_intersectionCost * node.count[i] : m_traversalCost);
+        }
+    }
+    return m_traversalCost + (float) (cost / rootArea);
+}
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+template <int Width> void BVH::resetNodeCosts(const AccelBuffer<WideBVHNode<Width>> &nodes) {
+    m_nodeCost.resize(nodes.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size(), GrainSize),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t n = range.begin(); n < range.end(); ++n)
+                m_nodeCost[n] = nodeCost(nodes[n]);
+        }
+    );
+    m_buildCost = wideSAHCost(nodes);
+}
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+template <int Width> BoundingBox3f BVH::refitNode(AccelBuffer<WideBVHNode<Width>> &nodes,
+                                                  AccelBuffer<TrianglePacket<Width>> &packets,
+                                                  uint32_t n, uint32_t depth) {
+    BoundingBox3f childBounds[Width];
+    auto refitChild = [&](int i) {
+        const WideBVHNode<Width> &node = nodes[n];
+        BoundingBox3f &bbox = childBounds[i];
+        if (node.count[i] > 0) {
+            /* Copy the new vertex positions into the packets of the leaf */
+            for (uint32_t k = node.child[i]; k < node.child[i] + node.count[i]; ++k) {
+                TrianglePacket<Width> &packet = packets[k];
+                for (int lane = 0; lane < Width; ++lane) {
+                    if (std::isnan(packet.p[0][0][lane]))
+                        continue; /* Unused lane */
+                    uint32_t meshIndex = findMesh(packet.prim[lane]);
+                    uint32_t faceIndex = packet.prim[lane] - m_meshOffset[meshIndex];
+                    const MeshMatrixXf &V = m_meshes[meshIndex]->getVertexPositions();
+                    const MeshMatrixXu &F = m_meshes[meshIndex]->getIndices();
+                    for (int j = 0; j < 3; ++j) {
+                        Point3f vertex = V.col(F(j, faceIndex));
+                        for (int axis = 0; axis < 3; ++axis)
+                            packet.p[j][axis][lane] = vertex[axis];
+                        bbox.expandBy(vertex);
+                    }
+                }
+            }
+        } else if (node.child[i] != 0) {
+            bbox = refitNode(nodes, packets, node.child[i], depth + 1);
+        }
+    };
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-            bary.y() * UV.col(idx1) +
-            bary.z() * UV.col(idx2);
+    /* The children of the topmost levels are refitted concurrently */
+    if (depth < ParallelRefitDepth)
+        tbb::parallel_for(0, Width, refitChild);
+    else
+        for (int i = 0; i < Width; ++i)
+            refitChild(i);
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+    /* Quantize relative to the new bounds of this node, but pass on its exact bounds */
+    nodes[n].setChildBounds(childBounds);
+    BoundingBox3f bbox;
+    for (int i = 0; i < Width; ++i) {
+        if (childBounds[i].isValid())
+            bbox.expandBy(childBounds[i]);
+    }
+    return bbox;
+}
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+template <int Width> uint32_t BVH::findDegraded(const AccelBuffer<WideBVHNode<Width>> &nodes,
+                                                uint32_t n, std::vector<uint8_t> &degraded) const {
+    if (nodeCost(nodes[n]) > m_maxCostGrowth * m_nodeCost[n]) {
+        degraded[n] = 1;
+        return 1;
+    }
+    uint32_t count = 0;
+    for (int i = 0; i < Width; ++i) {
+        if (nodes[n].count[i] == 0 && nodes[n].child[i] != 0)
+            count += findDegraded(nodes, nodes[n].child[i], degraded);
+    }
+    return count;
+}
 
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                    bary.y() * N.col(idx1) +
-                    bary.z() * N.col(idx2)).normalized());
+template <int Width> void BVH::gatherTriangles(const AccelBuffer<WideBVHNode<Width>> &nodes,
+                                               const AccelBuffer<TrianglePacket<Width>> &packets,
+                                               uint32_t n, std::vector<uint32_t> &prims) const {
+    const WideBVHNode<Width> &node = nodes[n];
+    for (int i = 0; i < Width; ++i) {
+        if (node.count[i] > 0) {
+            for (uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; ++p) {
+                for (int lane = 0; lane < Width; ++lane) {
+                    if (!std::isnan(packets[p].p[0][0][lane]))
+                        prims.push_back(packets[p].prim[lane]);
+                }
+            }
+        } else if (node.child[i] != 0) {
+            gatherTriangles(nodes, packets, node.child[i], prims);
         }
-        else {
-            its.shFrame = its.geoFrame;
+    }
+}
+
+template <int Width> uint32_t BVH::relayout(const AccelBuffer<WideBVHNode<Width>> &oldNodes,
+                                            const AccelBuffer<TrianglePacket<Width>> &oldPackets,
+                                            const std::vector<uint8_t> &degraded,
+                                            std::vector<WideBVHNode<Width>> &nodes,
+                                            std::vector<TrianglePacket<Width>> &packets,
+                                            std::vector<float> &costs,
+                                            uint32_t &rebuiltTriangles,
+                                            uint32_t n, uint32_t depth) {
+    if (degraded[n]) {
+        /* Build a new subtree over the same triangles. Its depth is limited
+           such that the whole tree still fits onto the traversal stack */
+        std::vector<uint32_t> prims;
+        gatherTriangles(oldNodes, oldPackets, n, prims);
+
+        /* Spatial splits reference some triangles several times */
+        std::sort(prims.begin(), prims.end());
+        prims.erase(std::unique(prims.begin(), prims.end()), prims.end());
+        buildBinary(prims, std::min(m_maxDepth, MaxDepth - depth));
+        rebuiltTriangles += (uint32_t) prims.size();
+        size_t first = nodes.size();
+        uint32_t index = collapse(nodes, packets, 0);
+        for (size_t i = first; i < nodes.size(); ++i)
+            costs.push_back(nodeCost(nodes[i]));
+        return index;
+    }
+
+    /* Keep this node, and its reference cost */
+    uint32_t index = (uint32_t) nodes.size();
+    nodes.push_back(oldNodes[n]);
+    costs.push_back(m_nodeCost[n]);
+
+    for (int i = 0; i < Width; ++i) {
+        uint32_t child = oldNodes[n].child[i];
+        uint16_t count = oldNodes[n].count[i];
+        if (count > 0) {
+            nodes[index].child[i] = (uint32_t) packets.size();
+            packets.insert(packets.end(), oldPackets.data() + child, oldPackets.data() + child + count);
+        } else if (child != 0) {
+            nodes[index].child[i] = relayout(oldNodes, oldPackets, degraded, nodes, packets,
+                                             costs, rebuiltTriangles, child, depth + 1);
         }
     }
 
-    return foundIntersection;
+    return index;
 }
 
-NORI_NAMESPACE_END
+template <int Width> uint32_t BVH::refitTriangles(AccelBuffer<WideBVHNode<Width>> &nodes,
+                                                  AccelBuffer<TrianglePacket<Width>> &packets,
+                                                  float &refitCost, uint32_t &rebuiltTriangles) {
+    refitNode(nodes, packets, 0, 0);
+
+    rebuiltTriangles = 0;
+    refitCost = wideSAHCost(nodes);
+    if (refitCost <= m_maxCostGrowth * m_buildCost)
+        return 0;
+
+    /* The tree got too slow: find the degraded subtrees and rebuild them */
+    std::vector<uint8_t> degraded(nodes.size(), 0);
+    uint32_t degradedCount = findDegraded(nodes, 0, degraded);
+    if (degradedCount == 0)
+        return 0;
+
+    std::vector<WideBVHNode<Width>> newNodes;
+    std::vector<TrianglePacket<Width>> newPackets;
+    std::vector<float> newNodeCost;
+    newNodes.reserve(nodes.size());
+    newPackets.reserve(packets.size());
+    newNodeCost.reserve(nodes.size());
+    relayout(nodes, packets, degraded, newNodes, newPackets, newNodeCost, rebuiltTriangles, 0, 0);
+
+    nodes.assign(std::move(newNodes));
+    packets.assign(std::move(newPackets));
+    m_nodeCost = std::move(newNodeCost);
+
+    /* Rebuilding the root amounts to a full build */
+    if (degraded[0])
+        m_buildCost = wideSAHCost(nodes);
+    std::vector<BVHNode>().swap(m_nodes);
+    std::vector<uint32_t>().swap(m_indexes);
+    return degradedCount;
+}
+
+void BVH::refit(bool verbose) {
+    Timer timer;
+
+    refitInstances();
+
+    float refitCost = 0.0f, newCost = 0.0f;
+    uint32_t rebuiltSubtrees = 0, rebuiltTriangles = 0;
+    if (!m_nodes8.empty()) {
+        rebuiltSubtrees = refitTriangles(m_nodes8, m_packets8, refitCost, rebuiltTriangles);
+        newCost = wideSAHCost(m_nodes8);
+    } else if (!m_nodes4.empty()) {
+        rebuiltSubtrees = refitTriangles(m_nodes4, m_packets4, refitCost, rebuiltTriangles);
+        newCost = wideSAHCost(m_nodes4);
+    }
+
+    /* The arrays no longer refer to the cache file after a partial rebuild */
+    if (rebuiltSubtrees > 0) {
+        m_cacheFile.reset();
+        m_referenceCount = countReferences(m_packets4) + countReferences(m_packets8);
+    }
+
+    m_refitTime = timer.elapsed();
+
+    if (verbose) {
+        std::cout << "[refit time]: " << timeString(m_refitTime) << std::endl;
+        if (!m_nodes4.empty() || !m_nodes8.empty()) {
+            std::cout << "[wide SAH cost]: " << m_buildCost << " after the last build, "
+                      << refitCost << " after refitting";
+            if (rebuiltSubtrees > 0)
+                std::cout << ", " << newCost << " after rebuilding " << rebuiltSubtrees
+                          << " subtree(s) with " << rebuiltTriangles << " triangles";
+            std::cout << std::endl;
+        }
+    }
+}
+
+namespace {
+
+/**
+ * \brief Ray quantities that are shared by all box and triangle tests of
+ * a traversal
+ *
+ * For every axis, \c nearRow and \c farRow select the rows of the SoA
+ * bounds that hold the slab entered and exited first along the ray.
+ *
+ * The triangle test is the watertight algorithm by Woop et al. [2013]. It
+ * permutes the axes such that \c kz is the dominant direction and shears
+ * the vertices so that the ray runs along the z axis from the origin. The
+ * 2D edge functions are then evaluated in that space, which guarantees
+ * that rays through a shared edge or vertex hit at least one triangle.
+ */
+struct TraversalRay {
+    float o[3], dRcp[3], mint;
+    int nearRow[3], farRow[3];
+    int kx, ky, kz;
+    float shear[3];
+
+    TraversalRay() = default;
+    TraversalRay(const Ray3f &ray) : mint(ray.mint) {
+        for (int axis = 0; axis < 3; ++axis) {
+            o[axis] = ray.o[axis];
+            dRcp[axis] = ray.dRcp[axis];
+            bool negative = std::signbit(ray.d[axis]);
+            nearRow[axis] = negative ? axis + 3 : axis;
+            farRow[axis] = negative ? axis : axis + 3;
+        }
+
+        ray.d.cwiseAbs().maxCoeff(&kz);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        shear[0] = ray.d[kx] / ray.d[kz];
+        shear[1] = ray.d[ky] / ray.d[kz];
+        shear[2] = 1.0f / ray.d[kz];
+    }
+};
+
+/**
+ * \brief Bounds on the rays of a packet that share their origin and the
+ * signs of their direction
+ *
+ * The box tests of packets use interval arithmetic over the range of the
+ * reciprocal directions, which bounds the entry and exit distances of all
+ * rays at once. For a shared origin, the distance to a slab is the same
+ * float for all rays, and multiplying it by the reciprocal direction rounds
+ * monotonically. The bounds are hence conservative without any padding:
+ * a packet never misses a box that one of its rays hits.
+ */
+struct TraversalPacket {
+    float o[3], dRcpMin[3], dRcpMax[3], mint;
+    int nearRow[3], farRow[3];
+
+    /// Compute the bounds, or return \c false if the rays do not qualify
+    bool init(const Ray3f *rays, uint32_t count) {
+        mint = rays[0].mint;
+        for (int axis = 0; axis < 3; ++axis) {
+            o[axis] = rays[0].o[axis];
+            dRcpMin[axis] = dRcpMax[axis] = rays[0].dRcp[axis];
+            bool negative = std::signbit(rays[0].d[axis]);
+            nearRow[axis] = negative ? axis + 3 : axis;
+            farRow[axis] = negative ? axis : axis + 3;
+        }
+        for (uint32_t k = 0; k < count; ++k) {
+            const Ray3f &ray = rays[k];
+            for (int axis = 0; axis < 3; ++axis) {
+                /* Directions parallel to an axis would turn the products into NaNs */
+                if (ray.o[axis] != o[axis] || std::signbit(ray.d[axis]) != std::signbit(rays[0].d[axis]) ||
+                    !std::isfinite(ray.dRcp[axis]))
+                    return false;
+                dRcpMin[axis] = std::min(dRcpMin[axis], ray.dRcp[axis]);
+                dRcpMax[axis] = std::max(dRcpMax[axis], ray.dRcp[axis]);
+            }
+            mint = std::min(mint, ray.mint);
+        }
+        return true;
+    }
+};
+
+/* The box tests below return a bit mask of the children that are hit and
+   the entry distance of all children. A slab computation that yields NaN
+   (the ray lies exactly on a slab boundary) never rejects a child.
+
+   The triangle tests return a bit mask of the triangles that are hit
+   within [mint, maxt], together with their distance and barycentric
+   coordinates. Degenerate and NaN triangles are never reported. Grazing
+   rays can make the computed distance much larger than the true one, hence
+   hits are only accepted beyond a conservative bound on the rounding error
+   of the distance (Pharr et al., PBRT 3rd ed., Sec. 3.9.6). Otherwise,
+   shadow rays that leave a surface at a shallow angle hit its neighbors. */
 
+/// Bound on the relative rounding error of \c n consecutive float operations
+constexpr float roundingGamma(int n) {
+    return (n * 0.5f * std::numeric_limits<float>::epsilon()) /
+           (1 - n * 0.5f * std::numeric_limits<float>::epsilon());
+}
+
+/// Portable fallback that loops over the children of a 4-ary node
+struct KernelScalar {
+    static constexpr int Width = 4;
+
+    struct Ray : TraversalRay {
+        Ray() = default;
+        Ray(const Ray3f &ray) : TraversalRay(ray) { }
+    };
+
+    using PacketRay = TraversalPacket;
+
+    static NORI_INLINE uint32_t intersect(const WideBVHNode<Width> &node, const Ray &ray,
+                                          float maxt, float *tNear) {
+        float scale[3] = { node.getScale(0), node.getScale(1), node.getScale(2) };
+        uint32_t mask = 0;
+        for (int i = 0; i < Width; ++i) {
+            float tMin = ray.mint, tMax = maxt;
+            for (int axis = 0; axis < 3; ++axis) {
+                float nearBound = node.origin[axis] + node.bounds[ray.nearRow[axis]][i] * scale[axis];
+                float farBound = node.origin[axis] + node.bounds[ray.farRow[axis]][i] * scale[axis];
+                float t0 = (nearBound - ray.o[axis]) * ray.dRcp[axis];
+                float t1 = (farBound - ray.o[axis]) * ray.dRcp[axis];
+                tMin = t0 > tMin ? t0 : tMin;
+                tMax = t1 < tMax ? t1 : tMax;
+            }
+            tNear[i] = tMin;
+            mask |= (tMin <= tMax ? 1u : 0u) << i;
+        }
+        return mask;
+    }
+
+    static NORI_INLINE uint32_t intersect(const WideBVHNode<Width> &node, const PacketRay &ray,
+                                          float maxt, float *tNear) {
+        float scale[3] = { node.getScale(0), node.getScale(1), node.getScale(2) };
+        uint32_t mask = 0;
+        for (int i = 0; i < Width; ++i) {
+            float tMin = ray.mint, tMax = maxt;
+            for (int axis = 0; axis < 3; ++axis) {
+                float nearBound = node.origin[axis] + node.bounds[ray.nearRow[axis]][i] * scale[axis];
+                float farBound = node.origin[axis] + node.bounds[ray.farRow[axis]][i] * scale[axis];
+                float d0 = nearBound - ray.o[axis], d1 = farBound - ray.o[axis];
+                float t0 = std::min(d0 * ray.dRcpMin[axis], d0 * ray.dRcpMax[axis]);
+                float t1 = std::max(d1 * ray.dRcpMin[axis], d1 * ray.dRcpMax[axis]);
+                tMin = t0 > tMin ? t0 : tMin;
+                tMax = t1 < tMax ? t1 : tMax;
+                /* The intervals of an unused slot (inverted bounds) can
+                   overlap, while each single ray leaves its slabs first */
+                if (d0 * ray.dRcpMin[axis] > d1 * ray.dRcpMin[axis])
+                    tMax = -std::numeric_limits<float>::infinity();
+            }
+            tNear[i] = tMin;
+            mask |= (tMin <= tMax ? 1u : 0u) << i;
+        }
+        return mask;
+    }
+
+    static NORI_INLINE uint32_t intersect(const TrianglePacket<Width> &tri, const Ray &ray,
+                                          float maxt, float *t, float *u, float *v) {
+        uint32_t mask = 0;
+        for (int i = 0; i < Width; ++i) {
+            /* Transform the vertices into the ray coordinate system */
+            float x[3], y[3], z[3];
+            for (int j = 0; j < 3; ++j) {
+                z[j] = tri.p[j][ray.kz][i] - ray.o[ray.kz];
+                x[j] = (tri.p[j][ray.kx][i] - ray.o[ray.kx]) - ray.shear[0] * z[j];
+                y[j] = (tri.p[j][ray.ky][i] - ray.o[ray.ky]) - ray.shear[1] * z[j];
+                z[j] *= ray.shear[2];
+            }
+
+            /* Edge functions, i.e. the unnormalized barycentric coordinates */
+            float e0 = x[2] * y[1] - y[2] * x[1];
+            float e1 = x[0] * y[2] - y[0] * x[2];
+            float e2 = x[1] * y[0] - y[1] * x[0];
+
+            bool inside = (e0 >= 0 && e1 >= 0 && e2 >= 0) ||
+                          (e0 <= 0 && e1 <= 0 && e2 <= 0);
+            float det = e0 + e1 + e2;
+            float invDet = 1.0f / det;
+            float tHit = (e0 * z[0] + e1 * z[1] + e2 * z[2]) * invDet;
+
+            float maxX = std::max({ std::abs(x[0]), std::abs(x[1]), std::abs(x[2]) });
+            float maxY = std::max({ std::abs(y[0]), std::abs(y[1]), std::abs(y[2]) });
+            float maxZ = std::max({ std::abs(z[0]), std::abs(z[1]), std::abs(z[2]) });
+            float maxE = std::max({ std::abs(e0), std::abs(e1), std::abs(e2) });
+            float deltaX = roundingGamma(5) * (maxX + maxZ);
+            float deltaY = roundingGamma(5) * (maxY + maxZ);
+            float deltaE = 2 * (roundingGamma(2) * maxX * maxY + deltaY * maxX + deltaX * maxY);
+            float deltaT = 3 * (roundingGamma(3) * maxE * maxZ + deltaE * maxZ +
+                                roundingGamma(3) * maxZ * maxE) * std::abs(invDet);
+
+            t[i] = tHit;
+            u[i] = e1 * invDet;
+            v[i] = e2 * invDet;
+            if (inside && det != 0 && tHit > deltaT && tHit >= ray.mint && tHit <= maxt)
+                mask |= 1u << i;
+        }
+        return mask;
+    }
+};
+
+#if defined(NORI_X86)
+/// Tests the four children of a node with SSE2 instructions
+struct KernelSSE2 {
+    static constexpr int Width = 4;
+
+    struct Ray {
+        __m128 o[3], dRcp[3], mint;
+        int nearRow[3], farRow[3];
+        __m128 shear[3];
+        int kx, ky, kz;
+
+        Ray() = default;
+        Ray(const Ray3f &ray_) {
+            TraversalRay ray(ray_);
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis] = _mm_set1_ps(ray.o[axis]);
+                dRcp[axis] = _mm_set1_ps(ray.dRcp[axis]);
+                nearRow[axis] = ray.nearRow[axis];
+                farRow[axis] = ray.farRow[axis];
+                shear[axis] = _mm_set1_ps(ray.shear[axis]);
+            }
+            mint = _mm_set1_ps(ray.mint);
+            kx = ray.kx; ky = ray.ky; kz = ray.kz;
+        }
+    };
+
+    struct PacketRay {
+        __m128 o[3], dRcpMin[3], dRcpMax[3], mint;
+        int nearRow[3], farRow[3];
+
+        PacketRay(const TraversalPacket &packet) {
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis] = _mm_set1_ps(packet.o[axis]);
+                dRcpMin[axis] = _mm_set1_ps(packet.dRcpMin[axis]);
+                dRcpMax[axis] = _mm_set1_ps(packet.dRcpMax[axis]);
+                nearRow[axis] = packet.nearRow[axis];
+                farRow[axis] = packet.farRow[axis];
+            }
+            mint = _mm_set1_ps(packet.mint);
+        }
+    };
+
+    /// Decode one row of quantized child bounds
+    static NORI_INLINE __m128 decode(const uint8_t *row, __m128 origin, __m128 scale) {
+        int32_t bytes;
+        memcpy(&bytes, row, sizeof(int32_t));
+        __m128i zero = _mm_setzero_si128();
+        __m128i cells = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+        return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(cells), scale));
+    }
+
+    static NORI_INLINE uint32_t intersect(const WideBVHNode<Width> &node, const Ray &ray,
+                                          float maxt, float *tNear) {
+        __m128 tMin = ray.mint, tMax = _mm_set1_ps(maxt);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 origin = _mm_set1_ps(node.origin[axis]), scale = _mm_set1_ps(node.getScale(axis));
+            __m128 nearBound = decode(node.bounds[ray.nearRow[axis]], origin, scale);
+            __m128 farBound = decode(node.bounds[ray.farRow[axis]], origin, scale);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(nearBound, ray.o[axis]), ray.dRcp[axis]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(farBound, ray.o[axis]), ray.dRcp[axis]);
+            /* MAXPS/MINPS return the second operand if either one is NaN */
+            tMin = _mm_max_ps(t0, tMin);
+            tMax = _mm_min_ps(t1, tMax);
+        }
+        _mm_storeu_ps(tNear, tMin);
+        return (uint32_t) _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+    }
+
+    static NORI_INLINE uint32_t intersect(const WideBVHNode<Width> &node, const PacketRay &ray,
+                                          float maxt, float *tNear) {
+        __m128 tMin = ray.mint, tMax = _mm_set1_ps(maxt), valid = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int axis = 0; axis < 3; ++axis) {
+            __m128 origin = _mm_set1_ps(node.origin[axis]), scale = _mm_set1_ps(node.getScale(axis));
+            __m128 d0 = _mm_sub_ps(decode(node.bounds[ray.nearRow[axis]], origin, scale), ray.o[axis]);
+            __m128 d1 = _mm_sub_ps(decode(node.bounds[ray.farRow[axis]], origin, scale), ray.o[axis]);
+            __m128 t0Min = _mm_mul_ps(d0, ray.dRcpMin[axis]), t1Min = _mm_mul_ps(d1, ray.dRcpMin[axis]);
+            __m128 t0 = _mm_min_ps(t0Min, _mm_mul_ps(d0, ray.dRcpMax[axis]));
+            __m128 t1 = _mm_max_ps(t1Min, _mm_mul_ps(d1, ray.dRcpMax[axis]));
+            tMin = _mm_max_ps(t0, tMin);
+            tMax = _mm_min_ps(t1, tMax);
+            /* The intervals of an unused slot (inverted bounds) can
+               overlap, while each single ray leaves its slabs first */
+            valid = _mm_and_ps(valid, _mm_cmple_ps(t0Min, t1Min));
+        }
+        _mm_storeu_ps(tNear, tMin);
+        return (uint32_t) _mm_movemask_ps(_mm_and_ps(valid, _mm_cmple_ps(tMin, tMax)));
+    }
+
+    static NORI_INLINE __m128 absMax(__m128 a, __m128 b, __m128 c) {
+        __m128 signMask = _mm_set1_ps(-0.0f);
+        return _mm_max_ps(_mm_max_ps(_mm_andnot_ps(signMask, a), _mm_andnot_ps(signMask, b)),
+                          _mm_andnot_ps(signMask, c));
+    }
+
+    static NORI_INLINE uint32_t intersect(const TrianglePacket<Width> &tri, const Ray &ray,
+                                          float maxt, float *t, float *u, float *v) {
+        __m128 x[3], y[3], z[3];
+        for (int j = 0; j < 3; ++j) {
+            z[j] = _mm_sub_ps(_mm_load_ps(tri.p[j][ray.kz]), ray.o[ray.kz]);
+            x[j] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(tri.p[j][ray.kx]), ray.o[ray.kx]), _mm_mul_ps(ray.shear[0], z[j]));
+            y[j] = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(tri.p[j][ray.ky]), ray.o[ray.ky]), _mm_mul_ps(ray.shear[1], z[j]));
+            z[j] = _mm_mul_ps(z[j], ray.shear[2]);
+        }
+
+        __m128 e0 = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+        __m128 e1 = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+        __m128 e2 = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 inside = _mm_or_ps(
+            _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero)),
+            _mm_and_ps(_mm_and_ps(_mm_cmple_ps(e0, zero), _mm_cmple_ps(e1, zero)), _mm_cmple_ps(e2, zero)));
+        __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+        __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, z[0]), _mm_mul_ps(e1, z[1])), _mm_mul_ps(e2, z[2]));
+        __m128 tHit = _mm_mul_ps(tScaled, invDet);
+
+        __m128 maxX = absMax(x[0], x[1], x[2]), maxY = absMax(y[0], y[1], y[2]);
+        __m128 maxZ = absMax(z[0], z[1], z[2]), maxE = absMax(e0, e1, e2);
+        __m128 gamma2 = _mm_set1_ps(roundingGamma(2)), gamma3 = _mm_set1_ps(roundingGamma(3)),
+               gamma5 = _mm_set1_ps(roundingGamma(5));
+        __m128 deltaX = _mm_mul_ps(gamma5, _mm_add_ps(maxX, maxZ));
+        __m128 deltaY = _mm_mul_ps(gamma5, _mm_add_ps(maxY, maxZ));
+        __m128 deltaE = _mm_mul_ps(_mm_set1_ps(2.0f),
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(gamma2, maxX), maxY), _mm_mul_ps(deltaY, maxX)),
+                       _mm_mul_ps(deltaX, maxY)));
+        __m128 deltaT = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(3.0f),
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(gamma3, maxE), maxZ), _mm_mul_ps(deltaE, maxZ)),
+                       _mm_mul_ps(_mm_mul_ps(gamma3, maxZ), maxE))),
+            _mm_andnot_ps(_mm_set1_ps(-0.0f), invDet));
+
+        _mm_storeu_ps(t, tHit);
+        _mm_storeu_ps(u, _mm_mul_ps(e1, invDet));
+        _mm_storeu_ps(v, _mm_mul_ps(e2, invDet));
+
+        __m128 hit = _mm_and_ps(_mm_and_ps(_mm_and_ps(inside, _mm_cmpneq_ps(det, zero)), _mm_cmpgt_ps(tHit, deltaT)),
+                                _mm_and_ps(_mm_cmpge_ps(tHit, ray.mint), _mm_cmple_ps(tHit, _mm_set1_ps(maxt))));
+        return (uint32_t) _mm_movemask_ps(hit);
+    }
+};
+
+/// Tests the eight children of a node with AVX2 instructions
+struct KernelAVX2 {
+    static constexpr int Width = 8;
+
+    struct Ray {
+        __m256 o[3], dRcp[3], mint;
+        int nearRow[3], farRow[3];
+        __m256 shear[3];
+        int kx, ky, kz;
+
+        Ray() = default;
+        NORI_TARGET_AVX2 Ray(const Ray3f &ray_) {
+            TraversalRay ray(ray_);
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis] = _mm256_set1_ps(ray.o[axis]);
+                dRcp[axis] = _mm256_set1_ps(ray.dRcp[axis]);
+                nearRow[axis] = ray.nearRow[axis];
+                farRow[axis] = ray.farRow[axis];
+                shear[axis] = _mm256_set1_ps(ray.shear[axis]);
+            }
+            mint = _mm256_set1_ps(ray.mint);
+            kx = ray.kx; ky = ray.ky; kz = ray.kz;
+        }
+    };
+
+    struct PacketRay {
+        __m256 o[3], dRcpMin[3], dRcpMax[3], mint;
+        int nearRow[3], farRow[3];
+
+        NORI_TARGET_AVX2 PacketRay(const TraversalPacket &packet) {
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis] = _mm256_set1_ps(packet.o[axis]);
+                dRcpMin[axis] = _mm256_set1_ps(packet.dRcpMin[axis]);
+                dRcpMax[axis] = _mm256_set1_ps(packet.dRcpMax[axis]);
+                nearRow[axis] = packet.nearRow[axis];
+                farRow[axis] = packet.farRow[axis];
+            }
+            mint = _mm256_set1_ps(packet.mint);
+        }
+    };
+
+    /// Decode one row of quantized child bounds
+    NORI_TARGET_AVX2 static inline __m256 decode(const uint8_t *row, __m256 origin, __m256 scale) {
+        __m256i cells = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) row));
+        return _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(cells), scale));
+    }
+
+    NORI_TARGET_AVX2 static inline uint32_t intersect(const WideBVHNode<Width> &node, const Ray &ray,
+                                                      float maxt, float *tNear) {
+        __m256 tMin = ray.mint, tMax = _mm256_set1_ps(maxt);
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 origin = _mm256_set1_ps(node.origin[axis]), scale = _mm256_set1_ps(node.getScale(axis));
+            __m256 nearBound = decode(node.bounds[ray.nearRow[axis]], origin, scale);
+            __m256 farBound = decode(node.bounds[ray.farRow[axis]], origin, scale);
+            /* Not fused into (b * rcp - o * rcp): the extra rounding
+               error would make grazing rays miss flat boxes */
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(nearBound, ray.o[axis]), ray.dRcp[axis]);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(farBound, ray.o[axis]), ray.dRcp[axis]);
+            tMin = _mm256_max_ps(t0, tMin);
+            tMax = _mm256_min_ps(t1, tMax);
+        }
+        _mm256_storeu_ps(tNear, tMin);
+        return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+    }
+
+    NORI_TARGET_AVX2 static inline uint32_t intersect(const WideBVHNode<Width> &node, const PacketRay &ray,
+                                                      float maxt, float *tNear) {
+        __m256 tMin = ray.mint, tMax = _mm256_set1_ps(maxt);
+        __m256 valid = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int axis = 0; axis < 3; ++axis) {
+            __m256 origin = _mm256_set1_ps(node.origin[axis]), scale = _mm256_set1_ps(node.getScale(axis));
+            __m256 d0 = _mm256_sub_ps(decode(node.bounds[ray.nearRow[axis]], origin, scale), ray.o[axis]);
+            __m256 d1 = _mm256_sub_ps(decode(node.bounds[ray.farRow[axis]], origin, scale), ray.o[axis]);
+            __m256 t0Min = _mm256_mul_ps(d0, ray.dRcpMin[axis]), t1Min = _mm256_mul_ps(d1, ray.dRcpMin[axis]);
+            __m256 t0 = _mm256_min_ps(t0Min, _mm256_mul_ps(d0, ray.dRcpMax[axis]));
+            __m256 t1 = _mm256_max_ps(t1Min, _mm256_mul_ps(d1, ray.dRcpMax[axis]));
+            tMin = _mm256_max_ps(t0, tMin);
+            tMax = _mm256_min_ps(t1, tMax);
+            /* The intervals of an unused slot (inverted bounds) can
+               overlap, while each single ray leaves its slabs first */
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(t0Min, t1Min, _CMP_LE_OQ));
+        }
+        _mm256_storeu_ps(tNear, tMin);
+        return (uint32_t) _mm256_movemask_ps(_mm256_and_ps(valid, _mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ)));
+    }
+
+    NORI_TARGET_AVX2 static inline __m256 absMax(__m256 a, __m256 b, __m256 c) {
+        __m256 signMask = _mm256_set1_ps(-0.0f);
+        return _mm256_max_ps(_mm256_max_ps(_mm256_andnot_ps(signMask, a), _mm256_andnot_ps(signMask, b)),
+                             _mm256_andnot_ps(signMask, c));
+    }
+
+    NORI_TARGET_AVX2 static inline uint32_t intersect(const TrianglePacket<Width> &tri, const Ray &ray,
+                                                      float maxt, float *t, float *u, float *v) {
+        __m256 x[3], y[3], z[3];
+        for (int j = 0; j < 3; ++j) {
+            z[j] = _mm256_sub_ps(_mm256_load_ps(tri.p[j][ray.kz]), ray.o[ray.kz]);
+            x[j] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(tri.p[j][ray.kx]), ray.o[ray.kx]), _mm256_mul_ps(ray.shear[0], z[j]));
+            y[j] = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(tri.p[j][ray.ky]), ray.o[ray.ky]), _mm256_mul_ps(ray.shear[1], z[j]));
+            z[j] = _mm256_mul_ps(z[j], ray.shear[2]);
+        }
+
+        __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+        __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+        __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+
+        __m256 zero = _mm256_setzero_ps();
+        __m256 inside = _mm256_or_ps(
+            _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ), _mm256_cmp_ps(e1, zero, _CMP_GE_OQ)),
+                          _mm256_cmp_ps(e2, zero, _CMP_GE_OQ)),
+            _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_LE_OQ), _mm256_cmp_ps(e1, zero, _CMP_LE_OQ)),
+                          _mm256_cmp_ps(e2, zero, _CMP_LE_OQ)));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+        __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+        __m256 tScaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, z[0]), _mm256_mul_ps(e1, z[1])), _mm256_mul_ps(e2, z[2]));
+        __m256 tHit = _mm256_mul_ps(tScaled, invDet);
+
+        __m256 maxX = absMax(x[0], x[1], x[2]), maxY = absMax(y[0], y[1], y[2]);
+        __m256 maxZ = absMax(z[0], z[1], z[2]), maxE = absMax(e0, e1, e2);
+        __m256 gamma2 = _mm256_set1_ps(roundingGamma(2)), gamma3 = _mm256_set1_ps(roundingGamma(3)),
+               gamma5 = _mm256_set1_ps(roundingGamma(5));
+        __m256 deltaX = _mm256_mul_ps(gamma5, _mm256_add_ps(maxX, maxZ));
+        __m256 deltaY = _mm256_mul_ps(gamma5, _mm256_add_ps(maxY, maxZ));
+        __m256 deltaE = _mm256_mul_ps(_mm256_set1_ps(2.0f),
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(gamma2, maxX), maxY), _mm256_mul_ps(deltaY, maxX)),
+                          _mm256_mul_ps(deltaX, maxY)));
+        __m256 deltaT = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(3.0f),
+            _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(gamma3, maxE), maxZ), _mm256_mul_ps(deltaE, maxZ)),
+                          _mm256_mul_ps(_mm256_mul_ps(gamma3, maxZ), maxE))),
+            _mm256_andnot_ps(_mm256_set1_ps(-0.0f), invDet));
+
+        _mm256_storeu_ps(t, tHit);
+        _mm256_storeu_ps(u, _mm256_mul_ps(e1, invDet));
+        _mm256_storeu_ps(v, _mm256_mul_ps(e2, invDet));
+
+        __m256 hit = _mm256_and_ps(
+            _mm256_and_ps(_mm256_and_ps(inside, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ)),
+                          _mm256_cmp_ps(tHit, deltaT, _CMP_GT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(tHit, ray.mint, _CMP_GE_OQ), _mm256_cmp_ps(tHit, _mm256_set1_ps(maxt), _CMP_LE_OQ)));
+        return (uint32_t) _mm256_movemask_ps(hit);
+    }
+};
+#endif
+
+/// Node or leaf that a ray still needs to visit, together with its entry distance
+struct WideStackEntry {
+    uint32_t child;
+    /// Number of triangle packets of a leaf, zero for interior nodes
+    uint32_t count;
+    float tNear;
+};
+
+/**
+ * \brief Intersect a ray with the triangle packets of a leaf
+ *
+ * Finds the closest intersection, or any intersection if \c ShadowRay is
+ * set (\c its is unused then).
+ */
+template <typename Kernel, bool ShadowRay>
+NORI_INLINE bool intersectLeaf(const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                               const WideStackEntry &entry, const typename Kernel::Ray &kernelRay,
+                               Ray3f &ray, Intersection *its, uint32_t &prim) {
+    constexpr int Width = Kernel::Width;
+    bool foundIntersection = false;
+    for (uint32_t i = entry.child; i < entry.child + entry.count; ++i) {
+        const TrianglePacket<Width> &packet = packets[i];
+        alignas(32) float t[Width], u[Width], v[Width];
+        uint32_t mask = Kernel::intersect(packet, kernelRay, ray.maxt, t, u, v);
+        if (!mask)
+            continue;
+
+        /* An intersection was found! Can terminate
+           immediately if this is a shadow ray query */
+        if (ShadowRay) {
+            prim = packet.prim[lowestBit(mask)];
+            return true;
+        }
+
+        do {
+            int lane = lowestBit(mask);
+            mask &= mask - 1;
+            if (t[lane] <= ray.maxt) {
+                ray.maxt = its->t = t[lane];
+                its->bary = Point2f(u[lane], v[lane]);
+                prim = packet.prim[lane];
+            }
+        } while (mask);
+        foundIntersection = true;
+    }
+    return foundIntersection;
+}
+
+/// Push the children of a node that were hit from far to near, so that the nearest one ends up on top of the stack
+template <int Width>
+NORI_INLINE void pushChildren(const WideBVHNode<Width> &node, uint32_t mask, const float *tNear,
+                              WideStackEntry *stack, uint32_t &stackSize) {
+    uint32_t base = stackSize;
+    while (mask) {
+        int i = lowestBit(mask);
+        mask &= mask - 1;
+        WideStackEntry child = { node.child[i], node.count[i], tNear[i] };
+        uint32_t j = stackSize++;
+        while (j > base && stack[j - 1].tNear < child.tNear) {
+            stack[j] = stack[j - 1];
+            --j;
+        }
+        stack[j] = child;
+    }
+}
+
+/**
+ * \brief Visit the node or leaf on top of the traversal stack of a ray
+ *
+ * Finds the closest intersection, or any intersection if \c ShadowRay is
+ * set (\c its is unused then). Only the former visits the children of a
+ * node sorted by their entry distance.
+ *
+ * \return \c true if the entry contained an intersection. Shadow rays
+ *    can stop at that point
+ */
+template <typename Kernel, bool ShadowRay>
+NORI_INLINE bool traversalStep(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                               const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                               const typename Kernel::Ray &kernelRay, Ray3f &ray, Intersection *its,
+                               uint32_t &prim, WideStackEntry *stack, uint32_t &stackSize) {
+    constexpr int Width = Kernel::Width;
+    WideStackEntry entry = stack[--stackSize];
+
+    /* Skip subtrees that start behind the closest intersection found so far */
+    if (entry.tNear > ray.maxt)
+        return false;
+
+    if (entry.count > 0)
+        return intersectLeaf<Kernel, ShadowRay>(packets, entry, kernelRay, ray, its, prim);
+
+    const WideBVHNode<Width> &node = nodes[entry.child];
+    alignas(32) float tNear[Width];
+    uint32_t mask = Kernel::intersect(node, kernelRay, ray.maxt, tNear);
+
+    /* Shadow rays may stop at any hit, so their children are not sorted */
+    if (ShadowRay) {
+        while (mask) {
+            int i = lowestBit(mask);
+            mask &= mask - 1;
+            stack[stackSize++] = { node.child[i], node.count[i], tNear[i] };
+        }
+        return false;
+    }
+
+    pushChildren(node, mask, tNear, stack, stackSize);
+    return false;
+}
+
+}
+
+template <typename Kernel, bool ShadowRay>
+NORI_INLINE bool BVH::traverseWide(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                                   const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                                   Ray3f &ray, Intersection *its, uint32_t &prim) const {
+    WideStackEntry stack[MaxDepth * (Kernel::Width - 1) + 1];
+    uint32_t stackSize = 0;
+
+    typename Kernel::Ray kernelRay(ray);
+    bool foundIntersection = false;
+    stack[stackSize++] = { 0, 0, ray.mint };
+
+    while (stackSize > 0) {
+        if (traversalStep<Kernel, ShadowRay>(nodes, packets, kernelRay, ray, its, prim, stack, stackSize)) {
+            if (ShadowRay)
+                return true;
+            foundIntersection = true;
+        }
+    }
+
+    return foundIntersection;
+}
+
+template <typename Kernel, bool ShadowRay>
+NORI_INLINE void BVH::traverseInterleaved(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                                          const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                                          Ray3f *rays, Intersection *its, uint32_t *prims,
+                                          uint32_t count) const {
+    /* Traversal state of each ray of a group */
+    struct RayState {
+        typename Kernel::Ray kernelRay;
+        uint32_t index;
+        uint32_t stackSize;
+        WideStackEntry stack[MaxDepth * (Kernel::Width - 1) + 1];
+    };
+    RayState states[InterleavedRayCount];
+
+    for (uint32_t start = 0; start < count; start += InterleavedRayCount) {
+        uint32_t activeCount = std::min(InterleavedRayCount, count - start);
+        RayState *active[InterleavedRayCount];
+        for (uint32_t k = 0; k < activeCount; ++k) {
+            RayState &state = states[k];
+            state.kernelRay = typename Kernel::Ray(rays[start + k]);
+            state.index = start + k;
+            state.stack[0] = { 0, 0, rays[start + k].mint };
+            state.stackSize = 1;
+            prims[start + k] = (uint32_t) -1;
+            active[k] = &state;
+        }
+
+        /* Advance the rays round-robin by one node or leaf each. Before
+           switching to the next ray, the memory of what the current one
+           visits next is requested, which arrives while the others run */
+        while (activeCount > 0) {
+            for (uint32_t k = 0; k < activeCount; ) {
+                RayState &state = *active[k];
+                uint32_t i = state.index;
+                bool hit = traversalStep<Kernel, ShadowRay>(nodes, packets, state.kernelRay, rays[i],
+                                                            ShadowRay ? nullptr : &its[i], prims[i],
+                                                            state.stack, state.stackSize);
+
+                /* Shadow rays are done at the first hit */
+                if (state.stackSize == 0 || (ShadowRay && hit)) {
+                    active[k] = active[--activeCount];
+                    continue;
+                }
+
+                const WideStackEntry &next = state.stack[state.stackSize - 1];
+                if (next.count > 0)
+                    prefetch(&packets[next.child]);
+                else
+                    prefetch(&nodes[next.child]);
+                ++k;
+            }
+        }
+    }
+}
+
+template <typename Kernel>
+NORI_INLINE bool BVH::traversePacket(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                                     const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                                     Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count,
+                                     float &raysPerLeaf) const {
+    TraversalPacket packet;
+    if (!packet.init(rays, count))
+        return false;
+
+    typename Kernel::PacketRay packetRay(packet);
+    typename Kernel::Ray kernelRays[PacketSize];
+    float maxt = 0; // Farthest distance at which any ray of the packet can still find an intersection
+    for (uint32_t k = 0; k < count; ++k) {
+        kernelRays[k] = typename Kernel::Ray(rays[k]);
+        prims[k] = (uint32_t) -1;
+        maxt = std::max(maxt, rays[k].maxt);
+    }
+
+    /* Entries additionally store the rays that still need to visit them */
+    struct StackEntry {
+        uint32_t child;
+        uint32_t count;
+        float tNear;
+        uint32_t rays;
+    } stack[MaxDepth * (Kernel::Width - 1) + 1];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = { 0, 0, packet.mint, (1u << count) - 1 };
+    uint32_t leafCount = 0, leafRayCount = 0;
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.tNear > maxt)
+            continue;
+
+        /* Drop the rays whose closest intersection lies in front of the entry */
+        uint32_t active = 0;
+        float activeMaxt = 0;
+        for (uint32_t mask = entry.rays; mask; mask &= mask - 1) {
+            int k = lowestBit(mask);
+            if (entry.tNear <= rays[k].maxt) {
+                active |= 1u << k;
+                activeMaxt = std::max(activeMaxt, rays[k].maxt);
+            }
+        }
+        if (!active)
+            continue;
+
+        if (entry.count > 0) {
+            leafCount++;
+            leafRayCount += popCount(active);
+            for (uint32_t mask = active; mask; mask &= mask - 1) {
+                int k = lowestBit(mask);
+                intersectLeaf<Kernel, false>(packets, { entry.child, entry.count, entry.tNear },
+                                             kernelRays[k], rays[k], &its[k], prims[k]);
+            }
+            maxt = 0;
+            for (uint32_t k = 0; k < count; ++k)
+                maxt = std::max(maxt, rays[k].maxt);
+            continue;
+        }
+
+        /* One conservative box test for the whole packet */
+        const WideBVHNode<Kernel::Width> &node = nodes[entry.child];
+        alignas(32) float tNear[Kernel::Width];
+        uint32_t mask = Kernel::intersect(node, packetRay, activeMaxt, tNear);
+
+        /* Interior children are passed on to all active rays. Leaves, whose
+           triangle tests are the expensive part, only to the rays that
+           actually hit their box */
+        uint32_t childRays[Kernel::Width];
+        uint32_t leafMask = 0;
+        for (uint32_t bits = mask; bits; bits &= bits - 1) {
+            int i = lowestBit(bits);
+            childRays[i] = node.count[i] > 0 ? 0 : active;
+            leafMask |= (node.count[i] > 0 ? 1u : 0u) << i;
+        }
+        if (leafMask) {
+            for (uint32_t rayBits = active; rayBits; rayBits &= rayBits - 1) {
+                int k = lowestBit(rayBits);
+                alignas(32) float rayNear[Kernel::Width];
+                uint32_t hit = Kernel::intersect(node, kernelRays[k], rays[k].maxt, rayNear) & leafMask;
+                for (; hit; hit &= hit - 1)
+                    childRays[lowestBit(hit)] |= 1u << k;
+            }
+        }
+
+        /* Push the children from far to near, so that the nearest one ends up on top of the stack */
+        uint32_t base = stackSize;
+        for (; mask; mask &= mask - 1) {
+            int i = lowestBit(mask);
+            if (!childRays[i])
+                continue;
+            StackEntry child = { node.child[i], node.count[i], tNear[i], childRays[i] };
+            uint32_t j = stackSize++;
+            while (j > base && stack[j - 1].tNear < child.tNear) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+
+        /* Request the memory of the entries that are visited next */
+        for (uint32_t j = stackSize; j > base && j + 2 > stackSize; --j) {
+            if (stack[j - 1].count > 0)
+                prefetch(&packets[stack[j - 1].child]);
+            else
+                prefetch(&nodes[stack[j - 1].child]);
+        }
+    }
+
+    raysPerLeaf = leafCount > 0 ? (float) leafRayCount / leafCount : (float) count;
+    return true;
+}
+
+template <typename Kernel>
+NORI_INLINE void BVH::traverseRays(const AccelBuffer<WideBVHNode<Kernel::Width>> &nodes,
+                                   const AccelBuffer<TrianglePacket<Kernel::Width>> &packets,
+                                   Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const {
+    /* Rays that are not traced as a packet are collected in a contiguous
+       range and traced interleaved. Packets only pay off if their rays
+       mostly visit the same leaves, otherwise (e.g. for triangles smaller
+       than a pixel) the memory latency of interleaving is hidden better */
+    uint32_t incoherent = 0;
+    bool coherent = true;
+    for (uint32_t start = 0; start < count; start += PacketSize) {
+        uint32_t packetCount = std::min(PacketSize, count - start);
+        float raysPerLeaf;
+        if (coherent && traversePacket<Kernel>(nodes, packets, rays + start, its + start, prims + start,
+                                               packetCount, raysPerLeaf)) {
+            coherent = raysPerLeaf >= MinPacketCoherence * packetCount;
+            traverseInterleaved<Kernel, false>(nodes, packets, rays + incoherent, its + incoherent,
+                                        prims + incoherent, start - incoherent);
+            incoherent = start + packetCount;
+        }
+    }
+    traverseInterleaved<Kernel, false>(nodes, packets, rays + incoherent, its + incoherent,
+                                prims + incoherent, count - incoherent);
+}
+
+bool BVH::traverseScalar(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const {
+    return shadowRay ? traverseWide<KernelScalar, true>(m_nodes4, m_packets4, ray, its, prim)
+                     : traverseWide<KernelScalar, false>(m_nodes4, m_packets4, ray, its, prim);
+}
+
+void BVH::traverseScalar(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const {
+    if (shadowRay)
+        traverseInterleaved<KernelScalar, true>(m_nodes4, m_packets4, rays, its, prims, count);
+    else
+        traverseRays<KernelScalar>(m_nodes4, m_packets4, rays, its, prims, count);
+}
+
+#if defined(NORI_X86)
+bool BVH::traverseSSE2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const {
+    return shadowRay ? traverseWide<KernelSSE2, true>(m_nodes4, m_packets4, ray, its, prim)
+                     : traverseWide<KernelSSE2, false>(m_nodes4, m_packets4, ray, its, prim);
+}
+
+NORI_TARGET_AVX2 bool BVH::traverseAVX2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const {
+    return shadowRay ? traverseWide<KernelAVX2, true>(m_nodes8, m_packets8, ray, its, prim)
+                     : traverseWide<KernelAVX2, false>(m_nodes8, m_packets8, ray, its, prim);
+}
+
+void BVH::traverseSSE2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const {
+    if (shadowRay)
+        traverseInterleaved<KernelSSE2, true>(m_nodes4, m_packets4, rays, its, prims, count);
+    else
+        traverseRays<KernelSSE2>(m_nodes4, m_packets4, rays, its, prims, count);
+}
+
+NORI_TARGET_AVX2 void BVH::traverseAVX2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count,
+                                        bool shadowRay) const {
+    if (shadowRay)
+        traverseInterleaved<KernelAVX2, true>(m_nodes8, m_packets8, rays, its, prims, count);
+    else
+        traverseRays<KernelAVX2>(m_nodes8, m_packets8, rays, its, prims, count);
+}
+#else
+bool BVH::traverseSSE2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const {
+    return traverseScalar(ray, its, prim, shadowRay);
+}
+
+bool BVH::traverseAVX2(Ray3f &ray, Intersection *its, uint32_t &prim, bool shadowRay) const {
+    return traverseScalar(ray, its, prim, shadowRay);
+}
+
+void BVH::traverseSSE2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const {
+    traverseScalar(rays, its, prims, count, shadowRay);
+}
+
+void BVH::traverseAVX2(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count, bool shadowRay) const {
+    traverseScalar(rays, its, prims, count, shadowRay);
+}
+#endif
+
+bool BVH::traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const {
+    if (m_nodes4.empty() && m_nodes8.empty())
+        return false;
+    switch (m_simdLevel) {
+        case EAVX2: return traverseAVX2(ray, &its, prim, false);
+        case ESSE2: return traverseSSE2(ray, &its, prim, false);
+        default:    return traverseScalar(ray, &its, prim, false);
+    }
+}
+
+bool BVH::occluded(const Ray3f &ray_, uint32_t &prim) const {
+    if (m_nodes4.empty() && m_nodes8.empty())
+        return false;
+    Ray3f ray(ray_);
+    switch (m_simdLevel) {
+        case EAVX2: return traverseAVX2(ray, nullptr, prim, true);
+        case ESSE2: return traverseSSE2(ray, nullptr, prim, true);
+        default:    return traverseScalar(ray, nullptr, prim, true);
+    }
+}
+
+void BVH::traverseBatch(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const {
+    if (m_nodes4.empty() && m_nodes8.empty()) {
+        std::fill(prims, prims + count, (uint32_t) -1);
+        return;
+    }
+    switch (m_simdLevel) {
+        case EAVX2: traverseAVX2(rays, its, prims, count, false); break;
+        case ESSE2: traverseSSE2(rays, its, prims, count, false); break;
+        default:    traverseScalar(rays, its, prims, count, false); break;
+    }
+}
+
+void BVH::occludedBatch(Ray3f *rays, uint32_t *prims, uint32_t count) const {
+    if (m_nodes4.empty() && m_nodes8.empty()) {
+        std::fill(prims, prims + count, (uint32_t) -1);
+        return;
+    }
+    switch (m_simdLevel) {
+        case EAVX2: traverseAVX2(rays, nullptr, prims, count, true); break;
+        case ESSE2: traverseSSE2(rays, nullptr, prims, count, true); break;
+        default:    traverseScalar(rays, nullptr, prims, count, true); break;
+    }
+}
+
+void Accel::traverseBatch(Ray3f *rays, Intersection *its, uint32_t *prims, uint32_t count) const {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!traverse(rays[i], its[i], prims[i]))
+            prims[i] = (uint32_t) -1;
+    }
+}
+
+void Accel::occludedBatch(Ray3f *rays, uint32_t *prims, uint32_t count) const {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!occluded(rays[i], prims[i]))
+            prims[i] = (uint32_t) -1;
+    }
+}
+
+template <bool ShadowRay> bool Accel::traverseInstances(Ray3f &ray, Intersection *its, uint32_t &prim,
+                                                        uint32_t &instance) const {
+    uint32_t stack[MaxDepth];
+    uint32_t stackSize = 0, n = 0;
+    bool foundIntersection = false;
+
+    while (true) {
+        const BVHNode &node = m_instanceNodes[n];
+        float nearT, farT;
+
+        if (node.bbox.rayIntersect(ray, nearT, farT) && nearT <= ray.maxt && farT >= ray.mint) {
+            if (!node.isLeaf()) {
+                /* Visit the child on the near side of the split first */
+                bool dirIsNeg = ray.d[node.axis] < 0;
+                stack[stackSize++] = node.child + (dirIsNeg ? 0 : 1);
+                n = node.child + (dirIsNeg ? 1 : 0);
+                continue;
+            }
+
+            for (uint32_t i = node.primOffset; i < node.primOffset + node.primCount; ++i) {
+                const Instance *candidate = m_instances[m_instanceIndexes[i]];
+                const Accel *accel = candidate->getShapeGroup()->getAccel();
+
+                /* The direction is not normalized after the transformation,
+                   hence distances along the ray are the same in both spaces */
+                Ray3f objectRay = candidate->getWorldToObject() * ray;
+                if (ShadowRay) {
+                    if (accel->occluded(objectRay, prim)) {
+                        instance = m_instanceIndexes[i];
+                        return true;
+                    }
+                } else if (accel->traverse(objectRay, *its, prim)) {
+                    ray.maxt = objectRay.maxt;
+                    instance = m_instanceIndexes[i];
+                    foundIntersection = true;
+                }
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        n = stack[--stackSize];
+    }
+
+    return foundIntersection;
+}
+
+namespace {
+
+/// Triangle that blocked the last shadow ray traced by the current thread
+struct OccluderCache {
+    /// ID of the structure that was queried, or zero if the ray was not blocked
+    uint64_t accel = 0;
+    const Mesh *mesh = nullptr;
+    uint32_t face = 0;
+    /// Instance of the mesh (if any)
+    const Instance *instance = nullptr;
+};
+
+thread_local OccluderCache occluderCache;
+
+/**
+ * Size of an acceleration data structure below which ray streams are traced
+ * ray by ray in their original order. The nodes of such structures stay in
+ * the caches anyway, so that sorting the rays would only add overhead
+ */
+constexpr size_t MinStreamMemoryUsage = 4 * 1024 * 1024;
+
+/**
+ * \brief Return the order in which a stream of rays is traced
+ *
+ * Rays are binned by the octant of their direction and then ordered along
+ * a Morton curve through their origins within \c bbox. Rays of the same
+ * bin start close to each other and travel in similar directions, so that
+ * they mostly visit the same nodes while those are still in the cache.
+ */
+std::vector<uint32_t> binRays(const Ray3f *rays, uint32_t count, const BoundingBox3f &bbox) {
+    /* 2^9 cells along each axis, which makes 30-bit keys with the octant */
+    constexpr uint32_t MortonBits = 9, CellCount = 1u << MortonBits;
+    Vector3f scale = Vector3f::Zero();
+    if (bbox.isValid()) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = bbox.max[axis] - bbox.min[axis];
+            scale[axis] = extent > 0 ? CellCount / extent : 0.0f;
+        }
+    }
+
+    std::vector<uint32_t> keys(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        const Ray3f &ray = rays[i];
+        uint32_t octant = 0, morton = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            octant |= (std::signbit(ray.d[axis]) ? 1u : 0u) << axis;
+            float cell = bbox.isValid() ? (ray.o[axis] - bbox.min[axis]) * scale[axis] : 0.0f;
+            /* Also maps NaNs to the first cell */
+            uint32_t index = cell > 0 ? (uint32_t) std::min(cell, (float) (CellCount - 1)) : 0u;
+            morton |= expandBits(index) << axis;
+        }
+        keys[i] = (octant << (3 * MortonBits)) | morton;
+    }
+
+    /* Radix sort of the ray indices by their keys, 10 bits per pass */
+    constexpr uint32_t RadixBits = 10, BucketCount = 1u << RadixBits;
+    std::vector<uint32_t> order(count), temp(count);
+    for (uint32_t i = 0; i < count; ++i)
+        order[i] = i;
+    for (uint32_t shift = 0; shift < 3 * MortonBits + 3; shift += RadixBits) {
+        uint32_t offsets[BucketCount] = { 0 };
+        for (uint32_t i = 0; i < count; ++i)
+            offsets[(keys[i] >> shift) & (BucketCount - 1)]++;
+        uint32_t sum = 0;
+        for (uint32_t &offset : offsets) {
+            uint32_t bucketSize = offset;
+            offset = sum;
+            sum += bucketSize;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t index = order[i];
+            temp[offsets[(keys[index] >> shift) & (BucketCount - 1)]++] = index;
+        }
+        order.swap(temp);
+    }
+    return order;
+}
+
+}
+
+uint64_t Accel::newId() {
+    static std::atomic<uint64_t> nextId { 1 };
+    return nextId++;
+}
+
+void Accel::completeIntersection(Intersection &its, uint32_t prim, uint32_t instance, uint32_t attributes) const {
+    /* Look up the mesh and triangle index of the closest intersection */
+    its.instance = instance != NoInstance ? m_instances[instance] : nullptr;
+    const Accel *accel = its.instance ? its.instance->getShapeGroup()->getAccel() : this;
+    uint32_t meshIndex = accel->findMesh(prim);
+    its.mesh = accel->m_meshes[meshIndex];
+    its.f = prim - accel->m_meshOffset[meshIndex];
+    its.computed = 0;
+    its.compute(attributes);
+}
+
+bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay, uint32_t attributes) const {
+    if (shadowRay)
+        return rayOccluded(ray_);
+
+    uint32_t prim = (uint32_t) -1;   // Global primitive ID of the closest intersection
+    uint32_t instance = NoInstance;  // Instance of the closest intersection (if any)
+
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    bool foundIntersection = traverse(ray, its, prim);
+
+    if (!m_instanceNodes.empty())
+        foundIntersection |= traverseInstances<false>(ray, &its, prim, instance);
+
+    if (foundIntersection)
+        completeIntersection(its, prim, instance, attributes);
+
+    return foundIntersection;
+}
+
+uint32_t Accel::rayIntersect(const Ray3f *rays_, Intersection *its, uint32_t count, uint32_t attributes) const {
+    /* Copies of the rays (whose '.maxt' values are updated) are made in chunks */
+    constexpr uint32_t ChunkSize = 64;
+    Ray3f rays[ChunkSize];
+    uint32_t prims[ChunkSize];
+    uint32_t hitCount = 0;
+
+    for (uint32_t start = 0; start < count; start += ChunkSize) {
+        uint32_t chunkCount = std::min(ChunkSize, count - start);
+        std::copy(rays_ + start, rays_ + start + chunkCount, rays);
+        traverseBatch(rays, its + start, prims, chunkCount);
+
+        for (uint32_t i = 0; i < chunkCount; ++i) {
+            Intersection &hit = its[start + i];
+            uint32_t instance = NoInstance;
+            bool foundIntersection = prims[i] != (uint32_t) -1;
+
+            if (!m_instanceNodes.empty())
+                foundIntersection |= traverseInstances<false>(rays[i], &hit, prims[i], instance);
+
+            if (foundIntersection) {
+                completeIntersection(hit, prims[i], instance, attributes);
+                hitCount++;
+            } else {
+                hit.mesh = nullptr;
+            }
+        }
+    }
+
+    return hitCount;
+}
+
+uint32_t Accel::intersectStream(const Ray3f *rays, Intersection *its, uint32_t count, uint32_t attributes) const {
+    if (getMemoryUsage() < MinStreamMemoryUsage) {
+        uint32_t hitCount = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (rayIntersect(rays[i], its[i], false, attributes))
+                hitCount++;
+            else
+                its[i].mesh = nullptr;
+        }
+        return hitCount;
+    }
+
+    std::vector<uint32_t> order = binRays(rays, count, m_bbox);
+
+    /* Trace the rays in chunks of the sorted order */
+    constexpr uint32_t ChunkSize = 64;
+    Ray3f chunk[ChunkSize];
+    Intersection hits[ChunkSize];
+    uint32_t hitCount = 0;
+
+    for (uint32_t start = 0; start < count; start += ChunkSize) {
+        uint32_t chunkCount = std::min(ChunkSize, count - start);
+        for (uint32_t i = 0; i < chunkCount; ++i)
+            chunk[i] = rays[order[start + i]];
+        hitCount += rayIntersect(chunk, hits, chunkCount, attributes);
+        for (uint32_t i = 0; i < chunkCount; ++i)
+            its[order[start + i]] = hits[i];
+    }
+
+    return hitCount;
+}
+
+uint32_t Accel::occludedStream(const Ray3f *rays, bool *occluded, uint32_t count) const {
+    if (getMemoryUsage() < MinStreamMemoryUsage) {
+        uint32_t occludedCount = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            occluded[i] = rayOccluded(rays[i]);
+            occludedCount += occluded[i] ? 1 : 0;
+        }
+        return occludedCount;
+    }
+
+    std::vector<uint32_t> order = binRays(rays, count, m_bbox);
+
+    constexpr uint32_t ChunkSize = 64;
+    Ray3f chunk[ChunkSize];
+    uint32_t prims[ChunkSize];
+    uint32_t occludedCount = 0;
+
+    for (uint32_t start = 0; start < count; start += ChunkSize) {
+        uint32_t chunkCount = std::min(ChunkSize, count - start);
+        for (uint32_t i = 0; i < chunkCount; ++i)
+            chunk[i] = rays[order[start + i]];
+        occludedBatch(chunk, prims, chunkCount);
+
+        for (uint32_t i = 0; i < chunkCount; ++i) {
+            bool foundIntersection = prims[i] != (uint32_t) -1;
+            if (!foundIntersection && !m_instanceNodes.empty()) {
+                uint32_t instance = NoInstance;
+                foundIntersection = traverseInstances<true>(chunk[i], nullptr, prims[i], instance);
+            }
+            occluded[order[start + i]] = foundIntersection;
+            occludedCount += foundIntersection ? 1 : 0;
+        }
+    }
+
+    return occludedCount;
+}
+
+bool Accel::rayOccluded(const Ray3f &ray_) const {
+    OccluderCache &cache = occluderCache;
+    if (cache.accel == m_id) {
+        float u, v, t;
+        if (cache.instance ? cache.mesh->rayIntersect(cache.face, cache.instance->getWorldToObject() * ray_, u, v, t)
+                           : cache.mesh->rayIntersect(cache.face, ray_, u, v, t))
+            return true;
+    }
+
+    uint32_t prim = 0, instance = NoInstance;
+    bool foundIntersection = occluded(ray_, prim);
+
+    if (!foundIntersection && !m_instanceNodes.empty()) {
+        Ray3f ray(ray_);
+        foundIntersection = traverseInstances<true>(ray, nullptr, prim, instance);
+    }
+
+    if (!foundIntersection) {
+        cache.accel = 0;
+        return false;
+    }
+
+    const Instance *hitInstance = instance != NoInstance ? m_instances[instance] : nullptr;
+    const Accel *accel = hitInstance ? hitInstance->getShapeGroup()->getAccel() : this;
+    uint32_t meshIndex = accel->findMesh(prim);
+    cache.accel = m_id;
+    cache.mesh = accel->m_meshes[meshIndex];
+    cache.face = prim - accel->m_meshOffset[meshIndex];
+    cache.instance = hitInstance;
+    return true;
+}
+
+std::string BVH::toString() const {
+    return tfm::format(
+        "BVH[\n"
+        "  builder = %s,\n"
+        "  maxLeafSize = %i,\n"
+        "  maxDepth = %i,\n"
+        "  traversalCost = %f,\n"
+        "  intersectionCost = %f\n"
+        "]",
+        m_buildMode == ESpatialSplits
+            ? tfm::format("sbvh (duplicationBudget = %f)", m_duplicationBudget)
+            : std::string("binned"),
+        m_maxLeafSize,
+        m_maxDepth,
+        m_traversalCost,
+        m_intersectionCost
+    );
+}
+
+NORI_REGISTER_CLASS(BVH, "bvh");
+NORI_NAMESPACE_END
@@ -0,0 +1,197 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/accel.h>
+#include <filesystem/path.h>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+
+/// Directory of the cache files (caching is disabled if empty)
+std::string cacheDirectory;
+/// Ignore existing cache files
+bool forceRebuild = false;
+
+/// Version of the cache file format. Increment whenever the builder or the node layout changes
+constexpr uint32_t CacheVersion = 2;
+/// Alignment of the arrays within a cache file
+constexpr uint64_t CacheAlignment = 64;
+
+/// Header at the beginning of every cache file, followed by the node and packet arrays
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint64_t key;
+    uint64_t nodeOffset, nodeCount;
+    uint64_t packetOffset, packetCount;
+    uint32_t maxDepth;
+    uint32_t unused;
+    double buildTime;
+};
+
+const char CacheMagic[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+
+std::string cacheFilename(uint64_t key) {
+    return (filesystem::path(cacheDirectory) /
+            filesystem::path(tfm::format("%016x.bvh", key))).str();
+}
+
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + CacheAlignment - 1) / CacheAlignment * CacheAlignment;
+}
+
+/// Write \c size bytes and pad the stream to the next aligned offset
+void writeAligned(std::ofstream &os, const void *data, size_t size) {
+    const char zeros[CacheAlignment] = { };
+    os.write((const char *) data, size);
+    uint64_t pos = (uint64_t) os.tellp();
+    os.write(zeros, alignOffset(pos) - pos);
+}
+
+}
+
+void BVH::setCacheDirectory(const std::string &directory) {
+    cacheDirectory = directory;
+}
+
+const std::string &BVH::getCacheDirectory() {
+    return cacheDirectory;
+}
+
+void BVH::setForceRebuild(bool value) {
+    forceRebuild = value;
+}
+
+uint64_t BVH::cacheKey() const {
+    Hasher hasher;
+    hasher.add(CacheVersion);
+    hasher.add(packetWidth());
+    hasher.add(m_maxDepth);
+    hasher.add(m_maxLeafSize);
+    hasher.add(m_traversalCost);
+    hasher.add(m_intersectionCost);
+    hasher.add((uint32_t) m_buildMode);
+    if (m_buildMode == ESpatialSplits)
+        hasher.add(m_duplicationBudget);
+    for (const Mesh *mesh : m_meshes) {
+        const MeshMatrixXf &V = mesh->getVertexPositions();
+        const MeshMatrixXu &F = mesh->getIndices();
+        hasher.add((uint64_t) V.cols());
+        hasher.add((uint64_t) F.cols());
+        hasher.add(V.data(), sizeof(float) * V.size());
+        hasher.add(F.data(), sizeof(uint32_t) * F.size());
+    }
+    return hasher.get();
+}
+
+bool BVH::loadCache(uint64_t key) {
+    std::string filename = cacheFilename(key);
+    if (forceRebuild || !filesystem::path(filename).is_file())
+        return false;
+
+    std::unique_ptr<MemoryMappedFile> file;
+    try {
+        file.reset(new MemoryMappedFile(filename));
+    } catch (const NoriException &e) {
+        cerr << "Accel: unable to load the cache: " << e.what() << endl;
+        return false;
+    }
+
+    /* Reject files of a different version, width or key, as well as
+       truncated ones (e.g. because the disk ran full while writing) */
+    uint32_t width = packetWidth();
+    size_t nodeSize = width == 8 ? sizeof(WideBVHNode<8>) : sizeof(WideBVHNode<4>);
+    size_t packetSize = width == 8 ? sizeof(TrianglePacket<8>) : sizeof(TrianglePacket<4>);
+    CacheHeader header;
+    if (file->size() < sizeof(CacheHeader))
+        return false;
+    memcpy(&header, file->data(), sizeof(CacheHeader));
+    if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+        header.version != CacheVersion || header.width != width ||
+        header.key != key ||
+        header.nodeCount == 0 || header.packetCount == 0 ||
+        header.nodeOffset % CacheAlignment != 0 || header.packetOffset % CacheAlignment != 0 ||
+        header.nodeOffset + header.nodeCount * nodeSize > file->size() ||
+        header.packetOffset + header.packetCount * packetSize > file->size()) {
+        cerr << "Accel: ignoring the invalid or outdated cache file \"" << filename << "\"" << endl;
+        return false;
+    }
+
+    /* Traverse the arrays where they are mapped */
+    uint8_t *data = file->data();
+    if (width == 8) {
+        m_nodes8.assign((WideBVHNode<8> *) (data + header.nodeOffset), header.nodeCount);
+        m_packets8.assign((TrianglePacket<8> *) (data + header.packetOffset), header.packetCount);
+    } else {
+        m_nodes4.assign((WideBVHNode<4> *) (data + header.nodeOffset), header.nodeCount);
+        m_packets4.assign((TrianglePacket<4> *) (data + header.packetOffset), header.packetCount);
+    }
+    m_treeDepth = header.maxDepth;
+    m_cachedBuildTime = header.buildTime;
+    m_cacheFile = std::move(file);
+    return true;
+}
+
+void BVH::saveCache(uint64_t key) const {
+    if (!filesystem::path(cacheDirectory).is_directory())
+        filesystem::create_directories(filesystem::path(cacheDirectory));
+
+    uint32_t width = packetWidth();
+    CacheHeader header;
+    memset(&header, 0, sizeof(CacheHeader));
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.width = width;
+    header.key = key;
+    header.nodeCount = width == 8 ? m_nodes8.size() : m_nodes4.size();
+    header.packetCount = width == 8 ? m_packets8.size() : m_packets4.size();
+    header.nodeOffset = alignOffset(sizeof(CacheHeader));
+    header.packetOffset = alignOffset(header.nodeOffset + header.nodeCount *
+        (width == 8 ? sizeof(WideBVHNode<8>) : sizeof(WideBVHNode<4>)));
+    header.maxDepth = m_treeDepth;
+    header.buildTime = m_cachedBuildTime;
+
+    /* Write to a temporary file first, hence other processes never
+       see a partially written cache file */
+    std::string filename = cacheFilename(key);
+    std::string tempFilename = filename + ".tmp";
+    {
+        std::ofstream os(tempFilename, std::ios::binary);
+        if (!os.is_open()) {
+            cerr << "Accel: unable to create the cache file \"" << tempFilename << "\"" << endl;
+            return;
+        }
+        writeAligned(os, &header, sizeof(CacheHeader));
+        if (width == 8) {
+            writeAligned(os, m_nodes8.data(), m_nodes8.size() * sizeof(WideBVHNode<8>));
+            writeAligned(os, m_packets8.data(), m_packets8.size() * sizeof(TrianglePacket<8>));
+        } else {
+            writeAligned(os, m_nodes4.data(), m_nodes4.size() * sizeof(WideBVHNode<4>));
+            writeAligned(os, m_packets4.data(), m_packets4.size() * sizeof(TrianglePacket<4>));
+        }
+        if (!os.good()) {
+            cerr << "Accel: unable to write the cache file \"" << tempFilename << "\"" << endl;
+            os.close();
+            std::remove(tempFilename.c_str());
+            return;
+        }
+    }
+
+#if defined(_WIN32)
+    std::remove(filename.c_str());
+#endif
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+        cerr << "Accel: unable to write the cache file \"" << filename << "\"" << endl;
+        std::remove(tempFilename.c_str());
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,216 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/acceltuner.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+
+/// Number of camera rays and of random rays within the scene bounds
+constexpr uint32_t SampleRayCount = 4096;
+
+/// Number of measurements per candidate, of which the fastest one counts
+constexpr int MeasurementCount = 3;
+
+/// Minimum time in milliseconds that the sample rays are traced per measurement
+constexpr double MeasurementTime = 50;
+
+/// Relative speedup that a candidate needs to replace the fastest one so far
+constexpr double MinSpeedup = 1.02;
+
+/// Parameter of a candidate structure, corresponding to a property tag
+struct Param {
+    const char *tag;
+    const char *name;
+    std::string value;
+};
+
+/// Acceleration data structure and build parameters to be measured
+struct Candidate {
+    const char *type;
+    std::vector<Param> params;
+
+    PropertyList getProperties() const {
+        PropertyList props;
+        for (const Param &param : params) {
+            if (strcmp(param.tag, "string") == 0)
+                props.setString(param.name, param.value);
+            else if (strcmp(param.tag, "integer") == 0)
+                props.setInteger(param.name, std::stoi(param.value));
+            else
+                props.setFloat(param.name, std::stof(param.value));
+        }
+        return props;
+    }
+
+    /// Return the candidate as a tag of a scene description
+    std::string toXML() const {
+        std::string result = tfm::format("<accel type=\"%s\">", type);
+        for (const Param &param : params)
+            result += tfm::format("\n    <%s name=\"%s\" value=\"%s\"/>", param.tag, param.name, param.value);
+        return result + "\n</accel>";
+    }
+
+    std::string toString() const {
+        std::string result = type;
+        for (size_t i = 0; i < params.size(); ++i)
+            result += tfm::format("%s%s=%s", i == 0 ? " (" : ", ", params[i].name, params[i].value);
+        return result + (params.empty() ? "" : ")");
+    }
+};
+
+/// Candidates in the order they are tried, the more promising ones first
+std::vector<Candidate> candidates() {
+    std::vector<Candidate> result;
+    for (const char *builder : { "binned", "sbvh" }) {
+        for (const char *leafSize : { "8", "4", "16" }) {
+            result.push_back({ "bvh", { { "string", "builder", builder },
+                                        { "integer", "maxLeafSize", leafSize } } });
+        }
+    }
+    for (const char *intersectionCost : { "80", "20", "160" }) {
+        result.push_back({ "kdtree", { { "float", "intersectionCost", intersectionCost },
+                                       { "float", "emptyBonus", "0.5" } } });
+    }
+    for (const char *leafSize : { "16", "8", "32" }) {
+        result.push_back({ "octree", { { "integer", "maxLeafSize", leafSize },
+                                       { "integer", "maxDepth", "12" } } });
+    }
+    return result;
+}
+
+}
+
+AccelTuner::AccelTuner(const Scene *scene, float budget)
+    : m_scene(scene), m_budget(budget) { }
+
+void AccelTuner::generateRays(const Accel *accel) {
+    const Camera *camera = m_scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    const BoundingBox3f &bbox = accel->getBoundingBox();
+    pcg32 random;
+
+    m_rays.clear();
+    m_shadowRays.clear();
+    for (uint32_t i = 0; i < SampleRayCount; ++i) {
+        Ray3f ray;
+        Point2f pixel(random.nextFloat() * outputSize.x(), random.nextFloat() * outputSize.y());
+        camera->sampleRay(ray, pixel, Point2f(random.nextFloat(), random.nextFloat()));
+        m_rays.push_back(ray);
+
+        Intersection its;
+        if (accel->rayIntersect(ray, its, false)) {
+            Point2f sample(random.nextFloat(), random.nextFloat());
+            m_shadowRays.emplace_back(its.p, Warp::squareToUniformSphere(sample));
+        }
+    }
+
+    for (uint32_t i = 0; i < SampleRayCount; ++i) {
+        Point3f o = bbox.min + bbox.getExtents().cwiseProduct(
+            Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat()));
+        Point2f sample(random.nextFloat(), random.nextFloat());
+        m_rays.emplace_back(o, Warp::squareToUniformSphere(sample));
+    }
+}
+
+double AccelTuner::measure(const Accel *accel) const {
+    auto trace = [&]() {
+        size_t hits = 0;
+        for (const Ray3f &ray : m_rays) {
+            Intersection its;
+            hits += accel->rayIntersect(ray, its, false) ? 1 : 0;
+        }
+        for (const Ray3f &ray : m_shadowRays) {
+            Intersection its;
+            hits += accel->rayIntersect(ray, its, true) ? 1 : 0;
+        }
+        return hits;
+    };
+
+    /* The first pass brings the structure into the cache. Afterwards, the
+       fastest measurement is the one that was disturbed the least */
+    trace();
+
+    double throughput = 0;
+    for (int i = 0; i < MeasurementCount; ++i) {
+        Timer timer;
+        size_t rayCount = 0;
+        double time;
+        do {
+            trace();
+            rayCount += m_rays.size() + m_shadowRays.size();
+            time = timer.elapsed();
+        } while (time < MeasurementTime);
+        throughput = std::max(throughput, rayCount / (time * 1e-3));
+    }
+    return throughput;
+}
+
+Accel *AccelTuner::tune(Accel *accel) {
+    Timer timer;
+    generateRays(accel);
+
+    /* Measure the actual build times and do not fill the cache with
+       the trees of the candidates */
+    std::string cacheDirectory = BVH::getCacheDirectory();
+    BVH::setCacheDirectory("");
+
+    Accel *best = accel;
+    std::string bestName = "the acceleration data structure of the scene";
+    std::string bestXML;
+    double bestThroughput = measure(accel);
+    cout << tfm::format("[accel tuning]: %.3f Mrays/s for the acceleration data structure of the scene",
+                        bestThroughput * 1e-6) << endl;
+
+    try {
+        for (const Candidate &candidate : candidates()) {
+            if (timer.elapsed() > m_budget * 1000) {
+                cout << "[accel tuning]: time budget exhausted, skipping the remaining candidates" << endl;
+                break;
+            }
+
+            std::unique_ptr<Accel> other(static_cast<Accel *>(
+                NoriObjectFactory::createInstance(candidate.type, candidate.getProperties())));
+            for (Mesh *mesh : m_scene->getMeshes())
+                other->addMesh(mesh);
+            for (Instance *instance : m_scene->getInstances())
+                other->addInstance(instance);
+            other->build(false);
+
+            double throughput = measure(other.get());
+            cout << tfm::format("[accel tuning]: %.3f Mrays/s for %s, built in %s", throughput * 1e-6,
+                                candidate.toString(), timeString(other->getBuildTime())) << endl;
+            if (throughput > MinSpeedup * bestThroughput) {
+                if (best != accel)
+                    delete best;
+                best = other.release();
+                bestName = candidate.toString();
+                bestXML = candidate.toXML();
+                bestThroughput = throughput;
+            }
+        }
+    } catch (...) {
+        BVH::setCacheDirectory(cacheDirectory);
+        if (best != accel)
+            delete best;
+        throw;
+    }
+    BVH::setCacheDirectory(cacheDirectory);
+
+    cout << "[accel tuning]: chose " << bestName << " after " << timeString(timer.elapsed()) << endl;
+    if (!bestXML.empty())
+        cout << "[accel tuning]: add the following to the scene to skip the tuning:" << endl
+             << indent(bestXML, 4).insert(0, "    ") << endl;
+    return best;
+}
+
+NORI_NAMESPACE_END
@@ -9,18 +9,27 @@ public:
     AOIntegrator(const PropertyList& propList) {}
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection* its) const {
+        if (!its)
             return { 0.0f };
 
         auto dir = Warp::squareToCosineHemisphere(sampler->next2D());
         auto pdf = Warp::squareToCosineHemispherePdf(dir);
-        dir = its.shFrame.toWorld(dir);
+        dir = its->shFrame.toWorld(dir);
 
-        if (scene->rayIntersect(Ray3f(its.p + dir * Epsilon, dir)))
+        if (scene->rayIntersect(Ray3f(its->p + dir * Epsilon, dir)))
             return { 0.0f };
 
         //Li/pi * cos_theta / pdf
-        return Color3f(1.0f) * INV_PI * std::max(0.0f, its.shFrame.n.dot(dir.normalized())) / pdf;
+        return Color3f(1.0f) * INV_PI * std::max(0.0f, its->shFrame.n.dot(dir.normalized())) / pdf;
+    }
+
+    uint32_t getPrimaryHitAttributes() const {
+        return Intersection::EPosition | Intersection::EShadingFrame;
     }
 
     std::string toString() const {
@@ -5,6 +5,7 @@
 */
 
 #include <nori/object.h>
+#include <nori/simd.h>
 #include <Eigen/Geometry>
 #include <Eigen/LU>
 #include <filesystem/resolver.h>
@@ -158,6 +159,34 @@ std::string memString(size_t size, bool precise) {
     return os.str();
 }
 
+ESIMDLevel getSIMDLevel() {
+    static const ESIMDLevel level = [] {
+#if !defined(NORI_X86)
+        return EScalar;
+#elif defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 0);
+        int maxLeaf = info[0];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        /* Check that the OS saves the AVX register state */
+        bool avxState = osxsave && (_xgetbv(0) & 6) == 6;
+        bool avx2 = false;
+        if (maxLeaf >= 7) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+        return (avx2 && avxState) ? EAVX2 : ESSE2;
+#else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return EAVX2;
+        return ESSE2;
+#endif
+    }();
+    return level;
+}
+
 filesystem::resolver *getFileResolver() {
     static filesystem::resolver *resolver = new filesystem::resolver();
     return resolver;
@@ -0,0 +1,115 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+ShapeGroup::ShapeGroup(const PropertyList &props) {
+    m_name = props.getString("id");
+}
+
+ShapeGroup::~ShapeGroup() {
+    delete m_accel;
+    for (Mesh *mesh : m_meshes)
+        delete mesh;
+}
+
+void ShapeGroup::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EMesh: {
+                Mesh *mesh = static_cast<Mesh *>(obj);
+                /* Emitters are sampled in world space, which requires a
+                   separate copy of the mesh for every instance */
+                if (mesh->isEmitter())
+                    throw NoriException("ShapeGroup: meshes of a shape group cannot be emitters!");
+                m_meshes.push_back(mesh);
+            }
+            break;
+
+        case EAccel:
+            if (m_accel)
+                throw NoriException("ShapeGroup: there can only be one acceleration data structure per group!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
+        default:
+            throw NoriException("ShapeGroup::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void ShapeGroup::activate() {
+    if (m_meshes.empty())
+        throw NoriException("ShapeGroup \"%s\" does not contain any meshes!", m_name);
+    if (!m_accel) {
+        m_accel = static_cast<Accel *>(
+            NoriObjectFactory::createInstance("bvh", PropertyList()));
+    }
+    for (Mesh *mesh : m_meshes)
+        m_accel->addMesh(mesh);
+    m_accel->build(false);
+}
+
+std::string ShapeGroup::toString() const {
+    uint32_t triangleCount = 0;
+    for (const Mesh *mesh : m_meshes)
+        triangleCount += mesh->getTriangleCount();
+    return tfm::format(
+        "ShapeGroup[\n"
+        "  name = \"%s\",\n"
+        "  meshCount = %i,\n"
+        "  triangleCount = %i\n"
+        "]",
+        m_name,
+        m_meshes.size(),
+        triangleCount
+    );
+}
+
+Instance::Instance(const PropertyList &props) {
+    m_toWorld = props.getTransform("toWorld", Transform());
+    m_worldToObject = m_toWorld.inverse();
+}
+
+void Instance::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EShapeGroup:
+            if (m_group)
+                throw NoriException("Instance: tried to reference multiple shape groups!");
+            m_group = static_cast<const ShapeGroup *>(obj);
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_group)
+        throw NoriException("Instance: no shape group was referenced!");
+
+    const BoundingBox3f &bbox = m_group->getBoundingBox();
+    m_bbox.reset();
+    for (int i = 0; i < 8; ++i)
+        m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  shapeGroup = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_group ? m_group->getName() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(ShapeGroup, "shapegroup");
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
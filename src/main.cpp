@@ -13,16 +13,27 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/warp.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
+#include <tbb/task_arena.h>
 #include <filesystem/resolver.h>
+#include <mutex>
 #include <thread>
+#include <typeinfo>
 
 using namespace nori;
 
 static int threadCount = -1;
 static bool gui = true;
+static bool bench = false;
+static bool accelCache = true;
+static bool rebuildAccel = false;
+
+/* Startup phases that are reported as the time to the first pixel */
+static Timer startupTimer;
+static double sceneLoadTime = 0;
 
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
@@ -34,6 +45,39 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+    /* Integrators that accept the first intersection of the camera rays get
+       the rays of each row of the block traced together, which hides the
+       latency of the acceleration data structure's memory accesses */
+    uint32_t attributes = integrator->getPrimaryHitAttributes();
+    if (attributes != 0) {
+        uint32_t count = (uint32_t) size.x() * sampler->getSampleCount();
+        std::vector<Point2f> pixelSamples(count);
+        std::vector<Color3f> values(count);
+        std::vector<Ray3f> rays(count);
+        std::vector<Intersection> its(count);
+
+        for (int y=0; y<size.y(); ++y) {
+            /* Sample the rays from the camera */
+            uint32_t k = 0;
+            for (int x=0; x<size.x(); ++x) {
+                for (uint32_t i=0; i<sampler->getSampleCount(); ++i, ++k) {
+                    pixelSamples[k] = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                    Point2f apertureSample = sampler->next2D();
+                    values[k] = camera->sampleRay(rays[k], pixelSamples[k], apertureSample);
+                }
+            }
+
+            scene->rayIntersect(rays.data(), its.data(), count, attributes);
+
+            /* Compute the incident radiance and store it in the image block */
+            for (k = 0; k < count; ++k) {
+                Color3f value = values[k] * integrator->Li(scene, sampler, rays[k], its[k].mesh ? &its[k] : nullptr);
+                block.put(pixelSamples[k], value);
+            }
+        }
+        return;
+    }
+
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
@@ -58,7 +102,9 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
 static void render(Scene *scene, const std::string &filename) {
     const Camera *camera = scene->getCamera();
     Vector2i outputSize = camera->getOutputSize();
+    Timer preprocessTimer;
     scene->getIntegrator()->preprocess(scene);
+    double preprocessTime = preprocessTimer.elapsed();
 
     /* Create a block generator (i.e. a work scheduler) */
     BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
@@ -81,6 +127,8 @@ static void render(Scene *scene, const std::string &filename) {
         cout << "Rendering .. ";
         cout.flush();
         Timer timer;
+        double renderStartTime = startupTimer.elapsed(), firstPixelTime = 0;
+        std::once_flag firstBlock;
 
         tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
 
@@ -106,6 +154,7 @@ static void render(Scene *scene, const std::string &filename) {
                 /* The image block has been processed. Now add it to
                    the "big" block that represents the entire image */
                 result.put(block);
+                std::call_once(firstBlock, [&] { firstPixelTime = startupTimer.elapsed(); });
             }
         };
 
@@ -116,6 +165,14 @@ static void render(Scene *scene, const std::string &filename) {
         // map(range);
 
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+        double accelTime = scene->getAccel()->getBuildTime();
+        cout << "Time to first pixel: " << timeString(firstPixelTime) << " (loading the scene "
+             << timeString(sceneLoadTime) << ", of which " << timeString(sceneLoadTime - accelTime)
+             << " parsing and loading meshes and " << timeString(accelTime)
+             << " building the acceleration data structure; preprocessing "
+             << timeString(preprocessTime) << "; first block "
+             << timeString(firstPixelTime - renderStartTime) << ")" << endl;
     });
 
     /* Enter the application main loop */
@@ -147,9 +204,138 @@ static void render(Scene *scene, const std::string &filename) {
     bitmap->savePNG(outputName);
 }
 
+/**
+ * \brief Trace one camera ray through the center of each pixel, followed by
+ * a shadow ray into a random direction from every surface hit, and report
+ * the number of rays per second for both kinds of queries
+ *
+ * \param intersect
+ *    Function with the signature of \ref Accel::rayIntersect() that
+ *    traces the rays
+ */
+template <typename Intersect> static void benchmarkRays(Scene *scene, const Intersect &intersect) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+
+    std::vector<Ray3f> shadowRays;
+    shadowRays.reserve((size_t) outputSize.x() * outputSize.y());
+
+    Timer timer;
+    for (int y=0; y<outputSize.y(); ++y) {
+        for (int x=0; x<outputSize.x(); ++x) {
+            Ray3f ray;
+            camera->sampleRay(ray, Point2f(x + 0.5f, y + 0.5f), Point2f(0.5f, 0.5f));
+
+            Intersection its;
+            if (intersect(ray, its, false))
+                shadowRays.emplace_back(its.p, Warp::squareToUniformSphere(sampler->next2D()));
+        }
+    }
+    double primaryTime = timer.lap();
+
+    size_t occluded = 0;
+    for (const Ray3f &ray : shadowRays) {
+        Intersection its;
+        occluded += intersect(ray, its, true) ? 1 : 0;
+    }
+    double shadowTime = timer.lap();
+
+    size_t primaryCount = (size_t) outputSize.x() * outputSize.y();
+    auto throughput = [](size_t count, double time) {
+        return tfm::format("%.3f Mrays/s", count / (std::max(time, 1.0) * 1000.0));
+    };
+    cout << "  Primary rays: " << primaryCount << " (" << shadowRays.size() << " hits), "
+         << throughput(primaryCount, primaryTime) << endl;
+    cout << "  Shadow rays: " << shadowRays.size() << " (" << occluded << " occluded), "
+         << throughput(shadowRays.size(), shadowTime) << endl;
+}
+
+/**
+ * \brief Measure the throughput of the acceleration data structure
+ *
+ * Rebuilds the acceleration data structure of the scene (bypassing the
+ * on-disk cache) with an increasing number of threads to report the
+ * parallel speedup of the construction. If it is a \ref BVH, also reports
+ * the time taken by a refit and compares the binned SAH builder against
+ * the spatial split builder. Afterwards, compares against the other
+ * acceleration data structures with their default parameters in terms of
+ * tree size, memory and the rays per second of \ref benchmarkRays().
+ */
+static void benchmark(Scene *scene) {
+    /* Measure actual builds instead of loading the cache */
+    BVH::setCacheDirectory("");
+
+    Accel *accel = scene->getAccel();
+    int maxThreads = threadCount > 0 ? threadCount
+        : tbb::task_scheduler_init::default_num_threads();
+    double serialBuildTime = 0;
+    for (int threads = 1; ; threads = std::min(2 * threads, maxThreads)) {
+        tbb::task_arena arena(threads);
+        arena.execute([&] { accel->build(false); });
+        double time = accel->getBuildTime();
+        if (threads == 1)
+            serialBuildTime = time;
+        cout << tfm::format("Build with %i thread(s): %s (speedup %.2fx)", threads,
+            timeString(time, true), std::max(serialBuildTime, 1.0) / std::max(time, 1.0)) << endl;
+        if (threads == maxThreads)
+            break;
+    }
+
+    if (BVH *bvh = dynamic_cast<BVH *>(accel)) {
+        /* Refitting an unchanged tree measures the cost of the bottom-up pass */
+        bvh->refit(false);
+        cout << "Refit: " << timeString(bvh->getRefitTime(), true) << endl;
+
+        BVH::EBuildMode buildMode = bvh->getBuildMode();
+        float duplicationBudget = bvh->getDuplicationBudget();
+        const BVH::EBuildMode modes[] = { BVH::EBinnedSAH, BVH::ESpatialSplits };
+        const char *modeNames[] = { "Binned SAH", "Spatial splits" };
+        for (int i = 0; i < 2; ++i) {
+            tbb::task_arena arena(maxThreads);
+            bvh->setBuildMode(modes[i], duplicationBudget);
+            arena.execute([&] { bvh->build(false); });
+            cout << tfm::format("%s: %i nodes, %i references, %.1f bytes/triangle, SAH cost %.3f, built in %s",
+                modeNames[i], bvh->getNodeCount(), bvh->getReferenceCount(),
+                (double) bvh->getMemoryUsage() / std::max(bvh->getTotalTriangleCount(), 1u),
+                bvh->getSAHCost(), timeString(bvh->getBuildTime(), true)) << endl;
+            benchmarkRays(scene, [&](const Ray3f &ray, Intersection &its, bool shadowRay) {
+                return bvh->rayIntersect(ray, its, shadowRay);
+            });
+        }
+
+        /* Leave the scene with the tree selected by its description */
+        if (bvh->getBuildMode() != buildMode) {
+            bvh->setBuildMode(buildMode, duplicationBudget);
+            bvh->build(false);
+        }
+    }
+
+    const char *types[] = { "bvh", "kdtree", "octree" };
+    for (const char *type : types) {
+        std::unique_ptr<Accel> other(static_cast<Accel *>(
+            NoriObjectFactory::createInstance(type, PropertyList())));
+        if (typeid(*other) == typeid(*accel))
+            continue;
+        for (Mesh *mesh : scene->getMeshes())
+            other->addMesh(mesh);
+        for (Instance *instance : scene->getInstances())
+            other->addInstance(instance);
+        tbb::task_arena arena(maxThreads);
+        arena.execute([&] { other->build(false); });
+        cout << tfm::format("Default %s: %i nodes, %.1f bytes/triangle, built in %s", type,
+            other->getNodeCount(),
+            (double) other->getMemoryUsage() / std::max(other->getTotalTriangleCount(), 1u),
+            timeString(other->getBuildTime(), true)) << endl;
+        benchmarkRays(scene, [&](const Ray3f &ray, Intersection &its, bool shadowRay) {
+            return other->rayIntersect(ray, its, shadowRay);
+        });
+    }
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N]" <<  endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N] [--bench] [--rebuild-accel] [--no-accel-cache]" <<  endl;
         return -1;
     }
 
@@ -176,6 +362,18 @@ int main(int argc, char **argv) {
             gui = false;
             continue;
         }
+        else if (token == "--bench") {
+            bench = true;
+            continue;
+        }
+        else if (token == "--rebuild-accel") {
+            rebuildAccel = true;
+            continue;
+        }
+        else if (token == "--no-accel-cache") {
+            accelCache = false;
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -231,11 +429,29 @@ int main(int argc, char **argv) {
         if (threadCount < 0) {
             threadCount = tbb::task_scheduler_init::automatic;
         }
+        /* Also use the requested number of threads while loading the scene
+           and building the acceleration data structure */
+        tbb::task_scheduler_init init(threadCount);
         try {
+            /* Keep built acceleration data structures in a cache directory
+               next to the scene file, which makes subsequent runs start faster */
+            if (accelCache) {
+                filesystem::path cacheDir = filesystem::path(sceneName).parent_path() /
+                                            filesystem::path(".nori-cache");
+                BVH::setCacheDirectory(cacheDir.str());
+                BVH::setForceRebuild(rebuildAccel);
+            }
+
+            Timer loadTimer;
             std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+            sceneLoadTime = loadTimer.elapsed();
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), sceneName);
+            if (root->getClassType() == NoriObject::EScene) {
+                if (bench)
+                    benchmark(static_cast<Scene *>(root.get()));
+                else
+                    render(static_cast<Scene *>(root.get()), sceneName);
+            }
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
             return -1;
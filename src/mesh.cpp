@@ -8,11 +8,63 @@
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_sort.h>
 
 NORI_NAMESPACE_BEGIN
 
+namespace {
+
+/// Number of bits per axis of the cells of the space-filling curves
+constexpr uint32_t CurveBits = 10;
+
+/// Morton code of a cell (interleaves the bits of the coordinates)
+uint32_t mortonIndex(const uint32_t cell[3]) {
+    return (expandBits(cell[0]) << 2) | (expandBits(cell[1]) << 1) | expandBits(cell[2]);
+}
+
+/**
+ * \brief Index of a cell along the Hilbert curve
+ *
+ * Uses Skilling's algorithm ("Programming the Hilbert curve", 2004), which
+ * transforms the coordinates such that interleaving their bits yields the
+ * Hilbert index
+ */
+uint32_t hilbertIndex(const uint32_t cell[3]) {
+    uint32_t x[3] = { cell[0], cell[1], cell[2] };
+    for (uint32_t q = 1u << (CurveBits - 1); q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int i = 0; i < 3; ++i) {
+            /* Invert the low bits of x[0] if bit q of x[i] is set, and
+               exchange them with those of x[i] otherwise (without branches,
+               which would be mispredicted half of the time) */
+            uint32_t set = (x[i] & q) ? ~0u : 0u;
+            uint32_t t = (x[0] ^ x[i]) & p & ~set;
+            x[0] ^= (p & set) | t;
+            x[i] ^= t;
+        }
+    }
+
+    /* Gray encode */
+    for (int i = 1; i < 3; ++i)
+        x[i] ^= x[i - 1];
+    uint32_t t = 0;
+    for (uint32_t q = 1u << (CurveBits - 1); q > 1; q >>= 1) {
+        if (x[2] & q)
+            t ^= q - 1;
+    }
+    for (int i = 0; i < 3; ++i)
+        x[i] ^= t;
+
+    return mortonIndex(x);
+}
+
+}
+
 Mesh::Mesh() { }
 
 Mesh::~Mesh() {
@@ -27,17 +79,133 @@ void Mesh::activate() {
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
 
+    computeAreaDistribution();
+}
+
+void Mesh::computeAreaDistribution() {
+    /* Evaluate the areas in parallel, but accumulate them in order so
+       that the distribution does not depend on the scheduling */
+    std::vector<float> areas(getTriangleCount());
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, getTriangleCount(), 16 * 1024),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i < range.end(); ++i)
+                areas[i] = surfaceArea(i);
+        }
+    );
+
     m_area = 0.0f;
+    m_disPdf.clear();
     m_disPdf.reserve(getTriangleCount());
-    for (int i = 0; i < getTriangleCount(); ++i)
-    {
-        auto area = surfaceArea(i);
+    for (float area : areas) {
         m_area += area;
         m_disPdf.append(area);
     }
     m_disPdf.normalize();
 }
 
+Mesh::ETriangleOrder Mesh::getTriangleOrder(const PropertyList &props) {
+    std::string order = props.getString("reorder", "none");
+    if (order == "none")
+        return EFileOrder;
+    else if (order == "morton")
+        return EMortonOrder;
+    else if (order == "hilbert")
+        return EHilbertOrder;
+    throw NoriException("Mesh: unknown triangle order \"%s\" (expected \"none\", \"morton\" or \"hilbert\")", order);
+}
+
+void Mesh::reorder(ETriangleOrder order) {
+    uint32_t triangleCount = getTriangleCount(), vertexCount = getVertexCount();
+    if (order == EFileOrder || triangleCount < 2)
+        return;
+
+    /* Sort the triangles by the curve index of the cell that contains their
+       centroid, and by their original index within the same cell. The cells
+       are cubes, since the curve would otherwise follow the thin axis of
+       flat meshes (e.g. noise in the height of a terrain) */
+    constexpr uint32_t CellCount = 1u << CurveBits;
+    float extent = m_bbox.getExtents().maxCoeff();
+    float scale = extent > 0 ? CellCount / extent : 0.0f;
+    std::vector<uint64_t> keys(triangleCount);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, triangleCount, 16 * 1024),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                Point3f centroid = getCentroid(i);
+                uint32_t cell[3];
+                for (int axis = 0; axis < 3; ++axis) {
+                    float c = (centroid[axis] - m_bbox.min[axis]) * scale;
+                    cell[axis] = c > 0 ? (uint32_t) std::min(c, (float) (CellCount - 1)) : 0u;
+                }
+                uint32_t index = order == EHilbertOrder ? hilbertIndex(cell) : mortonIndex(cell);
+                keys[i] = ((uint64_t) index << 32) | i;
+            }
+        }
+    );
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    /* Number the vertices in the order of their first use */
+    const uint32_t Unused = (uint32_t) -1;
+    std::vector<uint32_t> newIndex(vertexCount, Unused), oldIndex;
+    oldIndex.reserve(vertexCount);
+    for (uint64_t key : keys) {
+        uint32_t f = (uint32_t) key;
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = m_F(k, f);
+            if (newIndex[v] == Unused) {
+                newIndex[v] = (uint32_t) oldIndex.size();
+                oldIndex.push_back(v);
+            }
+        }
+    }
+    for (uint32_t v = 0; v < vertexCount; ++v) {
+        if (newIndex[v] == Unused) {
+            newIndex[v] = (uint32_t) oldIndex.size();
+            oldIndex.push_back(v);
+        }
+    }
+
+    /* Permute the triangles and the vertex attributes */
+    MatrixXu F(3, triangleCount);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, triangleCount, 16 * 1024),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                uint32_t f = (uint32_t) keys[i];
+                for (int k = 0; k < 3; ++k)
+                    F(k, i) = newIndex[m_F(k, f)];
+            }
+        }
+    );
+    m_F = F;
+
+    auto permute = [&](MeshMatrixXf &M) {
+        if (M.size() == 0)
+            return;
+        MatrixXf result(M.rows(), M.cols());
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, vertexCount, 16 * 1024),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i)
+                    result.col(i) = M.col(oldIndex[i]);
+            }
+        );
+        M = result;
+    };
+    permute(m_V);
+    permute(m_N);
+    permute(m_UV);
+}
+
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != m_V.rows() || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!",
+                            m_V.cols(), V.cols());
+    m_V = V;
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+    computeAreaDistribution();
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -85,6 +253,84 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+uint32_t Mesh::fillIntersectionRecord(uint32_t index, Intersection &its, uint32_t attributes) const {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+    its.mesh = this;
+
+    /* Without vertex normals, the shading frame is the geometric one */
+    if ((attributes & Intersection::EShadingFrame) && m_N.size() == 0)
+        attributes |= Intersection::EGeometricFrame;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1 - its.bary.sum(), its.bary;
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
+
+    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    if (attributes & Intersection::EPosition)
+        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (attributes & Intersection::ETexCoords) {
+        if (m_UV.size() > 0)
+            its.uv = bary.x() * m_UV.col(idx0) +
+                bary.y() * m_UV.col(idx1) +
+                bary.z() * m_UV.col(idx2);
+        else
+            its.uv = its.bary;
+    }
+
+    /* Compute the geometry frame */
+    if (attributes & Intersection::EGeometricFrame)
+        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+    if (attributes & Intersection::EShadingFrame) {
+        if (m_N.size() > 0) {
+            /* Compute the shading frame. Note that for simplicity,
+               the current implementation doesn't attempt to provide
+               tangents that are continuous across the surface. That
+               means that this code will need to be modified to be able
+               use anisotropic BRDFs, which need tangent continuity */
+
+            its.shFrame = Frame(
+                (bary.x() * m_N.col(idx0) +
+                    bary.y() * m_N.col(idx1) +
+                    bary.z() * m_N.col(idx2)).normalized());
+        } else {
+            its.shFrame = its.geoFrame;
+        }
+    }
+
+    return attributes;
+}
+
+void Intersection::computeAttributes(uint32_t attributes) {
+    attributes = mesh->fillIntersectionRecord(f, *this, attributes);
+
+    /* The attributes above are expressed in the coordinate system of the shape group */
+    if (instance) {
+        const Transform &toWorld = instance->getToWorld();
+        if (attributes & EPosition)
+            p = toWorld * p;
+        if (attributes & EGeometricFrame)
+            geoFrame = Frame((toWorld * geoFrame.n).normalized());
+        if (attributes & EShadingFrame)
+            shFrame = Frame((toWorld * shFrame.n).normalized());
+    }
+
+    computed |= attributes;
+}
+
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     BoundingBox3f result(m_V.col(m_F(0, index)));
     result.expandBy(m_V.col(m_F(1, index)));
@@ -0,0 +1,49 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+
+using namespace nori;
+
+/* Converts a mesh into Nori's binary mesh format (see \ref NMesh) */
+int main(int argc, char **argv) {
+    /* Optionally sort the triangles along a space-filling curve (see Mesh::reorder()) */
+    std::string order = "none";
+    int arg = 1;
+    if (argc == 5 && std::string(argv[1]) == "--reorder") {
+        order = argv[2];
+        arg = 3;
+    }
+    if (argc != arg + 2) {
+        cerr << "Syntax: " << argv[0] << " [--reorder morton|hilbert] <input.obj|input.ply> <output.nmesh>" << endl;
+        return -1;
+    }
+    std::string inputName = argv[arg], outputName = argv[arg + 1];
+
+    try {
+        filesystem::path input(inputName);
+        if (input.extension() != "obj" && input.extension() != "ply")
+            throw NoriException("unknown file \"%s\", expected an extension of type .obj or .ply", inputName);
+
+        /* Load the mesh like a scene that references it */
+        getFileResolver()->prepend(input.parent_path());
+        PropertyList props;
+        props.setString("filename", input.filename());
+        props.setString("reorder", order);
+        std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance(input.extension(), props)));
+
+        Timer timer;
+        NMesh::write(mesh.get(), outputName);
+        cout << "Wrote \"" << outputName << "\" in " << timer.elapsedString() << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/mmap.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+#if defined(_WIN32)
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) : m_filename(filename) {
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw NoriException("Unable to open \"%s\"!", filename);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw NoriException("Unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) size.QuadPart;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = (uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (!m_data) {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw NoriException("Unable to map \"%s\" into memory!", filename);
+    }
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+}
+#else
+MemoryMappedFile::MemoryMappedFile(const std::string &filename) : m_filename(filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw NoriException("Unable to open \"%s\"!", filename);
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        throw NoriException("Unable to determine the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) sb.st_size;
+
+    if (m_size > 0) {
+        void *ptr = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw NoriException("Unable to map \"%s\" into memory!", filename);
+        }
+        m_data = (uint8_t *) ptr;
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+}
+
+MemoryMappedFile::~MemoryMappedFile() {
+    if (m_data)
+        munmap(m_data, m_size);
+}
+#endif
+
+NORI_NAMESPACE_END
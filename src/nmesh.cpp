@@ -0,0 +1,184 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+
+/// Version of the file format. Increment whenever the layout changes
+constexpr uint32_t NMeshVersion = 1;
+/// Alignment of the blocks within a file
+constexpr uint64_t NMeshAlignment = 64;
+
+const char NMeshMagic[8] = { 'N', 'O', 'R', 'I', 'M', 'S', 'H', '\0' };
+
+/// Header at the beginning of every mesh file, followed by the blocks
+struct NMeshHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    uint64_t vertexCount, triangleCount;
+    /// Offsets of the blocks in bytes (0 if there are no normals or texture coordinates)
+    uint64_t positionOffset, normalOffset, texCoordOffset, indexOffset;
+    float bboxMin[3], bboxMax[3];
+    /// Checksum of the blocks (see \ref checksum())
+    uint64_t checksum;
+};
+
+uint64_t alignOffset(uint64_t offset) {
+    return (offset + NMeshAlignment - 1) / NMeshAlignment * NMeshAlignment;
+}
+
+/// Write \c size bytes and pad the stream to the next aligned offset
+void writeAligned(std::ofstream &os, const void *data, size_t size) {
+    const char zeros[NMeshAlignment] = { };
+    os.write((const char *) data, size);
+    uint64_t pos = (uint64_t) os.tellp();
+    os.write(zeros, alignOffset(pos) - pos);
+}
+
+/// Hash the blocks of a mesh (without the padding between them)
+uint64_t checksum(const NMeshHeader &header, const float *V, const float *N, const float *UV, const uint32_t *F) {
+    Hasher hasher;
+    hasher.add(V, sizeof(float) * 3 * header.vertexCount);
+    if (N)
+        hasher.add(N, sizeof(float) * 3 * header.vertexCount);
+    if (UV)
+        hasher.add(UV, sizeof(float) * 2 * header.vertexCount);
+    hasher.add(F, sizeof(uint32_t) * 3 * header.triangleCount);
+    return hasher.get();
+}
+
+}
+
+NMesh::NMesh(const PropertyList &props) {
+    filesystem::path filename =
+        getFileResolver()->resolve(props.getString("filename"));
+    Transform trafo = props.getTransform("toWorld", Transform());
+    bool verify = props.getBoolean("verify", false);
+
+    Timer timer;
+
+    m_file.reset(new MemoryMappedFile(filename.str()));
+    uint8_t *data = m_file->data();
+    uint64_t size = m_file->size();
+
+    NMeshHeader header;
+    if (size < sizeof(NMeshHeader))
+        throw NoriException("\"%s\" is not a mesh file!", filename);
+    memcpy(&header, data, sizeof(NMeshHeader));
+    if (memcmp(header.magic, NMeshMagic, sizeof(NMeshMagic)) != 0)
+        throw NoriException("\"%s\" is not a mesh file!", filename);
+    if (header.version != NMeshVersion)
+        throw NoriException("\"%s\" has version %i of the mesh format, expected version %i. "
+                            "Please convert the mesh again!", filename, header.version, NMeshVersion);
+
+    /* Reject truncated files, whose blocks would extend past the end */
+    auto checkBlock = [&](uint64_t offset, uint64_t blockSize) {
+        return offset >= sizeof(NMeshHeader) && offset % NMeshAlignment == 0 &&
+               offset <= size && blockSize <= size - offset;
+    };
+    if (header.vertexCount > std::numeric_limits<uint32_t>::max() ||
+        header.triangleCount > std::numeric_limits<uint32_t>::max() ||
+        !checkBlock(header.positionOffset, sizeof(float) * 3 * header.vertexCount) ||
+        (header.normalOffset != 0 && !checkBlock(header.normalOffset, sizeof(float) * 3 * header.vertexCount)) ||
+        (header.texCoordOffset != 0 && !checkBlock(header.texCoordOffset, sizeof(float) * 2 * header.vertexCount)) ||
+        !checkBlock(header.indexOffset, sizeof(uint32_t) * 3 * header.triangleCount))
+        throw NoriException("\"%s\" is truncated or corrupt!", filename);
+
+    Eigen::Index vertexCount = (Eigen::Index) header.vertexCount;
+    Eigen::Index triangleCount = (Eigen::Index) header.triangleCount;
+    m_V.assign((float *) (data + header.positionOffset), 3, vertexCount);
+    if (header.normalOffset != 0)
+        m_N.assign((float *) (data + header.normalOffset), 3, vertexCount);
+    if (header.texCoordOffset != 0)
+        m_UV.assign((float *) (data + header.texCoordOffset), 2, vertexCount);
+    m_F.assign((uint32_t *) (data + header.indexOffset), 3, triangleCount);
+
+    if (verify) {
+        if (checksum(header, m_V.data(), m_N.size() > 0 ? m_N.data() : nullptr,
+                     m_UV.size() > 0 ? m_UV.data() : nullptr, m_F.data()) != header.checksum)
+            throw NoriException("\"%s\" is corrupt (checksum mismatch)!", filename);
+        if (triangleCount > 0 && m_F.maxCoeff() >= header.vertexCount)
+            throw NoriException("\"%s\" is corrupt (vertex index out of range)!", filename);
+    }
+
+    if (trafo.getMatrix().isIdentity()) {
+        if (vertexCount > 0)
+            m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                                   Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+    } else {
+        /* The mapping is private, hence this only modifies copies of the pages */
+        for (Eigen::Index i = 0; i < vertexCount; ++i) {
+            Point3f p = trafo * Point3f(m_V.col(i));
+            m_V.col(i) = p;
+            m_bbox.expandBy(p);
+        }
+        for (Eigen::Index i = 0; i < m_N.cols(); ++i)
+            m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+    }
+
+    m_name = filename.str();
+    cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s and mapped %s)\n",
+                        filename, m_V.cols(), m_F.cols(), timer.elapsedString(), memString(size));
+    cout.flush();
+}
+
+void NMesh::write(const Mesh *mesh, const std::string &filename) {
+    const MeshMatrixXf &V = mesh->getVertexPositions();
+    const MeshMatrixXf &N = mesh->getVertexNormals();
+    const MeshMatrixXf &UV = mesh->getVertexTexCoords();
+    const MeshMatrixXu &F = mesh->getIndices();
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, NMeshMagic, sizeof(NMeshMagic));
+    header.version = NMeshVersion;
+    header.vertexCount = (uint64_t) V.cols();
+    header.triangleCount = (uint64_t) F.cols();
+
+    uint64_t offset = alignOffset(sizeof(NMeshHeader));
+    header.positionOffset = offset;
+    offset = alignOffset(offset + sizeof(float) * V.size());
+    if (N.size() > 0) {
+        header.normalOffset = offset;
+        offset = alignOffset(offset + sizeof(float) * N.size());
+    }
+    if (UV.size() > 0) {
+        header.texCoordOffset = offset;
+        offset = alignOffset(offset + sizeof(float) * UV.size());
+    }
+    header.indexOffset = offset;
+
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = bbox.isValid() ? bbox.min[i] : 0.0f;
+        header.bboxMax[i] = bbox.isValid() ? bbox.max[i] : 0.0f;
+    }
+    header.checksum = checksum(header, V.data(), N.size() > 0 ? N.data() : nullptr,
+                               UV.size() > 0 ? UV.data() : nullptr, F.data());
+
+    std::ofstream os(filename, std::ios::binary);
+    if (!os.is_open())
+        throw NoriException("Unable to create \"%s\"!", filename);
+    writeAligned(os, &header, sizeof(NMeshHeader));
+    writeAligned(os, V.data(), sizeof(float) * V.size());
+    if (N.size() > 0)
+        writeAligned(os, N.data(), sizeof(float) * N.size());
+    if (UV.size() > 0)
+        writeAligned(os, UV.data(), sizeof(float) * UV.size());
+    os.write((const char *) F.data(), sizeof(uint32_t) * F.size());
+    if (!os.good())
+        throw NoriException("Unable to write \"%s\"!", filename);
+}
+
+NORI_REGISTER_CLASS(NMesh, "nmesh");
+NORI_NAMESPACE_END
@@ -8,13 +8,22 @@ public:
     NormalIntegrator(const PropertyList& props) { }
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its)) {
+        bool hit = scene->rayIntersect(ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection* its) const {
+        if (!its) {
             return Color3f(0.0f);
         }
-        Normal3f n = its.shFrame.n.cwiseAbs();
+        Normal3f n = its->shFrame.n.cwiseAbs();
         return  Color3f(n.x(), n.y(), n.z());
     }
 
+    uint32_t getPrimaryHitAttributes() const {
+        return Intersection::EShadingFrame;
+    }
+
     std::string toString() const {
         return "NormalIntegrator[]";
     }
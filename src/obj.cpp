@@ -5,158 +5,418 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <cstring>
 
 NORI_NAMESPACE_BEGIN
 
+namespace {
+
+/// Approximate size of the line-aligned chunks of a file that are parsed in parallel
+constexpr size_t ChunkSize = 1024 * 1024;
+
+/// Vertex indices used by the OBJ format (zero-based, -1 if not specified)
+struct OBJVertex {
+    uint32_t p = (uint32_t) -1;
+    uint32_t n = (uint32_t) -1;
+    uint32_t uv = (uint32_t) -1;
+
+    bool operator==(const OBJVertex &v) const {
+        return v.p == p && v.n == n && v.uv == uv;
+    }
+};
+
 /**
- * \brief Loader for Wavefront OBJ triangle meshes
+ * \brief Hash map from OBJ vertices to their indices in the mesh
+ *
+ * The entries are stored in a single array that is probed linearly,
+ * which avoids the allocation per entry of \c std::unordered_map.
+ * Empty slots have an invalid position index. The capacity is a power
+ * of two and doubles whenever the map becomes half full.
  */
-class WavefrontOBJ : public Mesh {
+class VertexMap {
 public:
-    WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+    /**
+     * \brief Return the index of \c v, inserting it with index \c index
+     * if it is not in the map yet
+     */
+    uint32_t insert(const OBJVertex &v, uint32_t index) {
+        if (2 * (m_size + 1) > m_entries.size())
+            grow();
+        size_t mask = m_entries.size() - 1;
+        for (size_t i = hash(v) & mask; ; i = (i + 1) & mask) {
+            Entry &entry = m_entries[i];
+            if (entry.vertex.p == (uint32_t) -1) {
+                entry.vertex = v;
+                entry.index = index;
+                m_size++;
+                return index;
+            }
+            if (entry.vertex == v)
+                return entry.index;
+        }
+    }
 
-        filesystem::path filename =
-            getFileResolver()->resolve(propList.getString("filename"));
+private:
+    struct Entry {
+        OBJVertex vertex;
+        uint32_t index;
+    };
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
-        Transform trafo = propList.getTransform("toWorld", Transform());
+    static size_t hash(const OBJVertex &v) {
+        uint64_t hash = v.p + 0x9E3779B97F4A7C15ull * v.uv + 0xC2B2AE3D27D4EB4Full * v.n;
+        hash *= 0xFF51AFD7ED558CCDull;
+        return (size_t) (hash ^ (hash >> 32));
+    }
 
-        cout << "Loading \"" << filename << "\" .. ";
-        cout.flush();
-        Timer timer;
+    void grow() {
+        std::vector<Entry> entries(std::max((size_t) 1024, 2 * m_entries.size()));
+        entries.swap(m_entries);
+        m_size = 0;
+        for (const Entry &entry : entries) {
+            if (entry.vertex.p != (uint32_t) -1)
+                insert(entry.vertex, entry.index);
+        }
+    }
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
+    std::vector<Entry> m_entries;
+    size_t m_size = 0;
+};
+
+/// Data of a chunk of an OBJ file, where the faces refer to the chunk's vertices
+struct OBJChunk {
+    std::vector<Vector3f> positions;
+    std::vector<Vector2f> texcoords;
+    std::vector<Vector3f> normals;
+    /// Distinct vertices of the faces, in the order of their first use
+    std::vector<OBJVertex> vertices;
+    /// Three indices into \ref vertices per triangle
+    std::vector<uint32_t> indices;
+    BoundingBox3f bbox;
+};
+
+/**
+ * \brief Parser for the lines of a memory-mapped OBJ file
+ *
+ * Numbers are parsed in place without any temporary strings. Faces with
+ * more than three vertices are split into a fan of triangles. Statements
+ * other than vertices, texture coordinates, normals and faces are ignored.
+ */
+class OBJParser {
+public:
+    OBJParser(const char *data, size_t size, const std::string &filename, const Transform &trafo)
+        : m_data(data), m_end(data + size), m_filename(filename), m_trafo(trafo) { }
 
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+    /// Parse the lines in <tt>[begin, end)</tt>, which must start at the beginning of a line
+    void parse(const char *begin, const char *end, OBJChunk &chunk) const {
+        VertexMap vertexMap;
 
-            std::string prefix;
-            line >> prefix;
+        for (const char *line = begin; line < end; ) {
+            const char *lineEnd = (const char *) memchr(line, '\n', end - line);
+            if (!lineEnd)
+                lineEnd = end;
 
-            if (prefix == "v") {
+            const char *s = line;
+            skipSpace(s, lineEnd);
+            if (lineEnd - s >= 2 && s[0] == 'v' && isSpace(s[1])) {
+                s += 2;
                 Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
+                for (int i = 0; i < 3; ++i)
+                    p[i] = parseFloat(s, lineEnd);
+                p = m_trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (lineEnd - s >= 3 && s[0] == 'v' && s[1] == 't' && isSpace(s[2])) {
+                s += 3;
+                Vector2f tc;
+                tc.x() = parseFloat(s, lineEnd);
+                skipSpace(s, lineEnd);
+                tc.y() = s < lineEnd ? parseFloat(s, lineEnd) : 0.0f;
+                chunk.texcoords.push_back(tc);
+            } else if (lineEnd - s >= 3 && s[0] == 'v' && s[1] == 'n' && isSpace(s[2])) {
+                s += 3;
                 Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
+                for (int i = 0; i < 3; ++i)
+                    n[i] = parseFloat(s, lineEnd);
+                chunk.normals.push_back((m_trafo * n).normalized());
+            } else if (lineEnd - s >= 2 && s[0] == 'f' && isSpace(s[1])) {
+                s += 2;
+                /* Split the face into a fan of triangles around its first vertex
+                   (a quad (0, 1, 2, 3) becomes the triangles (0, 1, 2) and (3, 0, 2)) */
+                uint32_t first = 0, last = 0, count = 0;
+                for (skipSpace(s, lineEnd); s < lineEnd; skipSpace(s, lineEnd), ++count) {
+                    OBJVertex vertex = parseVertex(s, lineEnd);
+                    uint32_t index = vertexMap.insert(vertex, (uint32_t) chunk.vertices.size());
+                    if (index == chunk.vertices.size())
+                        chunk.vertices.push_back(vertex);
+                    if (count == 2) {
+                        chunk.indices.push_back(first);
+                        chunk.indices.push_back(last);
+                        chunk.indices.push_back(index);
+                    } else if (count > 2) {
+                        chunk.indices.push_back(index);
+                        chunk.indices.push_back(first);
+                        chunk.indices.push_back(last);
                     }
+                    if (count == 0)
+                        first = index;
+                    last = index;
                 }
+                if (count < 3)
+                    error(line, "a face needs at least three vertices");
             }
+
+            line = lineEnd + 1;
         }
+    }
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+private:
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+    static void skipSpace(const char *&s, const char *end) {
+        while (s < end && isSpace(*s))
+            ++s;
+    }
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+    /// Parse a decimal number with an optional fraction and exponent
+    float parseFloat(const char *&s, const char *end) const {
+        /* Powers of ten that are exactly representable as doubles */
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        skipSpace(s, end);
+        const char *start = s;
+        bool negative = false;
+        if (s < end && (*s == '-' || *s == '+'))
+            negative = *s++ == '-';
+
+        /* Collect up to 19 significant digits, which fit into 64 bits */
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        bool valid = false;
+        for (; s < end && isDigit(*s); ++s, valid = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*s - '0');
+                digits += mantissa != 0 ? 1 : 0;
+            } else {
+                exponent++;
+            }
+        }
+        if (s < end && *s == '.') {
+            for (++s; s < end && isDigit(*s); ++s, valid = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (uint64_t) (*s - '0');
+                    digits += mantissa != 0 ? 1 : 0;
+                    exponent--;
+                }
+            }
+        }
+        if (valid && s < end && (*s == 'e' || *s == 'E')) {
+            ++s;
+            bool negativeExponent = false;
+            if (s < end && (*s == '-' || *s == '+'))
+                negativeExponent = *s++ == '-';
+            int value = 0;
+            valid = s < end && isDigit(*s);
+            for (; s < end && isDigit(*s); ++s)
+                value = std::min(value * 10 + (*s - '0'), 100000);
+            exponent += negativeExponent ? -value : value;
         }
+        if (!valid || (s < end && !isSpace(*s)))
+            error(start, "expected a number");
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+        /* Exact if the mantissa has at most 53 bits and the power of ten is
+           representable, otherwise accurate enough for single precision */
+        double result = (double) mantissa;
+        if (mantissa != 0 && exponent != 0) {
+            double scale = std::abs(exponent) <= 22 ? powers[std::abs(exponent)] : std::pow(10.0, std::abs(exponent));
+            result = exponent < 0 ? result / scale : result * scale;
         }
+        return (float) (negative ? -result : result);
+    }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+    /// Parse a one-based index and return it zero-based
+    uint32_t parseIndex(const char *&s, const char *end) const {
+        const char *start = s;
+        uint64_t value = 0;
+        for (; s < end && isDigit(*s); ++s)
+            value = std::min(value * 10 + (uint64_t) (*s - '0'), (uint64_t) 0xFFFFFFFFull);
+        if (s < end && *s == '-')
+            error(start, "relative vertex indices are not supported");
+        if (s == start || value == 0 || value == 0xFFFFFFFFull)
+            error(start, "expected a vertex index");
+        return (uint32_t) (value - 1);
     }
 
-protected:
-    /// Vertex indices used by the OBJ format
-    struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+    /// Parse a face vertex of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+    OBJVertex parseVertex(const char *&s, const char *end) const {
+        const char *start = s;
+        OBJVertex vertex;
+        vertex.p = parseIndex(s, end);
+        if (s < end && *s == '/') {
+            ++s;
+            if (s < end && *s != '/')
+                vertex.uv = parseIndex(s, end);
+            if (s < end && *s == '/') {
+                ++s;
+                vertex.n = parseIndex(s, end);
+            }
+        }
+        if (s < end && !isSpace(*s))
+            error(start, "invalid vertex data");
+        return vertex;
+    }
 
-        inline OBJVertex() { }
+    /// Throw an exception that points to the line that contains \c pos
+    [[noreturn]] void error(const char *pos, const char *message) const {
+        size_t line = 1 + std::count(m_data, pos, '\n');
+        const char *lineStart = pos;
+        while (lineStart > m_data && lineStart[-1] != '\n')
+            --lineStart;
+        const char *lineEnd = lineStart;
+        while (lineEnd < m_end && *lineEnd != '\n' && *lineEnd != '\r' && lineEnd - lineStart < 80)
+            ++lineEnd;
+        throw NoriException("Error while parsing \"%s\" (line %i): %s in \"%s\"", m_filename, line, message,
+                            std::string(lineStart, lineEnd));
+    }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+    const char *m_data;
+    const char *m_end;
+    std::string m_filename;
+    Transform m_trafo;
+};
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+}
 
-            p = toUInt(tokens[0]);
+/**
+ * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is mapped into memory and split into line-aligned chunks,
+ * which are parsed in parallel. Each chunk removes duplicate vertices
+ * locally, after which the distinct vertices of all chunks are merged
+ * in file order. Hence, the mesh is the same as if the file had been
+ * parsed sequentially. The optional \c reorder parameter then sorts the
+ * triangles along a space-filling curve (see \ref Mesh::reorder()).
+ */
+class WavefrontOBJ : public Mesh {
+public:
+    WavefrontOBJ(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        MemoryMappedFile file(filename.str());
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        Timer timer;
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        /* Split the file at the line breaks that follow multiples of the chunk size */
+        const char *data = (const char *) file.data(), *end = data + file.size();
+        std::vector<const char *> boundaries { data };
+        for (size_t offset = ChunkSize; offset < file.size(); offset += ChunkSize) {
+            const char *pos = std::max(data + offset, boundaries.back());
+            const char *lineEnd = (const char *) memchr(pos, '\n', end - pos);
+            if (!lineEnd)
+                break;
+            boundaries.push_back(lineEnd + 1);
         }
+        boundaries.push_back(end);
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        OBJParser parser(data, file.size(), filename.str(), trafo);
+        uint32_t chunkCount = (uint32_t) boundaries.size() - 1;
+        std::vector<OBJChunk> chunks(chunkCount);
+        tbb::parallel_for(uint32_t(0), chunkCount, [&](uint32_t i) {
+            parser.parse(boundaries[i], boundaries[i + 1], chunks[i]);
+        });
+
+        /* Concatenate the vertex data of the chunks */
+        std::vector<Vector3f> positions;
+        std::vector<Vector2f> texcoords;
+        std::vector<Vector3f> normals;
+        size_t triangleCount = 0;
+        for (OBJChunk &chunk : chunks) {
+            positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+            texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+            normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+            triangleCount += chunk.indices.size() / 3;
+            m_bbox.expandBy(chunk.bbox);
+            chunk.positions = std::vector<Vector3f>();
+            chunk.texcoords = std::vector<Vector2f>();
+            chunk.normals = std::vector<Vector3f>();
         }
-    };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+        /* Merge the distinct vertices of the chunks in file order, which
+           numbers them in the order of their first use like a sequential parse */
+        std::vector<OBJVertex> vertices;
+        std::vector<std::vector<uint32_t>> remap(chunkCount);
+        VertexMap vertexMap;
+        for (uint32_t i = 0; i < chunkCount; ++i) {
+            remap[i].resize(chunks[i].vertices.size());
+            for (size_t j = 0; j < chunks[i].vertices.size(); ++j) {
+                const OBJVertex &v = chunks[i].vertices[j];
+                remap[i][j] = vertexMap.insert(v, (uint32_t) vertices.size());
+                if (remap[i][j] == vertices.size())
+                    vertices.push_back(v);
+            }
         }
-    };
+
+        std::vector<size_t> triangleOffsets(chunkCount + 1, 0);
+        for (uint32_t i = 0; i < chunkCount; ++i)
+            triangleOffsets[i + 1] = triangleOffsets[i] + chunks[i].indices.size() / 3;
+
+        m_F.resize(3, triangleCount);
+        tbb::parallel_for(uint32_t(0), chunkCount, [&](uint32_t i) {
+            uint32_t *indices = m_F.data() + 3 * triangleOffsets[i];
+            for (size_t j = 0; j < chunks[i].indices.size(); ++j)
+                indices[j] = remap[i][chunks[i].indices[j]];
+        });
+
+        m_V.resize(3, vertices.size());
+        if (!normals.empty())
+            m_N.resize(3, vertices.size());
+        if (!texcoords.empty())
+            m_UV.resize(2, vertices.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = vertices[i];
+                    if (v.p >= positions.size())
+                        throw NoriException("\"%s\": position %i does not exist!", filename, v.p + 1);
+                    m_V.col(i) = positions[v.p];
+                    if (!normals.empty()) {
+                        if (v.n >= normals.size())
+                            throw NoriException("\"%s\": a face vertex has no valid normal index!", filename);
+                        m_N.col(i) = normals[v.n];
+                    }
+                    if (!texcoords.empty()) {
+                        if (v.uv >= texcoords.size())
+                            throw NoriException("\"%s\": a face vertex has no valid texture coordinate index!",
+                                                filename);
+                        m_UV.col(i) = texcoords[v.uv];
+                    }
+                }
+            }
+        );
+
+        reorder(getTriangleOrder(propList));
+
+        m_name = filename.str();
+        double time = timer.elapsed();
+        /* Meshes may be loaded concurrently, hence print the whole line at once */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s at %.1f MiB/s and %s)\n",
+                            filename, m_V.cols(), m_F.cols(), timeString(time),
+                            file.size() / (1024.0 * 1024.0) / std::max(time * 1e-3, 1e-6),
+                            memString(m_F.size() * sizeof(uint32_t) +
+                                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+        cout.flush();
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -1,127 +1,264 @@
-#include<nori/octree.h>
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/octree.h>
+#include <nori/timer.h>
+#include <numeric>
 
 NORI_NAMESPACE_BEGIN
-struct treeNode
-    {
-        void Init(int meshIndex_, int flag_, int nTri_, treeNode* child_){
-            meshIndex = meshIndex_;
-            flag = flag_;
-            nTri = nTri_;
-            child = child_;
-        };
-        int meshIndex;
-        int flag;
-        int nTri;
-        treeNode* child;
-    };
-Octree::Octree(Mesh* mesh){
-    this->mesh = mesh;
-    bounds = mesh->getBoundingBox();
-    int nums = mesh->getTriangleCount();
-    std::vector<int> triNums(nums);
-    for (int i = 0; i < nums; ++i){
-        triNums[i] = i;
-        tribounds.push_back(mesh->getBoundingBox(i));
-    } 
-    root = new treeNode();
-    root->Init(0,0,nums,nullptr);
-    buildTree(triNums, bounds, root, nums);
 
+Octree::Octree(const PropertyList &props) {
+    int maxLeafSize = props.getInteger("maxLeafSize", (int) m_maxLeafSize);
+    int maxDepth = props.getInteger("maxDepth", (int) m_maxDepth);
+    if (maxLeafSize < 1)
+        throw NoriException("Octree: the maximum leaf size must be positive!");
+    if (maxDepth < 1 || maxDepth > (int) MaxDepth)
+        throw NoriException("Octree: the maximum depth must be between 1 and %i!", MaxDepth);
+    m_maxLeafSize = (uint32_t) maxLeafSize;
+    m_maxDepth = (uint32_t) maxDepth;
 }
-void Octree::buildTree(std::vector<int> meshIndex, BoundingBox3f bound, treeNode *cur, int nTri){
-    // leaf condition
-    if(nTri<5 || bound.getVolume()<0.00001f){
-        cur->nTri = nTri;
-        cur->meshIndex = meshIndices.size();
-        for(int i = 0; i < nTri; i++){
-            meshIndices.push_back(meshIndex[i]);
-        }
-        cur->flag = 1;
-    }else{
-        std::vector<BoundingBox3f> subbounds;
-        Point3f halfsize =0.5*(bound.max-bound.min);
-        cur->child = new treeNode[8];
-        std::vector<std::vector<int>> indexArray(8);
-        // get all bounding boxes for all 8 subnodes
-        for (int i = 0; i < 2; i++){
-            for (int j = 0; j < 2; j++){
-                for (int k = 0; k < 2; k++){
-                    Point3f add(i*halfsize.x(),j*halfsize.y(),k*halfsize.z());
-                    subbounds.push_back(BoundingBox3f(bound.min+add,bound.min+add+halfsize));
-                }
+
+void Octree::build(bool verbose) {
+    Timer timer;
+
+    m_nodes.clear();
+    m_indices.clear();
+    m_treeDepth = 0;
+    size_t peakWorkSize = 0;
+    uint32_t primCount = getTotalTriangleCount();
+    if (primCount > 0) {
+        /* The root covers the triangles, while the scene bounds also include instances */
+        m_nodes.emplace_back();
+        for (const Mesh *mesh : m_meshes)
+            m_nodes[0].bbox.expandBy(mesh->getBoundingBox());
+
+        /* Nodes that still have to be processed, with the start of their
+           triangles in the work array. The node on top of the stack always
+           owns the last range of the array, so that splitting it and
+           finishing a leaf only ever touch the end of the array */
+        struct StackEntry {
+            uint32_t node;
+            uint32_t begin;
+            uint32_t depth;
+        };
+        std::vector<StackEntry> stack;
+        std::vector<uint32_t> work(primCount);
+        std::iota(work.begin(), work.end(), 0u);
+        stack.push_back({ 0, 0, 1 });
+
+        while (!stack.empty()) {
+            StackEntry entry = stack.back();
+            stack.pop_back();
+            m_treeDepth = std::max(m_treeDepth, entry.depth);
+
+            if (work.size() - entry.begin > m_maxLeafSize && entry.depth < m_maxDepth &&
+                divide(entry.node, work, entry.begin)) {
+                peakWorkSize = std::max(peakWorkSize, work.capacity());
+                /* Push the last child first, since its triangles are at the end of the array */
+                uint32_t child = m_nodes[entry.node].offset;
+                for (uint32_t i = 0; i < 8; ++i)
+                    stack.push_back({ child + i, m_nodes[child + i].offset, entry.depth + 1 });
+                continue;
             }
+
+            /* Move the triangles of the leaf to the index array */
+            OctreeNode &node = m_nodes[entry.node];
+            node.offset = (uint32_t) m_indices.size();
+            node.count = (uint32_t) (work.size() - entry.begin);
+            m_indices.insert(m_indices.end(), work.begin() + entry.begin, work.end());
+            work.resize(entry.begin);
         }
-        // search through all mesh triangles
-        for(int index = 0; index < nTri; index++){
-            for(int i = 0; i< 8; i++){
-                if(tribounds[meshIndex[index]].overlaps(subbounds[i])){
-                    indexArray[i].push_back(meshIndex[index]);
-                }
-            }
+
+    }
+    buildInstances();
+
+    m_buildTime = timer.elapsed();
+
+    if (verbose && primCount > 0) {
+        size_t leafCount = 0;
+        for (const OctreeNode &node : m_nodes)
+            leafCount += node.isLeaf() ? 1 : 0;
+        std::cout << "[octree build time]: " << timeString(m_buildTime) << std::endl;
+        std::cout << "[octree nodes]: " << m_nodes.size() << " (" << leafCount << " leaves, max depth "
+                  << m_treeDepth << ")" << std::endl;
+        std::cout << "[octree references]: " << m_indices.size() << " ("
+                  << tfm::format("%.1f", (double) m_indices.size() / primCount)
+                  << " per triangle)" << std::endl;
+        std::cout << "[octree memory]: " << memString(getMemoryUsage()) << ", "
+                  << tfm::format("%.1f", (double) getMemoryUsage() / primCount)
+                  << " bytes/triangle (at most " << memString(peakWorkSize * sizeof(uint32_t))
+                  << " of temporary triangle lists during the build)" << std::endl;
+    }
+    if (verbose && !m_instances.empty()) {
+        std::cout << "[instances]: " << m_instances.size() << " ("
+                  << m_instanceNodes.size() << " top-level nodes)" << std::endl;
+    }
+}
+
+bool Octree::divide(uint32_t n, std::vector<uint32_t> &work, uint32_t begin) {
+    BoundingBox3f bbox = m_nodes[n].bbox;
+    Point3f center = bbox.getCenter();
+
+    /* Every triangle overlaps the node, so it overlaps an octant if it reaches
+       the octant's side of the center along all three axes. Bit i of the
+       result is set if it overlaps octant i (see BoundingBox3f::getCorner()) */
+    auto octantMask = [&](uint32_t prim) {
+        uint32_t meshIndex = findMesh(prim);
+        BoundingBox3f primBounds = m_meshes[meshIndex]->getBoundingBox(prim - m_meshOffset[meshIndex]);
+        uint32_t mask = 0xFF;
+        for (int axis = 0; axis < 3; ++axis) {
+            /* Octants on the lower and on the upper side along this axis */
+            uint32_t lower = axis == 0 ? 0x55 : (axis == 1 ? 0x33 : 0x0F);
+            if (primBounds.min[axis] > center[axis])
+                mask &= ~lower;
+            if (primBounds.max[axis] < center[axis])
+                mask &= lower;
         }
-        for(int i = 0; i < 8; i++){
-            (cur->child)[i].Init(0,0,indexArray[i].size(),nullptr);
-            buildTree(indexArray[i],subbounds[i],&(cur->child)[i],indexArray[i].size());
+        return mask;
+    };
+
+    /* Count the triangles of each octant first, so that they can be written
+       to the work array without any temporary lists */
+    uint32_t end = (uint32_t) work.size();
+    uint32_t counts[8] = { 0 };
+    for (uint32_t i = begin; i < end; ++i) {
+        uint32_t mask = octantMask(work[i]);
+        for (int j = 0; j < 8; ++j)
+            counts[j] += (mask >> j) & 1;
+    }
+
+    /* Splitting is pointless if every octant overlaps all triangles */
+    uint32_t primCount = end - begin;
+    if (std::all_of(counts, counts + 8, [&](uint32_t count) { return count == primCount; }))
+        return false;
+
+    /* Append the triangles of the octants behind those of the node, then
+       move them to the front of the node's range */
+    uint32_t offsets[8], childCount = 0;
+    for (int j = 0; j < 8; ++j) {
+        offsets[j] = end + childCount;
+        childCount += counts[j];
+    }
+    work.resize(end + childCount);
+    for (uint32_t i = begin; i < end; ++i) {
+        uint32_t prim = work[i], mask = octantMask(prim);
+        for (int j = 0; j < 8; ++j) {
+            if (mask & (1 << j))
+                work[offsets[j]++] = prim;
         }
     }
+    std::copy(work.begin() + end, work.end(), work.begin() + begin);
+    work.resize(begin + childCount);
+
+    uint32_t child = (uint32_t) m_nodes.size();
+    m_nodes.resize(m_nodes.size() + 8);
+    for (int j = 0; j < 8; ++j) {
+        Point3f corner = bbox.getCorner(j);
+        OctreeNode &node = m_nodes[child + j];
+        node.bbox = BoundingBox3f(center.cwiseMin(corner), center.cwiseMax(corner));
+        node.offset = offsets[j] - counts[j] - end + begin;
+        node.count = counts[j];
+    }
+    m_nodes[n].offset = child;
+    m_nodes[n].count = OctreeNode::Interior;
+    return true;
 }
-bool Octree::IntersectOctree(Ray3f &ray, Intersection &its, bool shadowRay, int &triIndex) const{
-    return Octree::recursive(*root,ray,its,shadowRay,bounds,triIndex);
+
+size_t Octree::getMemoryUsage() const {
+    return m_nodes.size() * sizeof(OctreeNode) + m_indices.size() * sizeof(uint32_t);
 }
 
-bool Octree::recursive(const treeNode &node, Ray3f &ray_, Intersection &its, bool shadowRay, BoundingBox3f bbox, int &triIndex) const{
-    bool foundIntersection = false;
+template <bool ShadowRay> bool Octree::traverseTree(Ray3f &ray, Intersection *its, uint32_t &prim) const {
+    if (m_nodes.empty())
+        return false;
 
-    // only check triangles of node and its children if ray intersects with node bbox
-    if (!bbox.rayIntersect(ray_)) {
+    float nearT, farT;
+    if (!m_nodes[0].bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
         return false;
-    }
-    std::vector<BoundingBox3f> subbounds;
-    Point3f halfsize =0.5*(bbox.max-bbox.min);
-    for (int i = 0; i < 2; i++){
-            for (int j = 0; j < 2; j++){
-                for (int k = 0; k < 2; k++){
-                    Point3f add(i*halfsize.x(),j*halfsize.y(),k*halfsize.z());
-                    subbounds.push_back(BoundingBox3f(bbox.min+add,bbox.min+add+halfsize));
+
+    /* Bit k of a child index selects the upper half of its parent along axis k
+       (see BoundingBox3f::getCorner()). Visiting the children in the order
+       0..7 with the bits of the axes flipped along which the ray travels
+       downwards is therefore front-to-back: no child can occlude one that
+       comes before it. The order is the same for every node of the tree */
+    uint32_t signMask = (ray.d.x() < 0 ? 1u : 0u) | (ray.d.y() < 0 ? 2u : 0u) | (ray.d.z() < 0 ? 4u : 0u);
+    uint8_t order[8];
+    for (uint32_t i = 0; i < 8; ++i)
+        order[i] = (uint8_t) (i ^ signMask);
+
+    /* Nodes to be visited with the distance at which the ray enters them.
+       Each level adds at most seven entries to the stack */
+    struct StackEntry {
+        uint32_t node;
+        float nearT;
+    } stack[7 * MaxDepth + 1];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = { 0, nearT };
+
+    bool foundIntersection = false;
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+
+        /* Skip nodes behind an intersection that was found after they were pushed */
+        if (entry.nearT > ray.maxt)
+            continue;
+
+        const OctreeNode &node = m_nodes[entry.node];
+        if (node.isLeaf()) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                uint32_t candidate = m_indices[i];
+                uint32_t meshIndex = findMesh(candidate);
+                float u, v, t;
+                if (m_meshes[meshIndex]->rayIntersect(candidate - m_meshOffset[meshIndex], ray, u, v, t)) {
+                    /* An intersection was found! Can terminate
+                       immediately if this is a shadow ray query */
+                    if (ShadowRay) {
+                        prim = candidate;
+                        return true;
+                    }
+                    ray.maxt = its->t = t;
+                    its->bary = Point2f(u, v);
+                    prim = candidate;
+                    foundIntersection = true;
                 }
             }
+            continue;
         }
-    // search through all triangles in node
-    if (node.flag==1)
-    for (uint32_t i = 0; i < node.nTri; ++i) {
-        float u, v, t;
-        uint32_t triangle_idx = meshIndices[node.meshIndex+i];
-        if (mesh->rayIntersect(triangle_idx, ray_, u, v, t) && t < ray_.maxt) {
-            /* An intersection was found! Can terminate
-               immediately if this is a shadow ray query */
-            if (shadowRay)
-                return true;
-            ray_.maxt = its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = mesh;
-            triIndex = triangle_idx;
-            foundIntersection = true;
-        }
-    }
-    else {
-        std::vector<std::pair<int, float>> children(8);
-        for (int i = 0; i < 8; i++){
-            children[i].first = i;
-            children[i].second = subbounds[i].distanceTo(ray_.o);
-        }
-
-        std::sort(children.begin(), children.end(), [](const std::pair<int, float>& l, const std::pair<int, float>& r) {
-            return l.second < r.second;
-        });
 
-        for (int i = 0; i<8; i++) {
-            int index = children[i].first;
-            foundIntersection = Octree::recursive(node.child[index], ray_, its, shadowRay, subbounds[index], triIndex) || foundIntersection;
-            if (shadowRay && foundIntersection)
-                return true;
+        /* Push the children that the ray hits back to front, so that the nearest one is popped first */
+        for (int i = 7; i >= 0; --i) {
+            uint32_t child = node.offset + order[i];
+            if (m_nodes[child].bbox.rayIntersect(ray, nearT, farT) && nearT <= ray.maxt && farT >= ray.mint)
+                stack[stackSize++] = { child, nearT };
         }
     }
+
     return foundIntersection;
 }
 
-NORI_NAMESPACE_END
\ No newline at end of file
+bool Octree::traverse(Ray3f &ray, Intersection &its, uint32_t &prim) const {
+    return traverseTree<false>(ray, &its, prim);
+}
+
+bool Octree::occluded(const Ray3f &ray_, uint32_t &prim) const {
+    Ray3f ray(ray_);
+    return traverseTree<true>(ray, nullptr, prim);
+}
+
+std::string Octree::toString() const {
+    return tfm::format(
+        "Octree[\n"
+        "  maxLeafSize = %i,\n"
+        "  maxDepth = %i\n"
+        "]",
+        m_maxLeafSize,
+        m_maxDepth
+    );
+}
+
+NORI_REGISTER_CLASS(Octree, "octree");
+NORI_NAMESPACE_END
@@ -8,6 +8,8 @@
 #include <nori/proplist.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
+#include <deque>
 #include <fstream>
 #include <set>
 
@@ -55,6 +57,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EShapeGroup           = NoriObject::EShapeGroup,
+        EInstance             = NoriObject::EInstance,
+        EAccel                = NoriObject::EAccel,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -71,6 +76,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* Reference to an object declared with an 'id' attribute */
+        ERef,
+
         EInvalid
     };
 
@@ -87,6 +95,10 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["shapegroup"] = EShapeGroup;
+    tags["instance"]   = EInstance;
+    tags["accel"]      = EAccel;
+    tags["ref"]        = ERef;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -117,12 +129,24 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
-    /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    /* Objects that can be referenced using <ref id=".."/> */
+    std::map<std::string, NoriObject *> ids;
+
+    /* Meshes are loaded and activated by background tasks while the rest of
+       the document is parsed, and shape groups build their acceleration data
+       structures in the background. The results are written to 'slots',
+       whose elements keep their addresses while new ones are appended */
+    tbb::task_group tasks;
+    std::deque<NoriObject *> slots;
+
+    /* Helper function to parse a Nori XML node (recursive). Stores the
+       resulting object (if any) in 'result' and returns 'true' if it is
+       still being constructed or activated by a background task */
+    std::function<bool(pugi::xml_node &, PropertyList &, int, NoriObject *&)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag, NoriObject *&result) -> bool {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
-            return nullptr;
+            return false;
 
         if (node.type() != pugi::node_element)
             throw NoriException(
@@ -158,45 +182,100 @@ NoriObject *loadFromXML(const std::string &filename) {
 
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EShapeGroup)
+            node.append_attribute("type") = "shapegroup";
+        else if (tag == EInstance)
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
         PropertyList propList;
-        std::vector<NoriObject *> children;
+        std::vector<NoriObject **> childSlots;
+        bool pending = false;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
-            if (child)
-                children.push_back(child);
+            slots.push_back(nullptr);
+            childSlots.push_back(&slots.back());
+            pending |= parseTag(ch, propList, tag, slots.back());
+        }
+
+        /* The children must be complete before they are added to this object */
+        if (pending)
+            tasks.wait();
+        std::vector<NoriObject *> children;
+        for (NoriObject **child : childSlots) {
+            if (*child)
+                children.push_back(*child);
         }
 
-        NoriObject *result = nullptr;
+        bool background = false;
         try {
             if (currentIsObject) {
-                check_attributes(node, { "type" });
+                /* Shape groups must be named, since they are only used through references */
+                std::string id = node.attribute("id").value();
+                if (tag == EShapeGroup) {
+                    check_attributes(node, { "type", "id" });
+                    if (ids.find(id) != ids.end())
+                        throw NoriException("Duplicate id \"%s\"", id);
+                    propList.setString("id", id);
+                } else {
+                    check_attributes(node, { "type" });
+                }
 
                 /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
-                }
+                std::string type = node.attribute("type").value();
+                auto create = [tag, type, propList, children]() {
+                    NoriObject *object = NoriObjectFactory::createInstance(type, propList);
+
+                    if (object->getClassType() != (int) tag) {
+                        throw NoriException(
+                            "Unexpectedly constructed an object "
+                            "of type <%s> (expected type <%s>): %s",
+                            NoriObject::classTypeName(object->getClassType()),
+                            NoriObject::classTypeName((NoriObject::EClassType) tag),
+                            object->toString());
+                    }
+
+                    /* Add all children */
+                    for (auto ch: children) {
+                        object->addChild(ch);
+                        ch->setParent(object);
+                    }
+                    return object;
+                };
 
-                /* Add all children */
-                for (auto ch: children) {
-                    result->addChild(ch);
-                    ch->setParent(result);
-                }
+                /* Report errors of background tasks like those of the parser */
+                ptrdiff_t pos = node.offset_debug();
+                auto inBackground = [&, pos](const std::function<void()> &task) {
+                    tasks.run([&, pos, task]() {
+                        try {
+                            task();
+                        } catch (const NoriException &e) {
+                            throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                                                e.what(), offset(pos));
+                        }
+                    });
+                    background = true;
+                };
 
-                /* Activate / configure the object */
-                result->activate();
+                if (tag == EMesh) {
+                    /* Load the mesh and build its sampling distribution */
+                    inBackground([create, &result]() {
+                        NoriObject *mesh = create();
+                        mesh->activate();
+                        result = mesh;
+                    });
+                } else if (tag == EShapeGroup) {
+                    /* Instances only need the object for now, and wait
+                       for the acceleration data structure when activated */
+                    result = create();
+                    ids[id] = result;
+                    NoriObject *group = result;
+                    inBackground([group]() { group->activate(); });
+                } else {
+                    /* Activate / configure the object */
+                    result = create();
+                    result->activate();
+                }
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -289,6 +368,19 @@ NoriObject *loadFromXML(const std::string &filename) {
                         }
                         break;
 
+                    case ERef: {
+                            check_attributes(node, { "id" });
+                            auto it = ids.find(node.attribute("id").value());
+                            if (it == ids.end())
+                                throw NoriException("Reference to unknown id \"%s\"", node.attribute("id").value());
+                            if (parentTag != EInstance)
+                                throw NoriException("Shape groups can only be referenced by instances");
+                            result = it->second;
+                            /* The instance needs the group's acceleration data structure */
+                            background = true;
+                        }
+                        break;
+
                     default: throw NoriException("Unhandled element \"%s\"", node.name());
                 };
             }
@@ -297,11 +389,23 @@ NoriObject *loadFromXML(const std::string &filename) {
                                 e.what(), offset(node.offset_debug()));
         }
 
-        return result;
+        return background;
     };
 
     PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    NoriObject *root = nullptr;
+    try {
+        if (parseTag(*doc.begin(), list, EInvalid, root))
+            tasks.wait();
+    } catch (...) {
+        /* Background tasks still refer to the state of the parser */
+        tasks.cancel();
+        try {
+            tasks.wait();
+        } catch (...) { }
+        throw;
+    }
+    return root;
 }
 
 NORI_NAMESPACE_END
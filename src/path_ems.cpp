@@ -11,6 +11,12 @@ public:
     PathMats(const PropertyList& props) {}
 
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(_ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, _ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray, const Intersection* primary) const override {
         Color3f color = 0;// final color
         Color3f t = 1;// contribution of this interaction
         Ray3f rayRecursive = _ray;
@@ -18,7 +24,11 @@ public:
         int depth = 1;// depth to bounce light
         while (true) {
             Intersection its;
-            if (!scene->rayIntersect(rayRecursive, its))
+            if (depth == 1) { // the first intersection was found by the caller
+                if (!primary)
+                    break;
+                its = *primary;
+            } else if (!scene->rayIntersect(rayRecursive, its, Intersection::EPosition | Intersection::EShadingFrame))
                 break;
             // it is a light source
             if (its.mesh->isEmitter()) {
@@ -42,6 +52,10 @@ public:
         return color;
     }
 
+    uint32_t getPrimaryHitAttributes() const override {
+        return Intersection::EPosition | Intersection::EShadingFrame;
+    }
+
     std::string toString() const {
         return "PathMats[]";
     }
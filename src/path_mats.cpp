@@ -11,6 +11,12 @@ public:
     PathEms(const PropertyList& props) {}
 
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(_ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, _ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& _ray, const Intersection* primary) const override {
         Color3f color = 0;
         Color3f t = 1;// final contribution of this interaction
         Ray3f rayRecursive = _ray;
@@ -19,7 +25,11 @@ public:
         int isDelta = 1;// is diffuse
         while (true) {
             Intersection its;
-            if (!scene->rayIntersect(rayRecursive, its))
+            if (depth == 1) { // the first intersection was found by the caller
+                if (!primary)
+                    break;
+                its = *primary;
+            } else if (!scene->rayIntersect(rayRecursive, its, Intersection::EPosition | Intersection::EShadingFrame))
                 break;
             if (its.mesh->isEmitter()) {// light source
                 EmitterQueryRecord lRecE(rayRecursive.o, its.p, its.shFrame.n);
@@ -59,6 +69,10 @@ public:
         return color;
     }
 
+    uint32_t getPrimaryHitAttributes() const override {
+        return Intersection::EPosition | Intersection::EShadingFrame;
+    }
+
     std::string toString() const {
         return "PathEms[]";
     }
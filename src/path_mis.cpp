@@ -11,16 +11,22 @@ public:
     PathMisIntegrator(const PropertyList& props) {}
 
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection* primary) const override {
         Color3f color = 0;
         Color3f t = 1;
         Ray3f rayRecursive = ray;
         float probability;
         float w_mats = 1.0f;//BRDF weights for next iter
         int depth = 1;
-        Intersection its;
-        if (!scene->rayIntersect(rayRecursive, its)) {
+        if (!primary) {
             return color;
         }
+        Intersection its = *primary;
         while (true) {
             if (its.mesh->isEmitter()) {
                 EmitterQueryRecord lRec(rayRecursive.o, its.p, its.shFrame.n);
@@ -58,7 +64,7 @@ public:
             rayRecursive = Ray3f(its.p, its.toWorld(bRec.wo));
             float pdf_mat = its.mesh->getBSDF()->pdf(bRec);//BRDF pdf
             Point3f origin = its.p;
-            if (!scene->rayIntersect(rayRecursive, its)) {
+            if (!scene->rayIntersect(rayRecursive, its, Intersection::EPosition | Intersection::EShadingFrame)) {
                 return color;
             }
             if (its.mesh->isEmitter()) {// if emitter update brdf weight
@@ -75,6 +81,10 @@ public:
         return color;
     }
 
+    uint32_t getPrimaryHitAttributes() const override {
+        return Intersection::EPosition | Intersection::EShadingFrame;
+    }
+
     std::string toString() const {
         return "PathMisIntegrator[]";
     }
@@ -0,0 +1,407 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+
+/// Number of vertices or faces that are decoded by one task
+constexpr uint32_t BlockSize = 64 * 1024;
+
+/// Scalar types of PLY properties
+enum class PLYType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+size_t typeSize(PLYType type) {
+    switch (type) {
+        case PLYType::Int8: case PLYType::UInt8: return 1;
+        case PLYType::Int16: case PLYType::UInt16: return 2;
+        case PLYType::Int32: case PLYType::UInt32: case PLYType::Float32: return 4;
+        default: return 8;
+    }
+}
+
+/// Read a value of the given type, swapping the bytes of big-endian files
+template <typename T> T readValue(const uint8_t *ptr, PLYType type, bool swap) {
+    uint8_t bytes[8];
+    size_t size = typeSize(type);
+    memcpy(bytes, ptr, size);
+    if (swap)
+        std::reverse(bytes, bytes + size);
+
+    switch (type) {
+        case PLYType::Int8: { int8_t v; memcpy(&v, bytes, 1); return (T) v; }
+        case PLYType::UInt8: return (T) bytes[0];
+        case PLYType::Int16: { int16_t v; memcpy(&v, bytes, 2); return (T) v; }
+        case PLYType::UInt16: { uint16_t v; memcpy(&v, bytes, 2); return (T) v; }
+        case PLYType::Int32: { int32_t v; memcpy(&v, bytes, 4); return (T) v; }
+        case PLYType::UInt32: { uint32_t v; memcpy(&v, bytes, 4); return (T) v; }
+        case PLYType::Float32: { float v; memcpy(&v, bytes, 4); return (T) v; }
+        default: { double v; memcpy(&v, bytes, 8); return (T) v; }
+    }
+}
+
+struct PLYProperty {
+    std::string name;
+    PLYType type;
+    /// List properties store a count of type \ref countType followed by the values
+    bool isList = false;
+    PLYType countType;
+};
+
+struct PLYElement {
+    std::string name;
+    uint64_t count;
+    std::vector<PLYProperty> properties;
+
+    /// Return the size of each instance, or 0 if it contains lists
+    size_t stride() const {
+        size_t result = 0;
+        for (const PLYProperty &prop : properties) {
+            if (prop.isList)
+                return 0;
+            result += typeSize(prop.type);
+        }
+        return result;
+    }
+};
+
+}
+
+/**
+ * \brief Loader for binary PLY triangle meshes
+ *
+ * Reads the positions, normals and texture coordinates of the \c vertex
+ * element and the \c vertex_indices lists of the \c face element of
+ * little- or big-endian files; other elements and properties are skipped.
+ * The file is mapped into memory and decoded in parallel blocks, each of
+ * which also applies \c toWorld to its vertices with a single matrix
+ * product. Faces with more than three vertices are split into a fan of
+ * triangles like in \ref WavefrontOBJ, and the optional \c reorder
+ * parameter sorts the triangles along a space-filling curve (see
+ * \ref Mesh::reorder()).
+ */
+class StanfordPLY : public Mesh {
+public:
+    StanfordPLY(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+
+        MemoryMappedFile file(filename.str());
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        Timer timer;
+
+        m_name = filename.str();
+        const uint8_t *data = file.data(), *end = data + file.size();
+        bool swap = false;
+        std::vector<PLYElement> elements = parseHeader(data, end, swap);
+
+        for (const PLYElement &element : elements) {
+            if (element.name == "vertex")
+                data = readVertices(element, data, end, swap, trafo);
+            else if (element.name == "face")
+                data = readFaces(element, data, end, swap);
+            else
+                data = skipElement(element, data, end, swap);
+        }
+        reorder(getTriangleOrder(propList));
+
+        double time = timer.elapsed();
+        /* Meshes may be loaded concurrently, hence print the whole line at once */
+        cout << tfm::format("Loading \"%s\" .. done. (V=%i, F=%i, took %s at %.1f MiB/s and %s)\n",
+                            filename, m_V.cols(), m_F.cols(), timeString(time),
+                            file.size() / (1024.0 * 1024.0) / std::max(time * 1e-3, 1e-6),
+                            memString(m_F.size() * sizeof(uint32_t) +
+                                      sizeof(float) * (m_V.size() + m_N.size() + m_UV.size())));
+        cout.flush();
+    }
+
+private:
+    /// Parse the header and advance \c data to the first element
+    std::vector<PLYElement> parseHeader(const uint8_t *&data, const uint8_t *end, bool &swap) const {
+        const char HeaderEnd[] = "end_header";
+        const uint8_t *headerEnd = std::search(data, end, HeaderEnd, HeaderEnd + sizeof(HeaderEnd) - 1);
+        const uint8_t *body = headerEnd < end ? (const uint8_t *) memchr(headerEnd, '\n', end - headerEnd) : nullptr;
+        if (end - data < 4 || memcmp(data, "ply", 3) != 0 || !body)
+            throw NoriException("\"%s\" is not a PLY file!", m_name);
+
+        std::istringstream is(std::string((const char *) data, (const char *) headerEnd));
+        std::vector<PLYElement> elements;
+        std::string line;
+        while (std::getline(is, line)) {
+            std::vector<std::string> tokens = tokenize(line, " \t\r");
+            if (tokens.empty() || tokens[0] == "ply" || tokens[0] == "comment" || tokens[0] == "obj_info")
+                continue;
+
+            if (tokens[0] == "format" && tokens.size() >= 2) {
+                if (tokens[1] == "binary_big_endian")
+                    swap = true;
+                else if (tokens[1] != "binary_little_endian")
+                    throw NoriException("\"%s\": only binary PLY files are supported (found \"%s\")!",
+                                        m_name, tokens[1]);
+            } else if (tokens[0] == "element" && tokens.size() == 3) {
+                PLYElement element;
+                element.name = tokens[1];
+                element.count = std::stoull(tokens[2]);
+                elements.push_back(element);
+            } else if (tokens[0] == "property" && !elements.empty() && tokens.size() >= 3) {
+                PLYProperty prop;
+                if (tokens[1] == "list" && tokens.size() == 5) {
+                    prop.isList = true;
+                    prop.countType = parseType(tokens[2]);
+                    prop.type = parseType(tokens[3]);
+                    prop.name = tokens[4];
+                } else {
+                    prop.type = parseType(tokens[1]);
+                    prop.name = tokens[2];
+                }
+                elements.back().properties.push_back(prop);
+            } else {
+                throw NoriException("\"%s\": invalid header line \"%s\"!", m_name, line);
+            }
+        }
+
+        data = body + 1;
+        return elements;
+    }
+
+    PLYType parseType(const std::string &name) const {
+        if (name == "char" || name == "int8") return PLYType::Int8;
+        if (name == "uchar" || name == "uint8") return PLYType::UInt8;
+        if (name == "short" || name == "int16") return PLYType::Int16;
+        if (name == "ushort" || name == "uint16") return PLYType::UInt16;
+        if (name == "int" || name == "int32") return PLYType::Int32;
+        if (name == "uint" || name == "uint32") return PLYType::UInt32;
+        if (name == "float" || name == "float32") return PLYType::Float32;
+        if (name == "double" || name == "float64") return PLYType::Float64;
+        throw NoriException("\"%s\": unknown property type \"%s\"!", m_name, name);
+    }
+
+    /// Return the end of an element instance that starts at \c ptr
+    const uint8_t *skipInstance(const PLYElement &element, const uint8_t *ptr, const uint8_t *end, bool swap) const {
+        for (const PLYProperty &prop : element.properties) {
+            if (prop.isList) {
+                if (end - ptr < (ptrdiff_t) typeSize(prop.countType))
+                    throw NoriException("\"%s\" is truncated!", m_name);
+                uint64_t count = readValue<uint64_t>(ptr, prop.countType, swap);
+                ptr += typeSize(prop.countType) + count * typeSize(prop.type);
+            } else {
+                ptr += typeSize(prop.type);
+            }
+            if (ptr > end)
+                throw NoriException("\"%s\" is truncated!", m_name);
+        }
+        return ptr;
+    }
+
+    const uint8_t *skipElement(const PLYElement &element, const uint8_t *data, const uint8_t *end, bool swap) const {
+        size_t stride = element.stride();
+        if (stride > 0) {
+            if ((uint64_t) (end - data) / stride < element.count)
+                throw NoriException("\"%s\" is truncated!", m_name);
+            return data + stride * element.count;
+        }
+        for (uint64_t i = 0; i < element.count; ++i)
+            data = skipInstance(element, data, end, swap);
+        return data;
+    }
+
+    const uint8_t *readVertices(const PLYElement &element, const uint8_t *data, const uint8_t *end,
+                                bool swap, const Transform &trafo) {
+        size_t stride = element.stride();
+        if (stride == 0)
+            throw NoriException("\"%s\": list properties of vertices are not supported!", m_name);
+        if (element.count > std::numeric_limits<uint32_t>::max() || (uint64_t) (end - data) / stride < element.count)
+            throw NoriException("\"%s\" is truncated!", m_name);
+
+        /* Offsets and types of the properties within a vertex (-1 if absent) */
+        struct Attribute {
+            int offset = -1;
+            PLYType type;
+        } position[3], normal[3], texcoord[2];
+        const char *texcoordNames[][2] = { { "u", "v" }, { "s", "t" }, { "texture_u", "texture_v" },
+                                           { "texture_s", "texture_t" } };
+        size_t offset = 0;
+        for (const PLYProperty &prop : element.properties) {
+            for (int i = 0; i < 3; ++i) {
+                if (prop.name == std::string(1, (char) ('x' + i)))
+                    position[i] = { (int) offset, prop.type };
+                else if (prop.name == "n" + std::string(1, (char) ('x' + i)))
+                    normal[i] = { (int) offset, prop.type };
+            }
+            for (auto &names : texcoordNames) {
+                for (int i = 0; i < 2; ++i) {
+                    if (prop.name == names[i])
+                        texcoord[i] = { (int) offset, prop.type };
+                }
+            }
+            offset += typeSize(prop.type);
+        }
+        if (position[0].offset < 0 || position[1].offset < 0 || position[2].offset < 0)
+            throw NoriException("\"%s\": the vertices have no positions!", m_name);
+        bool hasNormals = normal[0].offset >= 0 && normal[1].offset >= 0 && normal[2].offset >= 0;
+        bool hasTexCoords = texcoord[0].offset >= 0 && texcoord[1].offset >= 0;
+
+        uint32_t vertexCount = (uint32_t) element.count;
+        m_V.resize(3, vertexCount);
+        if (hasNormals)
+            m_N.resize(3, vertexCount);
+        if (hasTexCoords)
+            m_UV.resize(2, vertexCount);
+
+        bool identity = trafo.getMatrix().isIdentity();
+        Eigen::Matrix4f M = trafo.getMatrix();
+        Eigen::Matrix3f normalMatrix = trafo.getInverseMatrix().topLeftCorner<3, 3>().transpose();
+
+        uint32_t blockCount = (vertexCount + BlockSize - 1) / BlockSize;
+        std::vector<BoundingBox3f> bounds(blockCount);
+        tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+            uint32_t begin = block * BlockSize, count = std::min(BlockSize, vertexCount - begin);
+            for (uint32_t i = begin; i < begin + count; ++i) {
+                const uint8_t *vertex = data + (size_t) i * stride;
+                for (int j = 0; j < 3; ++j)
+                    m_V(j, i) = readValue<float>(vertex + position[j].offset, position[j].type, swap);
+                if (hasNormals) {
+                    for (int j = 0; j < 3; ++j)
+                        m_N(j, i) = readValue<float>(vertex + normal[j].offset, normal[j].type, swap);
+                }
+                if (hasTexCoords) {
+                    for (int j = 0; j < 2; ++j)
+                        m_UV(j, i) = readValue<float>(vertex + texcoord[j].offset, texcoord[j].type, swap);
+                }
+            }
+
+            /* Transform the whole block at once */
+            auto V = m_V.middleCols(begin, count);
+            if (!identity) {
+                Eigen::Matrix<float, 4, Eigen::Dynamic> p = M.leftCols<3>() * V;
+                p.colwise() += M.col(3);
+                V = p.topRows<3>().array().rowwise() / p.row(3).array();
+            }
+            if (hasNormals) {
+                auto N = m_N.middleCols(begin, count);
+                if (!identity)
+                    N = normalMatrix * N;
+                N.colwise().normalize();
+            }
+
+            for (uint32_t i = 0; i < count; ++i)
+                bounds[block].expandBy(Point3f(V.col(i)));
+        });
+
+        for (const BoundingBox3f &bbox : bounds)
+            m_bbox.expandBy(bbox);
+
+        return data + stride * element.count;
+    }
+
+    const uint8_t *readFaces(const PLYElement &element, const uint8_t *data, const uint8_t *end, bool swap) {
+        int indexProperty = -1;
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const PLYProperty &prop = element.properties[i];
+            if (prop.isList && (prop.name == "vertex_indices" || prop.name == "vertex_index"))
+                indexProperty = (int) i;
+        }
+        if (indexProperty < 0)
+            throw NoriException("\"%s\": the faces have no vertex indices!", m_name);
+        const PLYProperty &indices = element.properties[indexProperty];
+
+        /* Faces have different sizes, hence the start of each block and
+           the number of triangles before it are found sequentially */
+        uint64_t blockCount = (element.count + BlockSize - 1) / BlockSize;
+        std::vector<const uint8_t *> blockStart(blockCount + 1);
+        std::vector<uint64_t> triangleOffset(blockCount + 1, 0);
+        const uint8_t *ptr = data;
+        for (uint64_t i = 0; i < element.count; ++i) {
+            if (i % BlockSize == 0) {
+                blockStart[i / BlockSize] = ptr;
+                triangleOffset[i / BlockSize + 1] = triangleOffset[i / BlockSize];
+            }
+            const uint8_t *next = ptr;
+            for (int j = 0; j < (int) element.properties.size(); ++j) {
+                const PLYProperty &prop = element.properties[j];
+                if (end - next < (ptrdiff_t) typeSize(prop.isList ? prop.countType : prop.type))
+                    throw NoriException("\"%s\" is truncated!", m_name);
+                if (prop.isList) {
+                    uint64_t count = readValue<uint64_t>(next, prop.countType, swap);
+                    if (j == indexProperty) {
+                        if (count < 3)
+                            throw NoriException("\"%s\": face %i has fewer than three vertices!", m_name, i);
+                        triangleOffset[i / BlockSize + 1] += count - 2;
+                    }
+                    next += typeSize(prop.countType) + count * typeSize(prop.type);
+                } else {
+                    next += typeSize(prop.type);
+                }
+            }
+            if (next > end)
+                throw NoriException("\"%s\" is truncated!", m_name);
+            ptr = next;
+        }
+        blockStart[blockCount] = ptr;
+        if (triangleOffset[blockCount] > std::numeric_limits<uint32_t>::max())
+            throw NoriException("\"%s\" has too many triangles!", m_name);
+
+        /* Decode the blocks in parallel, with the same fan as WavefrontOBJ:
+           (0, 1, 2), (3, 0, 2), (4, 0, 3), ... */
+        m_F.resize(3, (Eigen::Index) triangleOffset[blockCount]);
+        uint64_t vertexCount = (uint64_t) m_V.cols();
+        size_t countSize = typeSize(indices.countType), indexSize = typeSize(indices.type);
+        tbb::parallel_for(uint64_t(0), blockCount, [&](uint64_t block) {
+            const uint8_t *ptr = blockStart[block];
+            uint32_t *triangle = m_F.data() + 3 * triangleOffset[block];
+            uint64_t faceCount = std::min((uint64_t) BlockSize, element.count - block * BlockSize);
+            for (uint64_t i = 0; i < faceCount; ++i) {
+                for (int j = 0; j < (int) element.properties.size(); ++j) {
+                    const PLYProperty &prop = element.properties[j];
+                    if (!prop.isList) {
+                        ptr += typeSize(prop.type);
+                        continue;
+                    }
+                    uint64_t count = readValue<uint64_t>(ptr, prop.countType, swap);
+                    ptr += countSize;
+                    if (j != indexProperty) {
+                        ptr += count * typeSize(prop.type);
+                        continue;
+                    }
+                    uint32_t first = 0, last = 0;
+                    for (uint64_t k = 0; k < count; ++k, ptr += indexSize) {
+                        uint64_t index = readValue<uint64_t>(ptr, indices.type, swap);
+                        if (index >= vertexCount)
+                            throw NoriException("\"%s\": vertex index %i is out of range!", m_name, index);
+                        if (k == 2) {
+                            *triangle++ = first;
+                            *triangle++ = last;
+                            *triangle++ = (uint32_t) index;
+                        } else if (k > 2) {
+                            *triangle++ = (uint32_t) index;
+                            *triangle++ = first;
+                            *triangle++ = last;
+                        }
+                        if (k == 0)
+                            first = (uint32_t) index;
+                        last = (uint32_t) index;
+                    }
+                }
+            }
+        });
+
+        return blockStart[blockCount];
+    }
+};
+
+NORI_REGISTER_CLASS(StanfordPLY, "ply");
+NORI_NAMESPACE_END
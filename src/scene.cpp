@@ -10,11 +10,14 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
+#include <nori/acceltuner.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &props) {
+    /* Time in seconds for choosing the fastest acceleration data structure (disabled if zero) */
+    m_accelTuningBudget = props.getFloat("accelTuningBudget", 0.0f);
 }
 
 Scene::~Scene() {
@@ -22,16 +25,37 @@ Scene::~Scene() {
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (Instance *instance : m_instances)
+        delete instance;
+    for (ShapeGroup *group : m_shapeGroups)
+        delete group;
 }
 
 void Scene::activate() {
-    m_accel->build();
-
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
         throw NoriException("No camera was specified!");
-    
+
+    if (!m_accel) {
+        /* Create a default acceleration data structure (BVH) */
+        m_accel = static_cast<Accel*>(
+            NoriObjectFactory::createInstance("bvh", PropertyList()));
+    }
+    for (Mesh *mesh : m_meshes)
+        m_accel->addMesh(mesh);
+    for (Instance *instance : m_instances)
+        m_accel->addInstance(instance);
+    m_accel->build();
+
+    if (m_accelTuningBudget > 0) {
+        Accel *accel = AccelTuner(this, m_accelTuningBudget).tune(m_accel);
+        if (accel != m_accel) {
+            delete m_accel;
+            m_accel = accel;
+        }
+    }
+
     if (!m_sampler) {
         /* Create a default (independent) sampler */
         m_sampler = static_cast<Sampler*>(
@@ -47,7 +71,6 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
             Mesh* mesh = static_cast<Mesh*>(obj);
-            m_accel->addMesh(mesh);
             m_meshes.push_back(mesh);
             if (mesh->isEmitter()) {
                 m_meshes_emitter.push_back(mesh);
@@ -64,6 +87,23 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
 
+        case EShapeGroup:
+            /* Only rendered through instances */
+            m_shapeGroups.push_back(static_cast<ShapeGroup *>(obj));
+            break;
+
+        case EInstance: {
+                Instance *instance = static_cast<Instance *>(obj);
+                m_instances.push_back(instance);
+            }
+            break;
+
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration data structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -102,13 +142,19 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
-        "  %s  }\n"
+        "  %s  },\n"
+        "  shapeGroups = %i,\n"
+        "  instances = %i\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
-        indent(meshes, 2)
+        indent(m_accel->toString()),
+        indent(meshes, 2),
+        m_shapeGroups.size(),
+        m_instances.size()
     );
 }
 
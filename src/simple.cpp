@@ -16,16 +16,25 @@ public:
 
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection* its) const {
+        if (!its)
             return { 0.0f };
 
-        Vector3f L = m_position - its.p; // light dirention
+        Vector3f L = m_position - its->p; // light dirention
 
-        if (scene->rayIntersect(Ray3f(its.p + L * Epsilon, L))) //visibility
+        if (scene->rayIntersect(Ray3f(its->p + L * Epsilon, L))) //visibility
             return { 0.0f };
 
         // Phi/4pi*pi * cos_theta/||x-p||^2 * V(x<->p)
-        return 0.25f * INV_PI * INV_PI * m_energy * std::max(0.0f, its.shFrame.n.dot(L.normalized())) / L.dot(L);
+        return 0.25f * INV_PI * INV_PI * m_energy * std::max(0.0f, its->shFrame.n.dot(L.normalized())) / L.dot(L);
+    }
+
+    uint32_t getPrimaryHitAttributes() const {
+        return Intersection::EPosition | Intersection::EShadingFrame;
     }
 
     std::string toString() const {
@@ -9,7 +9,7 @@ public:
     AOIntegrator(const PropertyList& propList) {}
     Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        if (!scene->rayIntersect(ray, its, Intersection::EPosition | Intersection::EShadingFrame))
             return { 0.0f };
 
         auto dir = Warp::squareToCosineHemisphere(sampler->next2D());
@@ -12,7 +12,14 @@ private:
 public:
     WhittedIntegrator(const PropertyList& props) {}
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray_) const
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const
+    {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its, getPrimaryHitAttributes());
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray_, const Intersection* primary) const
     {
         int depth = 0;
         Color3f radiance(0.0f);
@@ -22,11 +29,13 @@ public:
         {
             depth++;
             Intersection its;
-            //no intersection
-            if (!scene->rayIntersect(ray, its))
+            //no intersection (the first one was found by the caller)
+            if (depth == 1 ? !primary : !scene->rayIntersect(ray, its, Intersection::EPosition | Intersection::EShadingFrame))
             {
                 continue;
             }
+            if (depth == 1)
+                its = *primary;
             Color3f Le(0.0f);
             // hit light source
             if (its.mesh->isEmitter())
@@ -79,6 +88,11 @@ public:
         return radiance *= coff;
     }
 
+    uint32_t getPrimaryHitAttributes() const
+    {
+        return Intersection::EPosition | Intersection::EShadingFrame;
+    }
+
     std::string toString() const
     {
         return "WhittedIntegrator[]";